@@ -26,6 +26,7 @@
    */ 
 
 #import	<Foundation/NSAutoreleasePool.h>
+#import	<Foundation/NSBundle.h>
 #import	<Foundation/NSCalendarDate.h>
 #import	<Foundation/NSCharacterSet.h>
 #import	<Foundation/NSData.h>
@@ -72,8 +73,14 @@ typedef struct {
   jmethodID	addBatch;
   jmethodID	clearBatch;
   jmethodID	executeBatch;
+  NSMapTable	*prepared;	// PreparedStatement objects by SQL
+  NSMutableArray	*recent;	// SQL of prepared, least recent first
 } JInfo;
 
+/* The maximum number of PreparedStatement objects cached per connection.
+ */
+#define	PREPARED_MAX	32
+
 
 /* SQLClientJVM shamelessly stolen from JIGS ... written by Nicola Pero
  * and copyright the Free Software Foundation.
@@ -749,6 +756,244 @@ static	int	JDBCVARBINARY = 0;
 static	int	JDBCLONGVARBINARY = 0;
 static	int	JDBCVARCHAR = 0;
 
+/* The helper class used to read rows from a result set in batches, and
+ * the number of rows to read in each batch.
+ */
+static	jclass		fetchClass = 0;
+static	jmethodID	fetchMethod = 0;
+#define	FETCH_ROWS	256
+
+/* Methods of java.sql.PreparedStatement and the constructor of
+ * java.sql.Timestamp, looked up once and used for all connections.
+ */
+static	jmethodID	psAddBatch = 0;
+static	jmethodID	psClearBatch = 0;
+static	jmethodID	psClearParameters = 0;
+static	jmethodID	psClose = 0;
+static	jmethodID	psExecuteBatch = 0;
+static	jmethodID	psExecuteUpdate = 0;
+static	jmethodID	psSetBigDecimal = 0;
+static	jmethodID	psSetBytes = 0;
+static	jmethodID	psSetDouble = 0;
+static	jmethodID	psSetLong = 0;
+static	jmethodID	psSetNull = 0;
+static	jmethodID	psSetString = 0;
+static	jmethodID	psSetTimestamp = 0;
+static	jclass		timestampClass = 0;
+static	jmethodID	timestampInit = 0;
+static	jclass		bigDecimalClass = 0;
+static	jmethodID	bigDecimalInit = 0;
+
+/* Binds the values in info (starting at the second element) to the
+ * parameters of the prepared statement.
+ */
+static void
+bindValues(JNIEnv *env, jobject ps, NSArray *info)
+{
+  NSUInteger	count = [info count];
+  NSUInteger	i;
+
+  for (i = 1; i < count; i++)
+    {
+      id	o = [info objectAtIndex: i];
+      jobject	jo = 0;
+
+      if ([o isKindOfClass: [NSData class]])
+	{
+	  jo = ByteArrayFromNSData(env, o);
+	  JException (env);
+	  (*env)->CallVoidMethod (env, ps, psSetBytes, (jint)i, jo);
+	}
+      else if ([o isKindOfClass: [NSDate class]])
+	{
+	  jlong	ms = (jlong)([o timeIntervalSince1970] * 1000.0);
+
+	  jo = (*env)->NewObject (env, timestampClass, timestampInit, ms);
+	  JException (env);
+	  (*env)->CallVoidMethod (env, ps, psSetTimestamp, (jint)i, jo);
+	}
+      else if ([o isKindOfClass: [NSDecimalNumber class]])
+	{
+	  jstring	js;
+
+	  /* A decimal number reports its type as double, so it must be
+	   * checked for first and passed as a BigDecimal to keep its
+	   * precision.
+	   */
+	  js = JStringFromNSString(env, [o description]);
+	  JException (env);
+	  jo = (*env)->NewObject (env, bigDecimalClass, bigDecimalInit, js);
+	  (*env)->DeleteLocalRef (env, js);
+	  JException (env);
+	  (*env)->CallVoidMethod (env, ps, psSetBigDecimal, (jint)i, jo);
+	}
+      else if ([o isKindOfClass: [NSNumber class]])
+	{
+	  const char	*t = [o objCType];
+
+	  if ('f' == *t || 'd' == *t)
+	    {
+	      (*env)->CallVoidMethod (env, ps, psSetDouble,
+		(jint)i, (jdouble)[o doubleValue]);
+	    }
+	  else
+	    {
+	      (*env)->CallVoidMethod (env, ps, psSetLong,
+		(jint)i, (jlong)[o longLongValue]);
+	    }
+	}
+      else if ([o isKindOfClass: [NSString class]])
+	{
+	  jo = JStringFromNSString(env, o);
+	  JException (env);
+	  (*env)->CallVoidMethod (env, ps, psSetString, (jint)i, jo);
+	}
+      else
+	{
+	  (*env)->CallVoidMethod (env, ps, psSetNull,
+	    (jint)i, (jint)JDBCVARCHAR);
+	}
+      JException (env);
+      if (jo != 0)
+	{
+	  (*env)->DeleteLocalRef (env, jo);
+	}
+    }
+}
+
+/* Reads a batch of rows from the result set using the helper class and
+ * adds records to the array.  Returns the number of rows read (zero at
+ * the end of the results).
+ */
+static int
+fetchBatch(JNIEnv *env, jobject result, jintArray jt, const int *types,
+  NSString **keys, int fieldCount, NSMutableArray *records, id rType)
+{
+  jobjectArray	a;
+  jintArray	ja;
+  jint		rows = 0;
+
+  if ((*env)->PushLocalFrame (env, fieldCount * 2 + 8) < 0)
+    {
+      JExceptionClear(env);
+      [NSException raise: NSInternalInconsistencyException
+		  format: @"No java memory for query"];
+    }
+  NS_DURING
+    {
+      NSMutableData	*md;
+      id		*cells;
+      int		c;
+      int		r;
+
+      a = (*env)->CallStaticObjectMethod (env, fetchClass, fetchMethod,
+	result, jt, (jint)FETCH_ROWS);
+      JException (env);
+      ja = (*env)->GetObjectArrayElement (env, a, 0);
+      JException (env);
+      (*env)->GetIntArrayRegion (env, ja, 0, 1, &rows);
+      JException (env);
+
+      md = [NSMutableData dataWithLength: sizeof(id) * rows * fieldCount];
+      cells = (id*)[md mutableBytes];
+      for (c = 0; c < fieldCount && rows > 0; c++)
+	{
+	  jint		ends[rows];
+	  jobject	data;
+	  jint		start = 0;
+
+	  ja = (*env)->GetObjectArrayElement (env, a, 2 + c * 2);
+	  JException (env);
+	  (*env)->GetIntArrayRegion (env, ja, 0, rows, ends);
+	  JException (env);
+	  data = (*env)->GetObjectArrayElement (env, a, 1 + c * 2);
+	  JException (env);
+
+	  if (types[c] == JDBCBOOLEAN)
+	    {
+	      for (r = 0; r < rows; r++)
+		{
+		  cells[r * fieldCount + c] = (ends[r] < 0) ? (id)null
+		    : (ends[r] > 0 ? @"Y" : @"N");
+		}
+	    }
+	  else if (types[c] == JDBCBLOB)
+	    {
+	      jbyte	*bytes;
+
+	      bytes = (*env)->GetByteArrayElements (env, data, NULL);
+	      if (bytes == NULL)
+		{
+		  JException (env);
+		}
+	      for (r = 0; r < rows; r++)
+		{
+		  if (ends[r] < 0)
+		    {
+		      cells[r * fieldCount + c] = null;
+		    }
+		  else
+		    {
+		      cells[r * fieldCount + c] = [NSData
+			dataWithBytes: bytes + start length: ends[r] - start];
+		      start = ends[r];
+		    }
+		}
+	      (*env)->ReleaseByteArrayElements (env, data, bytes, JNI_ABORT);
+	    }
+	  else
+	    {
+	      const jchar	*chars;
+
+	      chars = (*env)->GetStringChars (env, data, NULL);
+	      if (chars == NULL)
+		{
+		  JException (env);
+		}
+	      for (r = 0; r < rows; r++)
+		{
+		  if (ends[r] < 0)
+		    {
+		      cells[r * fieldCount + c] = null;
+		    }
+		  else
+		    {
+		      id	v;
+
+		      v = [NSString stringWithCharacters: chars + start
+						  length: ends[r] - start];
+		      if (types[c] == JDBCTIMESTAMP)
+			{
+			  v = NSDateFromNSString(v);
+			}
+		      cells[r * fieldCount + c] = v;
+		      start = ends[r];
+		    }
+		}
+	      (*env)->ReleaseStringChars (env, data, chars);
+	    }
+	}
+      for (r = 0; r < rows; r++)
+	{
+	  SQLRecord	*record;
+
+	  record = [rType newWithValues: cells + r * fieldCount
+				   keys: keys
+				  count: fieldCount];
+	  [records addObject: record];
+	  [record release];
+	}
+      (*env)->PopLocalFrame (env, NULL);
+    }
+  NS_HANDLER
+    {
+      (*env)->PopLocalFrame (env, NULL);
+      [localException raise];
+    }
+  NS_ENDHANDLER
+  return rows;
+}
+
 + (void) initialize
 {
   if (future == nil)
@@ -756,6 +1001,8 @@ static	int	JDBCVARCHAR = 0;
       JNIEnv	*env;
       jclass	jc;
       jfieldID	jf;
+      NSString	*classPath;
+      NSString	*path;
 
       future = [NSCalendarDate dateWithString: @"9999-01-01 00:00:00 +0000"
 			       calendarFormat: @"%Y-%m-%d %H:%M:%S %z"
@@ -764,7 +1011,27 @@ static	int	JDBCVARCHAR = 0;
       null = [NSNull null];
       [null retain];
 
-      [SQLClientJVM startVirtualMachineWithClassPath: nil libraryPath: nil];
+      /* Add the bundle resources (containing the helper class) to the
+       * class path.
+       */
+      path = [[NSBundle bundleForClass: self]
+	pathForResource: @"SQLClientJDBCFetch" ofType: @"class"];
+      classPath = [SQLClientJVM defaultClassPath];
+      if (nil != path)
+	{
+	  path = [path stringByDeletingLastPathComponent];
+	  if ([classPath length] > 0)
+	    {
+	      classPath = [NSString stringWithFormat: @"%@:%@",
+		classPath, path];
+	    }
+	  else
+	    {
+	      classPath = path;
+	    }
+	}
+      [SQLClientJVM startVirtualMachineWithClassPath: classPath
+					 libraryPath: nil];
       env = SQLClientJNIEnv();
       jc = (*env)->FindClass(env, "java/sql/Types");
       JException (env);
@@ -814,6 +1081,78 @@ static	int	JDBCVARCHAR = 0;
       JDBCVARCHAR = (*env)->GetStaticIntField(env, jc, jf);
       JException (env);
 
+      jc = (*env)->FindClass(env, "java/sql/PreparedStatement");
+      JException (env);
+      psAddBatch = (*env)->GetMethodID(env, jc, "addBatch", "()V");
+      JException (env);
+      psClearBatch = (*env)->GetMethodID(env, jc, "clearBatch", "()V");
+      JException (env);
+      psClearParameters = (*env)->GetMethodID(env, jc,
+	"clearParameters", "()V");
+      JException (env);
+      psClose = (*env)->GetMethodID(env, jc, "close", "()V");
+      JException (env);
+      psExecuteBatch = (*env)->GetMethodID(env, jc, "executeBatch", "()[I");
+      JException (env);
+      psExecuteUpdate = (*env)->GetMethodID(env, jc, "executeUpdate", "()I");
+      JException (env);
+      psSetBigDecimal = (*env)->GetMethodID(env, jc,
+	"setBigDecimal", "(ILjava/math/BigDecimal;)V");
+      JException (env);
+      psSetBytes = (*env)->GetMethodID(env, jc, "setBytes", "(I[B)V");
+      JException (env);
+      psSetDouble = (*env)->GetMethodID(env, jc, "setDouble", "(ID)V");
+      JException (env);
+      psSetLong = (*env)->GetMethodID(env, jc, "setLong", "(IJ)V");
+      JException (env);
+      psSetNull = (*env)->GetMethodID(env, jc, "setNull", "(II)V");
+      JException (env);
+      psSetString = (*env)->GetMethodID(env, jc,
+	"setString", "(ILjava/lang/String;)V");
+      JException (env);
+      psSetTimestamp = (*env)->GetMethodID(env, jc,
+	"setTimestamp", "(ILjava/sql/Timestamp;)V");
+      JException (env);
+
+      jc = (*env)->FindClass(env, "java/sql/Timestamp");
+      JException (env);
+      timestampInit = (*env)->GetMethodID(env, jc, "<init>", "(J)V");
+      JException (env);
+      timestampClass = (*env)->NewGlobalRef(env, jc);
+      JException (env);
+
+      jc = (*env)->FindClass(env, "java/math/BigDecimal");
+      JException (env);
+      bigDecimalInit = (*env)->GetMethodID(env, jc,
+	"<init>", "(Ljava/lang/String;)V");
+      JException (env);
+      bigDecimalClass = (*env)->NewGlobalRef(env, jc);
+      JException (env);
+
+      /* If the helper class is available we use it to read query
+       * results in batches, otherwise we read each value separately.
+       */
+      jc = (*env)->FindClass(env, "SQLClientJDBCFetch");
+      if (jc == 0)
+	{
+	  JExceptionClear (env);
+	  NSLog(@"SQLClientJDBCFetch class not found ... query results"
+	    @" will be read more slowly.");
+	}
+      else
+	{
+	  fetchMethod = (*env)->GetStaticMethodID(env, jc, "fetch",
+	    "(Ljava/sql/ResultSet;[II)[Ljava/lang/Object;");
+	  if (fetchMethod == 0)
+	    {
+	      JExceptionClear (env);
+	    }
+	  else
+	    {
+	      fetchClass = (*env)->NewGlobalRef(env, jc);
+	    }
+	}
+
     }
 }
 
@@ -831,6 +1170,23 @@ static	int	JDBCVARCHAR = 0;
 
       if ((*env)->PushLocalFrame (env, 16) >= 0)
 	{
+	  if (ji->prepared != 0)
+	    {
+	      NSMapEnumerator	e = NSEnumerateMapTable(ji->prepared);
+	      NSString		*k;
+	      jobject		ps;
+
+	      while (NSNextMapEnumeratorPair(&e, (void**)&k, (void**)&ps))
+		{
+		  (*env)->CallVoidMethod (env, ps, psClose);
+		  JExceptionClear(env);
+		  (*env)->DeleteGlobalRef (env, ps);
+		}
+	      NSEndMapTableEnumeration(&e);
+	      NSFreeMapTable(ji->prepared);
+	      ji->prepared = 0;
+	    }
+	  DESTROY(ji->recent);
 	  if (ji->statement != 0)
 	    {
 	      jc = (*env)->GetObjectClass(env, ji->statement);
@@ -863,6 +1219,97 @@ static	int	JDBCVARCHAR = 0;
   return (JInfo*)extra;
 }
 
+/* Executes a statement with values to be bound to its parameters using
+ * a PreparedStatement from the cache.
+ */
+- (void) _executePrepared: (NSArray*)info env: (JNIEnv*)env
+{
+  NSString	*stmt = [info objectAtIndex: 0];
+  jobject	ps;
+
+  stmt = [stmt stringByReplacingString: @"'?'''?'" withString: @"?"];
+  ps = [self _prepared: stmt env: env];
+  NS_DURING
+    {
+      bindValues(env, ps, info);
+      (*env)->CallIntMethod (env, ps, psExecuteUpdate);
+      JException(env);
+    }
+  NS_HANDLER
+    {
+      /* Don't keep references to the values of a failed statement
+       * in the cached PreparedStatement either.
+       */
+      (*env)->CallVoidMethod (env, ps, psClearParameters);
+      JExceptionClear(env);
+      [localException raise];
+    }
+  NS_ENDHANDLER
+
+  /* Don't keep references to the values once we are done.
+   */
+  (*env)->CallVoidMethod (env, ps, psClearParameters);
+  JException(env);
+}
+
+/* Returns a PreparedStatement for the SQL, from the cache of the
+ * connection if possible.  The least recently used statement is closed
+ * and discarded if the cache is full.
+ */
+- (jobject) _prepared: (NSString*)stmt env: (JNIEnv*)env
+{
+  JInfo		*ji = (JInfo*)extra;
+  jobject	ps;
+
+  if (0 == ji->prepared)
+    {
+      ji->prepared = NSCreateMapTable(NSObjectMapKeyCallBacks,
+	NSNonOwnedPointerMapValueCallBacks, 0);
+      ji->recent = [NSMutableArray new];
+    }
+  ps = (jobject)NSMapGet(ji->prepared, (void*)stmt);
+  if (0 != ps)
+    {
+      NSUInteger	index = [ji->recent indexOfObject: stmt];
+
+      if (index != NSNotFound && index + 1 < [ji->recent count])
+	{
+	  id	k = [[ji->recent objectAtIndex: index] retain];
+
+	  [ji->recent removeObjectAtIndex: index];
+	  [ji->recent addObject: k];
+	  [k release];
+	}
+      return ps;
+    }
+
+  ps = (*env)->CallObjectMethod (env, ji->connection, ji->prepare,
+    JStringFromNSString(env, stmt));
+  JException(env);
+  ps = (*env)->NewGlobalRef(env, ps);
+  JException(env);
+
+  if ([ji->recent count] >= PREPARED_MAX)
+    {
+      id	old = [ji->recent objectAtIndex: 0];
+      jobject	o = (jobject)NSMapGet(ji->prepared, (void*)old);
+
+      if (0 != o)
+	{
+	  (*env)->CallVoidMethod (env, o, psClose);
+	  JExceptionClear(env);
+	  (*env)->DeleteGlobalRef (env, o);
+	}
+      NSMapRemove(ji->prepared, (void*)old);
+      [ji->recent removeObjectAtIndex: 0];
+    }
+  stmt = [[NSString alloc] initWithString: stmt];
+  NSMapInsert(ji->prepared, (void*)stmt, (void*)ps);
+  [ji->recent addObject: stmt];
+  [stmt release];
+  return ps;
+}
+
 - (BOOL) backendConnect
 {
   if (extra == 0)
@@ -1154,9 +1601,6 @@ static	int	JDBCVARCHAR = 0;
 
   NS_DURING
     {
-      jmethodID	jm;
-      jobject	js;
-
       /*
        * Ensure we have a working connection.
        */
@@ -1171,30 +1615,7 @@ static	int	JDBCVARCHAR = 0;
 
       if ([info count] > 1)
         {
-	  unsigned	i;
-	  jclass	jc;
-
-	  stmt = [stmt stringByReplacingString: @"'?'''?'" withString: @"?"];
-
-	  js = (*env)->CallObjectMethod (env, ji->connection, ji->prepare,
-	    JStringFromNSString(env, stmt));
-	  JException(env);
-
-          jc = (*env)->GetObjectClass(env, js);
-	  JException(env);
-	  jm = (*env)->GetMethodID (env, jc, "setBytes", "(I[B)V");
-	  JException(env);
-
-	  for (i = 1; i < [info count]; i++)
-	    {
-	      (*env)->CallIntMethod (env, js, jm, i,
-	        ByteArrayFromNSData(env, [info objectAtIndex: i]));
-	      JException(env);
-	    }
-
-	  jm = (*env)->GetMethodID (env, jc, "executeUpdate", "()I");
-	  JException(env);
-	  (*env)->CallIntMethod (env, js, jm);
+	  [self _executePrepared: info env: env];
 	}
       else
 	{
@@ -1377,107 +1798,147 @@ static	int	JDBCVARCHAR = 0;
 	    "next", "()Z");
 	  JException (env);
 	  records = [[lType alloc] initWithCapacity: 2];
-	  while ((*env)->CallBooleanMethod (env, result, next) == JNI_TRUE)
+	  if (fetchClass != 0)
 	    {
-	      SQLRecord	*record;
-	      id	values[fieldCount];
-	      int	j;
+	      jintArray	jt;
+	      jint	codes[fieldCount];
 
-	      if ((*env)->PushLocalFrame (env, fieldCount * 2) < 0)
+	      /* Read rows in batches using the helper class, telling it
+	       * how to read each column.
+	       */
+	      for (i = 0; i < fieldCount; i++)
 		{
-		  JExceptionClear(env);
-		  [arp release];
-		  [NSException raise: NSInternalInconsistencyException
-			      format: @"No java memory for query"];
+		  if (types[i] == JDBCBOOLEAN)
+		    {
+		      codes[i] = 1;
+		    }
+		  else if (types[i] == JDBCTIMESTAMP)
+		    {
+		      codes[i] = 2;
+		    }
+		  else if (types[i] == JDBCBLOB)
+		    {
+		      codes[i] = 3;
+		    }
+		  else
+		    {
+		      codes[i] = 0;
+		    }
 		}
-	      NS_DURING
+	      jt = (*env)->NewIntArray (env, fieldCount);
+	      JException (env);
+	      (*env)->SetIntArrayRegion (env, jt, 0, fieldCount, codes);
+	      JException (env);
+	      while (fetchBatch(env, result, jt, types, keys, fieldCount,
+		records, rType) == FETCH_ROWS)
 		{
-		  for (j = 0; j < fieldCount; j++)
-		    {
-		      id		v = null;
+		  continue;
+		}
+	    }
+	  else
+	    {
+	      while ((*env)->CallBooleanMethod (env, result, next) == JNI_TRUE)
+		{
+		  SQLRecord	*record;
+		  id	values[fieldCount];
+		  int	j;
 
-		      if (types[j] == JDBCBOOLEAN)
+		  if ((*env)->PushLocalFrame (env, fieldCount * 2) < 0)
+		    {
+		      JExceptionClear(env);
+		      [arp release];
+		      [NSException raise: NSInternalInconsistencyException
+				  format: @"No java memory for query"];
+		    }
+		  NS_DURING
+		    {
+		      for (j = 0; j < fieldCount; j++)
 			{
-			  BOOL	b = NO;
+			  id		v = null;
 
-			  if ((*env)->CallBooleanMethod (env, result,
-			    getBoolean, j+1) == JNI_TRUE)
-			    {
-			      b = YES;
-			    }
-			  JException (env);
-			  if ((*env)->CallBooleanMethod (env, result,
-			    wasNull) == JNI_FALSE)
+			  if (types[j] == JDBCBOOLEAN)
 			    {
-			      if (b == YES)
+			      BOOL	b = NO;
+
+			      if ((*env)->CallBooleanMethod (env, result,
+				getBoolean, j+1) == JNI_TRUE)
 				{
-				  v = @"Y";
+				  b = YES;
 				}
-			      else
+			      JException (env);
+			      if ((*env)->CallBooleanMethod (env, result,
+				wasNull) == JNI_FALSE)
 				{
-				  v = @"N";
+				  if (b == YES)
+				    {
+				      v = @"Y";
+				    }
+				  else
+				    {
+				      v = @"N";
+				    }
 				}
+			      JException (env);
 			    }
-			  JException (env);
-			}
-		      else if (types[j] == JDBCTIMESTAMP)
-			{
-			  jobject	jo;
-
-			  jo = (*env)->CallObjectMethod (env, result,
-			    getString, j+1);
-			  JException (env);
-			  if ((*env)->CallBooleanMethod (env, result,
-			    wasNull) == JNI_FALSE)
+			  else if (types[j] == JDBCTIMESTAMP)
 			    {
-			      v = NSStringFromJString(env, jo);
-			      v = NSDateFromNSString(v);
-			    }
-			  JException (env);
-			}
-		      else if (types[j] == JDBCBLOB)
-			{
-			  jbyteArray	jo;
+			      jobject	jo;
 
-			  jo = (*env)->CallObjectMethod (env, result,
-			    getBytes, j+1);
-			  JException (env);
-			  if ((*env)->CallBooleanMethod (env, result,
-			    wasNull) == JNI_FALSE)
-			    {
-			      v = NSDataFromByteArray(env, jo);
+			      jo = (*env)->CallObjectMethod (env, result,
+				getString, j+1);
+			      JException (env);
+			      if ((*env)->CallBooleanMethod (env, result,
+				wasNull) == JNI_FALSE)
+				{
+				  v = NSStringFromJString(env, jo);
+				  v = NSDateFromNSString(v);
+				}
+			      JException (env);
 			    }
-			  JException (env);
-			}
-		      else
-			{
-			  jobject	jo;
+			  else if (types[j] == JDBCBLOB)
+			    {
+			      jbyteArray	jo;
 
-			  jo = (*env)->CallObjectMethod (env, result,
-			    getString, j+1);
-			  JException (env);
-			  if ((*env)->CallBooleanMethod (env, result,
-			    wasNull) == JNI_FALSE)
+			      jo = (*env)->CallObjectMethod (env, result,
+				getBytes, j+1);
+			      JException (env);
+			      if ((*env)->CallBooleanMethod (env, result,
+				wasNull) == JNI_FALSE)
+				{
+				  v = NSDataFromByteArray(env, jo);
+				}
+			      JException (env);
+			    }
+			  else
 			    {
-			      v = NSStringFromJString(env, jo);
+			      jobject	jo;
+
+			      jo = (*env)->CallObjectMethod (env, result,
+				getString, j+1);
+			      JException (env);
+			      if ((*env)->CallBooleanMethod (env, result,
+				wasNull) == JNI_FALSE)
+				{
+				  v = NSStringFromJString(env, jo);
+				}
+			      JException (env);
 			    }
-			  JException (env);
+			  values[j] = v;
 			}
-		      values[j] = v;
+		      (*env)->PopLocalFrame (env, NULL);
 		    }
-		  (*env)->PopLocalFrame (env, NULL);
-		}
-	      NS_HANDLER
-	        {
-		  (*env)->PopLocalFrame (env, NULL);
-		  [localException raise];
+		  NS_HANDLER
+		    {
+		      (*env)->PopLocalFrame (env, NULL);
+		      [localException raise];
+		    }
+		  NS_ENDHANDLER
+		  record = [rType newWithValues: values
+					   keys: keys
+					  count: fieldCount];
+		  [records addObject: record];
+		  [record release];
 		}
-	      NS_ENDHANDLER
-	      record = [rType newWithValues: values
-				       keys: keys
-				      count: fieldCount];
-	      [records addObject: record];
-	      [record release];
 	    }
 	}
       else
@@ -1581,6 +2042,22 @@ static	int	JDBCVARCHAR = 0;
   [super dealloc];
 }
 
+/* Values are bound as parameters of executed statements only, since
+ * queries are built with -prepareQuery:args: which quotes them into the
+ * statement text.
+ */
+- (BOOL) bindsValue: (id)obj
+{
+  if ([obj isKindOfClass: [NSData class]]
+    || [obj isKindOfClass: [NSDate class]]
+    || [obj isKindOfClass: [NSNumber class]]
+    || [obj isKindOfClass: [NSString class]])
+    {
+      return YES;
+    }
+  return NO;
+}
+
 - (NSString*) quoteString: (NSString *)s
 {
   static NSCharacterSet	*special = nil;
@@ -1687,23 +2164,50 @@ static	int	JDBCVARCHAR = 0;
 }
 @end
 
-@implementation	_JDBCTransaction
-
-- (BOOL) _batchable: (NSArray*)a
+/* Executes the batch of statements added to js (a Statement or a
+ * PreparedStatement) and clears it, raising an exception if any of
+ * the statements failed.  The first statement in the batch is at the
+ * index first in the statements array.
+ */
+static void
+executeBatch(JNIEnv *env, jobject js, jmethodID execute, jmethodID clear,
+  NSArray *statements, unsigned first)
 {
-  unsigned      c = [a count];
-  unsigned      i;
+  jintArray	ja;
+  jint		*array;
+  jsize		count;
+  jsize		i;
+  int		status = 0;
+
+  ja = (*env)->CallObjectMethod(env, js, execute);
+  JException(env);
+  count = (*env)->GetArrayLength(env, ja);
+  array = (*env)->GetIntArrayElements(env, ja, 0);
+  for (i = 0; i < count; i++)
+    {
+      status = array[i];
+      if (status < 0 && status != -2)
+	{
+	  break;
+	}
+    }
+  (*env)->ReleaseIntArrayElements(env, ja, array, 0);
+  (*env)->DeleteLocalRef(env, ja);
 
-  for (i = 0; i < c; i++)
+  (*env)->CallVoidMethod(env, js, clear);
+  JException(env);
+
+  if (i < count)
     {
-      if ([[a objectAtIndex: i] count] > 1)
-        {
-          return NO;
-        }
+      [NSException raise: NSGenericException
+	format: @"Statement %d error %d in batch with %@",
+	(int)(first + i), status,
+	[[statements objectAtIndex: first + i] objectAtIndex: 0]];
     }
-  return YES;
 }
 
+@implementation	_JDBCTransaction
+
 - (void) _merge: (NSMutableArray*)a
 {
   unsigned      c = [_info count];
@@ -1733,6 +2237,7 @@ static	int	JDBCVARCHAR = 0;
       SQLClient         *db;
       BOOL	wrapped = NO;
       BOOL	batched = NO;
+      jobject	prepared = 0;
       JNIEnv	*env;
       JInfo	*ji;
 
@@ -1775,6 +2280,7 @@ static	int	JDBCVARCHAR = 0;
                 format: @"Unable to connect to '%@' to execute transaction %@",
                 [_owner name], self];
             } 
+          ji = [(SQLClientJDBC*)db _backendExtra];
 
 	  _duration = [db durationLogging];
           statements = [NSMutableArray arrayWithCapacity: 100];
@@ -1791,60 +2297,92 @@ static	int	JDBCVARCHAR = 0;
 	      wrapped = YES;
 	    }
 
-	  if (numberOfStatements > 1 && ji->addBatch != 0
-	    && [self _batchable: statements] == YES)
+	  if (numberOfStatements > 1 && ji->addBatch != 0)
 	    {
-	      jintArray	ja;
-	      jint	*array;
-	      int	status = 0;
-
-	      for (statement = 0; statement < numberOfStatements; statement++)
+	      NSString	*template = nil;
+	      unsigned	first = 0;
+
+	      /* Consecutive statements without values go into a batch on
+	       * the plain Statement object, while consecutive statements
+	       * with the same template and bound values go into a batch on
+	       * the PreparedStatement for that template.  Each batch is
+	       * executed when the next statement can't be added to it.
+	       */
+	      for (statement = 0; statement <= numberOfStatements; statement++)
 		{
-		  NSString	*stmt = [statements objectAtIndex: statement];
-		  jobject	js;
+		  NSArray	*info = nil;
+		  NSString	*stmt = nil;
+		  BOOL		bound = NO;
 
-		  js = (*env)->CallObjectMethod(env, ji->statement,
-		    ji->addBatch, JStringFromNSString(env, stmt));
-		  JException(env);
-		  batched = YES;
-		}
-	      ja = (*env)->CallObjectMethod(env, ji->statement,
-		ji->executeBatch);
-	      JException(env);
-	      array = (*env)->GetIntArrayElements(env, ja, 0);
-	      for (statement = 0; statement < numberOfStatements; statement++)
-		{
-		  status = array[statement];
-		  if (status < 0 && status != -2)
+		  if (statement < numberOfStatements)
 		    {
-		      break;
+		      info = [statements objectAtIndex: statement];
+		      stmt = [info objectAtIndex: 0];
+		      if ([info count] > 1)
+			{
+			  bound = YES;
+			  stmt = [stmt stringByReplacingString: @"'?'''?'"
+						    withString: @"?"];
+			}
 		    }
-		}
-	      (*env)->ReleaseIntArrayElements(env, ja, array, 0);
 
-	      batched = NO;
-	      (*env)->CallVoidMethod(env, ji->statement, ji->clearBatch);
-	      JException(env);
+		  if (YES == batched && (nil == info || YES == bound))
+		    {
+		      batched = NO;
+		      executeBatch(env, ji->statement, ji->executeBatch,
+			ji->clearBatch, statements, first);
+		    }
+		  else if (0 != prepared && (NO == bound
+		    || NO == [stmt isEqualToString: template]))
+		    {
+		      jobject	ps = prepared;
 
-	      if (statement != numberOfStatements)
-	        {
-		  [NSException raise: NSGenericException
-		    format: @"Statement %d error %d in batch with %@",
-		    statement, status, [statements objectAtIndex: statement]];
+		      prepared = 0;
+		      executeBatch(env, ps, psExecuteBatch, psClearBatch,
+			statements, first);
+		      (*env)->CallVoidMethod(env, ps, psClearParameters);
+		      JException(env);
+		    }
+		  if (nil == info)
+		    {
+		      break;
+		    }
+
+		  if (YES == bound)
+		    {
+		      if (0 == prepared)
+			{
+			  prepared = [(SQLClientJDBC*)db _prepared: stmt
+							       env: env];
+			  template = stmt;
+			  first = statement;
+			}
+		      bindValues(env, prepared, info);
+		      (*env)->CallVoidMethod(env, prepared, psAddBatch);
+		    }
+		  else
+		    {
+		      if (NO == batched)
+			{
+			  batched = YES;
+			  first = statement;
+			}
+		      (*env)->CallVoidMethod(env, ji->statement,
+			ji->addBatch, JStringFromNSString(env, stmt));
+		    }
+		  JException(env);
 		}
 	    }
 	  else
 	    {
-	      /* Not batchable ... execute as a transaction without
-	       * batching :-(
+	      /* Single statement or no batch support ... execute each
+	       * statement separately.
 	       */
 	      for (statement = 0; statement < numberOfStatements; statement++)
 		{
                   NSArray       *info = [statements objectAtIndex: statement];
 		  NSString	*stmt = [info objectAtIndex: 0];
                   unsigned      c = [info count];
-		  jmethodID	jm;
-		  jobject	js;
 
 		  if (c == 1)
 		    {
@@ -1853,37 +2391,7 @@ static	int	JDBCVARCHAR = 0;
 		    }
 		  else
 		    {
-		      unsigned	i;
-		      jclass	jc;
-
-		      stmt = [stmt stringByReplacingString: @"'?'''?'"
-						withString: @"?"];
-
-		      js = (*env)->CallObjectMethod
-			(env, ji->connection, ji->prepare,
-			JStringFromNSString(env, stmt));
-		      JException(env);
-
-		      jc = (*env)->GetObjectClass(env, js);
-		      JException(env);
-		      jm = (*env)->GetMethodID (env, jc, "setBytes", "(I[B)V");
-		      JException(env);
-
-		      /* Get data arguments for statement.
-		       */
-                      for (i = 1; i < c; i++)
-                        {
-                          NSData	*data;
-
-                          data = [info objectAtIndex: i];
-			  (*env)->CallIntMethod (env, js, jm, i,
-			    ByteArrayFromNSData(env, data));
-			  JException(env);
-			}
-
-		      jm = (*env)->GetMethodID(env, jc, "executeUpdate", "()I");
-		      JException(env);
-		      (*env)->CallIntMethod (env, js, jm);
+		      [(SQLClientJDBC*)db _executePrepared: info env: env];
 		    }
 		  JException(env);
 		}
@@ -1923,6 +2431,13 @@ static	int	JDBCVARCHAR = 0;
 	      (*env)->CallVoidMethod(env, ji->statement, ji->clearBatch);
 	      JException(env);
 	    }
+	  if (prepared != 0)
+	    {
+	      (*env)->CallVoidMethod(env, prepared, psClearBatch);
+	      JExceptionClear(env);
+	      (*env)->CallVoidMethod(env, prepared, psClearParameters);
+	      JExceptionClear(env);
+	    }
 	  (*env)->PopLocalFrame (env, NULL);
 	  [localException raise];
 	}
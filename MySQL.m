@@ -24,10 +24,12 @@
 
    $Date$ $Revision$
    */ 
+#import	<Foundation/NSArray.h>
 #import	<Foundation/NSAutoreleasePool.h>
 #import	<Foundation/NSCalendarDate.h>
 #import	<Foundation/NSData.h>
 #import	<Foundation/NSDate.h>
+#import	<Foundation/NSDictionary.h>
 #import	<Foundation/NSException.h>
 #import	<Foundation/NSLock.h>
 #import	<Foundation/NSMapTable.h>
@@ -46,17 +48,130 @@
 #include	"SQLClient.h"
 
 #include	<mysql/mysql.h>
+#include	<mysql/mysqld_error.h>
 
 
 @interface SQLClientMySQL : SQLClient
 @end
 
+/* A query prepared with its values to be bound as parameters.  The rest
+ * of SQLClient sees the text of the query with the values quoted into it
+ * (that is used for logging and as the key for caching query results),
+ * while the backend executes a prepared statement with parameters so that
+ * it can be reused whatever the values.
+ */
+@interface MySQLQuery : NSString
+{
+@public
+  NSString	*text;	// The query with values quoted into it
+  NSArray	*info;	// The statement with markers, then the values
+}
+@end
+
+@implementation	MySQLQuery
+
+- (unichar) characterAtIndex: (NSUInteger)index
+{
+  return [text characterAtIndex: index];
+}
+
+- (id) copyWithZone: (NSZone*)z
+{
+  return [self retain];
+}
+
+- (void) dealloc
+{
+  [text release];
+  [info release];
+  [super dealloc];
+}
+
+- (NSString*) description
+{
+  return text;
+}
+
+- (void) getCharacters: (unichar*)buffer range: (NSRange)aRange
+{
+  [text getCharacters: buffer range: aRange];
+}
+
+- (NSUInteger) hash
+{
+  return [text hash];
+}
+
+- (BOOL) isEqual: (id)other
+{
+  return [text isEqual: other];
+}
+
+- (NSUInteger) length
+{
+  return [text length];
+}
+
+- (const char*) UTF8String
+{
+  return [text UTF8String];
+}
+
+@end
+
+/* Replaces the text of the query with a proxy to a MySQLQuery holding both
+ * the text and the form with values to be bound (if it has values to be
+ * bound, or if it is the original statement text, which does not change
+ * and is therefore worth preparing).
+ */
+static NSMutableArray *
+boundQuery(NSString *stmt, NSMutableArray *query, NSMutableArray *bound)
+{
+  if (1 == [query count]
+    && ([bound count] > 1 || [[query objectAtIndex: 0] isEqual: stmt]))
+    {
+      MySQLQuery	*q;
+
+      q = (MySQLQuery*)NSAllocateObject([MySQLQuery class], 0,
+	NSDefaultMallocZone());
+      q->text = [SQLClientUnProxyLiteral([query objectAtIndex: 0]) retain];
+      q->info = [bound retain];
+      [query replaceObjectAtIndex: 0 withObject: SQLClientProxyLiteral(q)];
+      [q release];
+    }
+  return query;
+}
+
 @implementation	SQLClientMySQL
 
-#define	connection	((MYSQL*)(self->extra))
+/* A cached prepared statement.  The cached statements form a list from
+ * the most to the least recently used, so that a statement can be moved
+ * to the front, or the least recently used one discarded, directly.
+ */
+typedef struct Prepared {
+  struct Prepared	*prev;	// More recently used
+  struct Prepared	*next;	// Less recently used
+  NSString		*key;	// The SQL (with parameters) prepared
+  MYSQL_STMT		*stmt;
+} Prepared;
+
+typedef struct	{
+  MYSQL		*_connection;
+  NSDictionary	*_options;
+  NSMapTable	*_statements;	// Prepared statements by SQL
+  Prepared	*_head;		// Most recently used statement
+  Prepared	*_tail;		// Least recently used statement
+  NSUInteger	_count;		// Number of prepared statements
+  NSUInteger	_maxStatements;	// Size of prepared statement cache
+} ConnectionInfo;
 
-static NSDate	*future = nil;
-static NSNull	*null = nil;
+#define	cInfo			((ConnectionInfo*)(self->extra))
+#define	connection		(cInfo->_connection)
+#define	options			(cInfo->_options)
+
+static NSDate		*future = nil;
+static NSNull		*null = nil;
+static NSTimeZone	*gmt = nil;
 
 + (void) initialize
 {
@@ -68,7 +183,347 @@ static NSNull	*null = nil;
       [future retain];
       null = [NSNull null];
       [null retain];
+      gmt = [[NSTimeZone timeZoneForSecondsFromGMT: 0] retain];
+    }
+}
+
+/* Returns a new date for the specified GMT date and time, formatted as
+ * dates parsed from the database text protocol are.
+ * The interval since the reference date is calculated directly (using
+ * the proleptic gregorian calendar) since that is far cheaper than having
+ * NSCalendarDate work it out.
+ */
+static NSCalendarDate *
+newDate(int year, int month, int day, int hour, int minute, int second)
+{
+  NSCalendarDate	*d;
+  NSTimeInterval	t;
+  int			era;
+  int			yoe;
+  int			doy;
+  int			doe;
+  long			days;
+
+  /* Treat missing (zero) month and day values as the first.
+   */
+  if (month < 1) month = 1;
+  if (day < 1) day = 1;
+
+  /* Days since 1970-01-01 from the civil date.
+   */
+  year -= (month <= 2) ? 1 : 0;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  days = (long)era * 146097 + doe - 719468;
+
+  /* 978307200 is the number of seconds from 1970 to the reference date.
+   */
+  t = (NSTimeInterval)days * 86400.0
+    + hour * 3600 + minute * 60 + second - 978307200.0;
+  d = [[NSCalendarDate alloc] initWithTimeIntervalSinceReferenceDate: t];
+  [d setTimeZone: gmt];
+  [d setCalendarFormat: @"%Y-%m-%d %H:%M:%S %z"];
+  return d;
+}
+
+/* Parses count decimal digits at *p (advancing the pointer), returning -1
+ * if a non-digit is found.
+ */
+static inline int
+digits(const unsigned char **p, int count)
+{
+  const unsigned char	*ptr = *p;
+  int			val = 0;
+
+  while (count-- > 0)
+    {
+      unsigned char	c = *ptr++;
+
+      if (c < '0' || c > '9')
+	{
+	  return -1;
+	}
+      val = val * 10 + c - '0';
+    }
+  *p = ptr;
+  return val;
+}
+
+/* Converts a two digit year in the way the MySQL server does.
+ */
+static inline int
+fullYear(int y)
+{
+  return (y < 70) ? y + 2000 : y + 1900;
+}
+
+/* Parses a date/time value from the text protocol.  Handles the format
+ * used by DATETIME, DATE and modern TIMESTAMP columns
+ * ('YYYY-MM-DD HH:MM:SS' optionally followed by fractional seconds,
+ * or 'YYYY-MM-DD' alone) and the older compact TIMESTAMP widths.
+ * Returns nil if the value could not be parsed.
+ */
+static NSCalendarDate *
+newDateFromText(const unsigned char *p, int size)
+{
+  int	year;
+  int	month = 1;
+  int	day = 1;
+  int	hour = 0;
+  int	minute = 0;
+  int	second = 0;
+
+  if (size >= 10 && '-' == p[4])
+    {
+      if ((year = digits(&p, 4)) < 0 || *p++ != '-'
+	|| (month = digits(&p, 2)) < 0 || *p++ != '-'
+	|| (day = digits(&p, 2)) < 0)
+	{
+	  return nil;
+	}
+      if (size >= 19)
+	{
+	  if (*p++ != ' '
+	    || (hour = digits(&p, 2)) < 0 || *p++ != ':'
+	    || (minute = digits(&p, 2)) < 0 || *p++ != ':'
+	    || (second = digits(&p, 2)) < 0)
+	    {
+	      return nil;
+	    }
+	}
+    }
+  else
+    {
+      switch (size)
+	{
+	  case 14:
+	    if ((year = digits(&p, 4)) < 0) return nil;
+	    break;
+
+	  case 12:
+	  case 10:
+	  case 8:
+	  case 6:
+	  case 4:
+	  case 2:
+	    if ((year = digits(&p, 2)) < 0) return nil;
+	    year = fullYear(year);
+	    break;
+
+	  default:
+	    return nil;
+	}
+      if (size >= 4 && (month = digits(&p, 2)) < 0) return nil;
+      if (size >= 6 && (day = digits(&p, 2)) < 0) return nil;
+      if (size >= 8 && (hour = digits(&p, 2)) < 0) return nil;
+      if (size >= 10 && (minute = digits(&p, 2)) < 0) return nil;
+      if (size >= 12 && (second = digits(&p, 2)) < 0) return nil;
+    }
+  if (0 == month && 0 == day)
+    {
+      return nil;	// A zero date
+    }
+  return newDate(year, month, day, hour, minute, second);
+}
+
+- (void) _clearStatements
+{
+  while (0 != cInfo->_head)
+    {
+      Prepared	*p = cInfo->_head;
+
+      cInfo->_head = p->next;
+      mysql_stmt_close(p->stmt);
+      [p->key release];
+      free(p);
+    }
+  cInfo->_tail = 0;
+  cInfo->_count = 0;
+  if (0 != cInfo->_statements)
+    {
+      NSResetMapTable(cInfo->_statements);
+    }
+}
+
+/* Removes the prepared statement for the SQL from the cache and closes it.
+ */
+- (void) _forgetPrepared: (NSString*)sql
+{
+  Prepared	*p;
+
+  if (0 == cInfo->_statements)
+    {
+      return;
+    }
+  p = (Prepared*)NSMapGet(cInfo->_statements, (void*)sql);
+  if (0 != p)
+    {
+      NSMapRemove(cInfo->_statements, (void*)p->key);
+      if (0 == p->prev) cInfo->_head = p->next; else p->prev->next = p->next;
+      if (0 == p->next) cInfo->_tail = p->prev; else p->next->prev = p->prev;
+      cInfo->_count--;
+      mysql_stmt_close(p->stmt);
+      [p->key release];
+      free(p);
+    }
+}
+
+/* Returns a prepared statement for the SQL (which has parameters in place
+ * of its values), from the cache if possible.  Returns 0 if the SQL can
+ * not be prepared (in which case the query should be performed using the
+ * text protocol).
+ */
+- (MYSQL_STMT*) _prepared: (NSString*)sql
+{
+  Prepared	*p;
+  MYSQL_STMT	*s;
+  const char	*str;
+
+  if (0 == cInfo->_statements)
+    {
+      cInfo->_statements = NSCreateMapTable(NSObjectMapKeyCallBacks,
+	NSNonOwnedPointerMapValueCallBacks, 0);
+    }
+  p = (Prepared*)NSMapGet(cInfo->_statements, (void*)sql);
+  if (0 != p)
+    {
+      /* Move to the most recently used end of the list.
+       */
+      if (0 != p->prev)
+	{
+	  p->prev->next = p->next;
+	  if (0 == p->next) cInfo->_tail = p->prev; else p->next->prev = p->prev;
+	  p->prev = 0;
+	  p->next = cInfo->_head;
+	  cInfo->_head->prev = p;
+	  cInfo->_head = p;
+	}
+      return p->stmt;
+    }
+
+  str = [sql UTF8String];
+  s = mysql_stmt_init(connection);
+  if (0 == s)
+    {
+      return 0;
+    }
+  if (mysql_stmt_prepare(s, str, strlen(str)) != 0)
+    {
+      if ([self debugging] > 1)
+	{
+	  [self debug: @"Unable to prepare %@: %s", sql, mysql_stmt_error(s)];
+	}
+      mysql_stmt_close(s);
+      return 0;
+    }
+
+  /* Discard the least recently used statement if the cache is full.
+   */
+  if (cInfo->_count >= cInfo->_maxStatements && 0 != cInfo->_tail)
+    {
+      [self _forgetPrepared: cInfo->_tail->key];
+    }
+  p = (Prepared*)malloc(sizeof(Prepared));
+  p->key = [sql copy];
+  p->stmt = s;
+  p->prev = 0;
+  p->next = cInfo->_head;
+  if (0 == cInfo->_head) cInfo->_tail = p; else cInfo->_head->prev = p;
+  cInfo->_head = p;
+  cInfo->_count++;
+  NSMapInsert(cInfo->_statements, (void*)p->key, (void*)p);
+  return s;
+}
+
+/* Binds the values in info (starting at the second element) to the
+ * parameters of the prepared statement and executes it.  Returns the
+ * result of mysql_stmt_execute() (non-zero on failure).
+ */
+- (int) _execute: (MYSQL_STMT*)s with: (NSArray*)info
+{
+  NSUInteger	count = [info count] - 1;
+  MYSQL_BIND	params[count + 1];
+  union {
+    long long	i;
+    double	d;
+  }		nums[count + 1];
+  unsigned long	lengths[count + 1];
+  NSUInteger	i;
+
+  if (0 == count)
+    {
+      return mysql_stmt_execute(s);
+    }
+  memset(params, '\0', sizeof(params));
+  memset(lengths, '\0', sizeof(lengths));
+  for (i = 0; i < count; i++)
+    {
+      id		o = [info objectAtIndex: i + 1];
+      const char	*str = 0;
+
+      params[i].length = &lengths[i];
+      if ([o isKindOfClass: [NSData class]])
+	{
+	  params[i].buffer_type = MYSQL_TYPE_BLOB;
+	  params[i].buffer = (void*)[o bytes];
+	  lengths[i] = [o length];
+	}
+      else if ([o isKindOfClass: [NSDate class]])
+	{
+	  NSString	*q = [self quote: o];
+
+	  /* Dates are passed as the text they are quoted as (without the
+	   * quotes), so they are interpreted exactly as in a statement.
+	   */
+	  q = [q substringWithRange: NSMakeRange(1, [q length] - 2)];
+	  str = [q UTF8String];
+	  params[i].buffer_type = MYSQL_TYPE_STRING;
+	}
+      else if ([o isKindOfClass: [NSDecimalNumber class]])
+	{
+	  str = [[o description] UTF8String];
+	  params[i].buffer_type = MYSQL_TYPE_NEWDECIMAL;
+	}
+      else if ([o isKindOfClass: [NSNumber class]])
+	{
+	  const char	*t = [o objCType];
+
+	  if ('f' == *t || 'd' == *t)
+	    {
+	      nums[i].d = [o doubleValue];
+	      params[i].buffer_type = MYSQL_TYPE_DOUBLE;
+	    }
+	  else if ('Q' == *t || 'L' == *t)
+	    {
+	      nums[i].i = (long long)[o unsignedLongLongValue];
+	      params[i].buffer_type = MYSQL_TYPE_LONGLONG;
+	      params[i].is_unsigned = 1;
+	    }
+	  else
+	    {
+	      nums[i].i = [o longLongValue];
+	      params[i].buffer_type = MYSQL_TYPE_LONGLONG;
+	    }
+	  params[i].buffer = &nums[i];
+	}
+      else
+	{
+	  str = [[o description] UTF8String];
+	  params[i].buffer_type = MYSQL_TYPE_STRING;
+	}
+      if (0 != str)
+	{
+	  params[i].buffer = (void*)str;
+	  lengths[i] = strlen(str);
+	}
     }
+  if (mysql_stmt_bind_param(s, params) != 0)
+    {
+      return 1;
+    }
+  return mysql_stmt_execute(s);
 }
 
 - (BOOL) backendConnect
@@ -104,7 +559,13 @@ static NSNull	*null = nil;
 	      [self debug: @"Connect to '%@' as %@",
 		[self database], [self name]];
 	    }
-	  extra = mysql_init(0);
+	  if (0 == extra)
+	    {
+	      extra = NSZoneMalloc(NSDefaultMallocZone(),
+		sizeof(ConnectionInfo));
+	      memset(extra, '\0', sizeof(ConnectionInfo));
+	    }
+	  connection = mysql_init(0);
 	  mysql_options(connection, MYSQL_SET_CHARSET_NAME, "utf8");
 	  if (mysql_real_connect(connection,
 	    [host UTF8String],
@@ -118,7 +579,7 @@ static NSNull	*null = nil;
 	      [self debug: @"Error connecting to '%@' (%@) - %s",
 		[self name], [self database], mysql_error(connection)];
 	      mysql_close(connection);
-	      extra = 0;
+	      connection = 0;
 	    }
 	  else
 	    {
@@ -155,8 +616,9 @@ static NSNull	*null = nil;
 	    {
 	      [self debug: @"Disconnecting client %@", [self clientName]];
 	    }
+	  [self _clearStatements];
           mysql_close(connection);
-          extra = 0;
+          connection = 0;
 	  if ([self debugging] > 0)
 	    {
 	      [self debug: @"Disconnected client %@", [self clientName]];
@@ -164,7 +626,7 @@ static NSNull	*null = nil;
 	}
       NS_HANDLER
 	{
-	  extra = 0;
+	  connection = 0;
 	  [self debug: @"Error disconnecting from database (%@): %@",
 	    [self clientName], localException];
 	}
@@ -173,6 +635,30 @@ static NSNull	*null = nil;
     }
 }
 
+/* Raises an exception for the current error on the connection, noting
+ * the index of the failed statement (in a multi-statement operation) in
+ * the userInfo of the exception.
+ */
+- (void) _raiseForStatement: (NSInteger)index
+{
+  NSString	*s;
+  NSString	*n;
+  NSDictionary	*u;
+
+  s = [NSString stringWithFormat: @"%s", mysql_error(connection)];
+  if (mysql_ping(connection) == 0)
+    {
+      n = SQLException;
+    }
+  else
+    {
+      n = SQLConnectionException;
+    }
+  u = [NSDictionary dictionaryWithObject: [NSNumber numberWithInteger: index]
+				  forKey: SQLStatementIndexKey];
+  [[NSException exceptionWithName: n reason: s userInfo: u] raise];
+}
+
 - (NSInteger) backendExecute: (NSArray*)info
 {
   NSString	        *stmt;
@@ -192,6 +678,7 @@ static NSNull	*null = nil;
       MYSQL_RES		*result;
       const char	*statement;
       unsigned		length;
+      NSInteger		index;
 
       /*
        * Ensure we have a working connection.
@@ -203,6 +690,41 @@ static NSNull	*null = nil;
 	    [self name], stmt];
 	} 
 
+      /* Statements are sent as text, so values other than data (which
+       * are bound to queries) are quoted into the statement, leaving the
+       * data to be inserted by -insertBLOBs:...
+       */
+      if ([info count] > 1)
+	{
+	  NSArray		*parts;
+	  NSMutableString	*m;
+	  NSMutableArray	*blobs;
+	  NSUInteger		i;
+
+	  parts = [stmt componentsSeparatedByString: @"'?'''?'"];
+	  m = [NSMutableString stringWithString: [parts objectAtIndex: 0]];
+	  blobs = [NSMutableArray arrayWithObject: m];
+	  for (i = 1; i < [parts count]; i++)
+	    {
+	      id	o = (i < [info count]) ? [info objectAtIndex: i] : nil;
+
+	      if (nil == o || [o isKindOfClass: [NSData class]])
+		{
+		  [m appendString: @"'?'''?'"];
+		  if (nil != o)
+		    {
+		      [blobs addObject: o];
+		    }
+		}
+	      else
+		{
+		  [m appendString: [self quote: o]];
+		}
+	      [m appendString: [parts objectAtIndex: i]];
+	    }
+	  info = blobs;
+	  stmt = m;
+	}
       statement = (char*)[stmt UTF8String];
       length = strlen(statement);
       statement = [self insertBLOBs: info
@@ -214,31 +736,36 @@ static NSNull	*null = nil;
 
       if (mysql_real_query(connection, statement, length) != 0)
 	{
-	  NSString	*s;
+	  [self _raiseForStatement: 0];
+	}
 
-	  s = [NSString stringWithFormat: @"%s", mysql_error(connection)];
-	  if (mysql_ping(connection) == 0)
+      /* The statement may contain multiple statements, so we walk through
+       * the results of all of them, discarding any result sets, totalling
+       * the rows modified, and raising an exception identifying the first
+       * statement which fails (the server executes no more after that).
+       */
+      for (index = 0; ; index++)
+	{
+	  result = mysql_store_result(connection);
+	  if (result != 0)
 	    {
-	      [NSException raise: SQLException format: @"%@", s];
+	      mysql_free_result(result);
+	    }
+	  else if (mysql_field_count(connection) == 0)
+	    {
+	      rowCount += mysql_affected_rows(connection);
 	    }
 	  else
 	    {
-	      [NSException raise: SQLConnectionException format: @"%@", s];
+	      [self _raiseForStatement: index];
 	    }
-	}
-      /* See how many rows were modified.
-       */
-      rowCount = mysql_affected_rows(connection);
-      /* discard any results.
-       */
-      result = mysql_store_result(connection);
-      if (result != 0) mysql_free_result(result);
-      while (mysql_more_results(connection))
-	{
-          if (mysql_next_result(connection) == 0)
+	  if (!mysql_more_results(connection))
+	    {
+	      break;
+	    }
+	  if (mysql_next_result(connection) > 0)
 	    {
-              result = mysql_store_result(connection);
-	      if (result != 0) mysql_free_result(result);
+	      [self _raiseForStatement: index + 1];
 	    }
 	}
     }
@@ -289,6 +816,301 @@ static unsigned int trim(char *str)
   return (str - start);
 }
 
+/* Performs a query (info holding the statement with markers in place of
+ * its values, followed by the values) using a (cached) prepared statement
+ * and the binary protocol, so that the values are bound as parameters,
+ * and numeric and date values are returned as NSNumber and NSCalendarDate
+ * objects without being converted to and from text.
+ * Returns nil if the query could not be prepared.
+ */
+- (NSMutableArray*) _binaryQuery: (NSArray*)info
+		      recordType: (id)rtype
+		        listType: (id)ltype
+{
+  NSMutableArray	*records;
+  NSMutableString	*sql;
+  MYSQL_STMT		*s;
+  MYSQL_RES		*meta;
+  MYSQL_FIELD		*fields;
+  my_bool		yes = 1;
+  int			fieldCount;
+  int			i;
+
+  sql = [[[info objectAtIndex: 0] mutableCopy] autorelease];
+  [sql replaceOccurrencesOfString: @"'?'''?'"
+		       withString: @"?"
+			  options: NSLiteralSearch
+			    range: NSMakeRange(0, [sql length])];
+  if (0 == (s = [self _prepared: sql]))
+    {
+      return nil;
+    }
+  if (mysql_stmt_param_count(s) != [info count] - 1)
+    {
+      return nil;	// Marker in a literal?  Use the query text.
+    }
+  if ([self _execute: s with: info] != 0
+    && ER_NEED_REPREPARE == mysql_stmt_errno(s))
+    {
+      /* The tables used by the statement have changed in a way the
+       * server could not handle, so we prepare it again and retry.
+       */
+      [self _forgetPrepared: sql];
+      if (0 == (s = [self _prepared: sql]))
+	{
+	  return nil;
+	}
+      [self _execute: s with: info];
+    }
+  if (mysql_stmt_errno(s) != 0)
+    {
+      NSString	*e;
+
+      e = [NSString stringWithFormat: @"%s", mysql_stmt_error(s)];
+      if (mysql_ping(connection) == 0)
+	{
+	  [NSException raise: SQLException format: @"%@", e];
+	}
+      else
+	{
+	  [NSException raise: SQLConnectionException format: @"%@", e];
+	}
+    }
+  if (0 == (meta = mysql_stmt_result_metadata(s)))
+    {
+      return [[[ltype alloc] initWithCapacity: 0] autorelease];
+    }
+
+  /* Store the result so that the maximum length of each field is known
+   * and we can allocate buffers large enough for all values.
+   */
+  mysql_stmt_attr_set(s, STMT_ATTR_UPDATE_MAX_LENGTH, &yes);
+  if (mysql_stmt_store_result(s) != 0)
+    {
+      NSString	*e;
+
+      e = [NSString stringWithFormat: @"%s", mysql_stmt_error(s)];
+      mysql_free_result(meta);
+      [NSException raise: SQLException format: @"%@", e];
+    }
+  fieldCount = mysql_num_fields(meta);
+  fields = mysql_fetch_fields(meta);
+  records = [[[ltype alloc] initWithCapacity: mysql_stmt_num_rows(s)]
+    autorelease];
+
+  {
+    MYSQL_BIND		bind[fieldCount];
+    unsigned long	lengths[fieldCount];
+    my_bool		nulls[fieldCount];
+    union {
+      long long		i;
+      double		d;
+      MYSQL_TIME	t;
+    }			nums[fieldCount];
+    char		*bufs[fieldCount];
+    NSString		*keys[fieldCount];
+
+    memset(bind, '\0', sizeof(bind));
+    for (i = 0; i < fieldCount; i++)
+      {
+	keys[i] = [NSString stringWithUTF8String: (char*)fields[i].name];
+	bufs[i] = 0;
+	bind[i].length = &lengths[i];
+	bind[i].is_null = &nulls[i];
+	switch (fields[i].type)
+	  {
+	    case MYSQL_TYPE_TINY:
+	    case MYSQL_TYPE_SHORT:
+	    case MYSQL_TYPE_INT24:
+	    case MYSQL_TYPE_LONG:
+	    case MYSQL_TYPE_LONGLONG:
+	    case MYSQL_TYPE_YEAR:
+	      bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+	      bind[i].buffer = &nums[i].i;
+	      bind[i].is_unsigned
+		= (fields[i].flags & UNSIGNED_FLAG) ? 1 : 0;
+	      break;
+
+	    case MYSQL_TYPE_FLOAT:
+	    case MYSQL_TYPE_DOUBLE:
+	      bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
+	      bind[i].buffer = &nums[i].d;
+	      break;
+
+	    case MYSQL_TYPE_TIMESTAMP:
+	    case MYSQL_TYPE_DATETIME:
+	    case MYSQL_TYPE_DATE:
+	      bind[i].buffer_type = fields[i].type;
+	      bind[i].buffer = &nums[i].t;
+	      break;
+
+	    case MYSQL_TYPE_BLOB:
+	    case MYSQL_TYPE_TINY_BLOB:
+	    case MYSQL_TYPE_MEDIUM_BLOB:
+	    case MYSQL_TYPE_LONG_BLOB:
+	      /* As in the text protocol, only blob fields with the binary
+	       * character set produce data.
+	       */
+	      if (63 == fields[i].charsetnr)
+		{
+		  bind[i].buffer_type = MYSQL_TYPE_BLOB;
+		}
+	      else
+		{
+		  bind[i].buffer_type = MYSQL_TYPE_STRING;
+		}
+	      bind[i].buffer_length = fields[i].max_length + 1;
+	      bufs[i] = malloc(bind[i].buffer_length);
+	      bind[i].buffer = bufs[i];
+	      break;
+
+	    default:
+	      bind[i].buffer_type = MYSQL_TYPE_STRING;
+	      bind[i].buffer_length = fields[i].max_length + 1;
+	      bufs[i] = malloc(bind[i].buffer_length);
+	      bind[i].buffer = bufs[i];
+	      break;
+	  }
+      }
+
+    NS_DURING
+      {
+	int	rc;
+
+	if (mysql_stmt_bind_result(s, bind) != 0)
+	  {
+	    [NSException raise: SQLException format: @"%s",
+	      mysql_stmt_error(s)];
+	  }
+	while ((rc = mysql_stmt_fetch(s)) == 0 || MYSQL_DATA_TRUNCATED == rc)
+	  {
+	    SQLRecord	*record;
+	    id		values[fieldCount];
+
+	    if (MYSQL_DATA_TRUNCATED == rc)
+	      {
+		BOOL	rebind = NO;
+
+		/* A value did not fit in its buffer (and a terminating nul
+		 * for a string must fit too), so we enlarge the buffer and
+		 * fetch the value again.
+		 */
+		for (i = 0; i < fieldCount; i++)
+		  {
+		    if (0 != bufs[i] && 0 == nulls[i]
+		      && lengths[i] >= bind[i].buffer_length)
+		      {
+			bind[i].buffer_length = lengths[i] + 1;
+			bufs[i] = realloc(bufs[i], bind[i].buffer_length);
+			bind[i].buffer = bufs[i];
+			if (mysql_stmt_fetch_column(s, &bind[i], i, 0) != 0)
+			  {
+			    [NSException raise: SQLException format: @"%s",
+			      mysql_stmt_error(s)];
+			  }
+			rebind = YES;
+		      }
+		  }
+		if (YES == rebind && mysql_stmt_bind_result(s, bind) != 0)
+		  {
+		    [NSException raise: SQLException format: @"%s",
+		      mysql_stmt_error(s)];
+		  }
+	      }
+
+	    for (i = 0; i < fieldCount; i++)
+	      {
+		id	v = null;
+
+		if (0 == nulls[i])
+		  {
+		    switch (bind[i].buffer_type)
+		      {
+			case MYSQL_TYPE_LONGLONG:
+			  if (bind[i].is_unsigned)
+			    {
+			      v = [NSNumber numberWithUnsignedLongLong:
+				(unsigned long long)nums[i].i];
+			    }
+			  else
+			    {
+			      v = [NSNumber numberWithLongLong: nums[i].i];
+			    }
+			  break;
+
+			case MYSQL_TYPE_DOUBLE:
+			  v = [NSNumber numberWithDouble: nums[i].d];
+			  break;
+
+			case MYSQL_TYPE_TIMESTAMP:
+			case MYSQL_TYPE_DATETIME:
+			case MYSQL_TYPE_DATE:
+			  if (0 == nums[i].t.month && 0 == nums[i].t.day)
+			    {
+			      /* A zero date ... return the text as the
+			       * text protocol does.
+			       */
+			      v = (MYSQL_TYPE_DATE == bind[i].buffer_type)
+				? @"0000-00-00" : @"0000-00-00 00:00:00";
+			    }
+			  else
+			    {
+			      v = [newDate(nums[i].t.year, nums[i].t.month,
+				nums[i].t.day, nums[i].t.hour,
+				nums[i].t.minute, nums[i].t.second)
+				autorelease];
+			    }
+			  break;
+
+			case MYSQL_TYPE_BLOB:
+			  v = [NSData dataWithBytes: bufs[i] length: lengths[i]];
+			  break;
+
+			default:
+			  bufs[i][lengths[i]] = '\0';
+			  if (YES == _shouldTrim)
+			    {
+			      trim(bufs[i]);
+			    }
+			  v = [NSString stringWithUTF8String: bufs[i]];
+			  break;
+		      }
+		  }
+		values[i] = v;
+	      }
+	    record = [rtype newWithValues: values
+				     keys: keys
+				    count: fieldCount];
+	    [records addObject: record];
+	    [record release];
+	  }
+	if (rc != MYSQL_NO_DATA)
+	  {
+	    [NSException raise: SQLException format: @"%s",
+	      mysql_stmt_error(s)];
+	  }
+      }
+    NS_HANDLER
+      {
+	for (i = 0; i < fieldCount; i++)
+	  {
+	    free(bufs[i]);
+	  }
+	mysql_free_result(meta);
+	mysql_stmt_free_result(s);
+	[localException raise];
+      }
+    NS_ENDHANDLER
+    for (i = 0; i < fieldCount; i++)
+      {
+	free(bufs[i]);
+      }
+  }
+  mysql_free_result(meta);
+  mysql_stmt_free_result(s);
+  return records;
+}
+
 - (NSMutableArray*) backendQuery: (NSString*)stmt
 		      recordType: (id)rtype
 		        listType: (id)ltype
@@ -306,6 +1128,7 @@ static unsigned int trim(char *str)
 
   NS_DURING
     {
+      NSString	*sql = stmt;
       char	*statement;
 
       /*
@@ -318,8 +1141,27 @@ static unsigned int trim(char *str)
 	    [self name], stmt];
 	} 
 
+      /* Only a query built by -prepareQuery:args: or -prepareQuery:with:
+       * is prepared (with its values bound as parameters), since other
+       * query text probably has literal values in it and would push
+       * reusable statements out of the cache.
+       */
+      if (YES == SQLClientIsLiteral(stmt))
+	{
+	  sql = SQLClientUnProxyLiteral(stmt);
+	}
+      if (cInfo->_maxStatements > 0 && [sql isKindOfClass: [MySQLQuery class]])
+	{
+	  records = [[self _binaryQuery: ((MySQLQuery*)sql)->info
+			     recordType: rtype
+			       listType: ltype] retain];
+	}
       statement = (char*)[stmt UTF8String];
-      if (mysql_query(connection, statement) == 0
+      if (nil != records)
+	{
+	  ;	// Already done using the binary protocol
+	}
+      else if (mysql_query(connection, statement) == 0
 	&& (result = mysql_store_result(connection)) != 0)
 	{
 	  int	recordCount = mysql_num_rows(result);
@@ -360,57 +1202,24 @@ static unsigned int trim(char *str)
 		      switch (fields[j].type)
 			{
 			  case FIELD_TYPE_TIMESTAMP:
-			    {
-			      char	b[32];
-			      NSString	*f;
-			      NSString	*s;
-
-			      if (size > 14)
-				{
-				  size = 19;
-				  f = @"%Y-%m-%d %H:%M:%S %z";
-				}
-			      else if (size == 14)
-				{
-				  f = @"%Y%m%d%H%M%S %z";
-				}
-			      else if (size == 12)
-				{
-				  f = @"%y%m%d%H%M%S %z";
-				}
-			      else if (size == 10)
-				{
-				  f = @"%y%m%d%H%M %z";
-				}
-			      else if (size == 8)
-				{
-				  f = @"%y%m%d%H %z";
-				}
-			      else if (size == 6)
-				{
-				  f = @"%y%m%d %z";
-				}
-			      else if (size == 4)
-				{
-				  f = @"%y%m %z";
-				}
-			      else 
-				{
-				  f = @"%y %z";
-				}
-			      strncpy(b, (char*)p, size);
-			      strncpy(b + size, (char*)" +0000", 6);
-			      s = [[NSString alloc] initWithBytes: b
-				length: size + 6
-				encoding: NSASCIIStringEncoding];
-			      v = [NSCalendarDate dateWithString: s
-				calendarFormat: f
-				locale: nil];
-			      [v setCalendarFormat: @"%Y-%m-%d %H:%M:%S %z"];
-			      if ([self debugging] > 1)
-				[self debug: @"Parsed '%@' as '%@'\n", s, v];
-			      [s release];
-			    }
+			  case FIELD_TYPE_DATETIME:
+			  case FIELD_TYPE_DATE:
+			    v = [newDateFromText(p, size) autorelease];
+			    if (nil == v)
+			      {
+				/* Not a valid (or a zero) date ...
+				 * return the text unchanged.
+				 */
+				v = [[[NSString alloc] initWithBytes: p
+				  length: size
+				  encoding: NSASCIIStringEncoding]
+				  autorelease];
+			      }
+			    if ([self debugging] > 1)
+			      {
+				[self debug: @"Parsed '%*.*s' as '%@'\n",
+				  size, size, p, v];
+			      }
 			    break;
 
 			  case FIELD_TYPE_TINY:
@@ -499,6 +1308,18 @@ static unsigned int trim(char *str)
   return [records autorelease];
 }
 
+- (BOOL) bindsValue: (id)obj
+{
+  if ([obj isKindOfClass: [NSData class]]
+    || [obj isKindOfClass: [NSDate class]]
+    || [obj isKindOfClass: [NSNumber class]]
+    || [obj isKindOfClass: [NSString class]])
+    {
+      return YES;
+    }
+  return NO;
+}
+
 - (unsigned) copyEscapedBLOB: (NSData*)blob into: (void*)buf
 {
   const unsigned char	*bytes = [blob bytes];
@@ -549,6 +1370,53 @@ static unsigned int trim(char *str)
   return length;
 }
 
+- (void) dealloc
+{
+  if (extra != 0)
+    {
+      if (YES == connected)
+	{
+	  [self disconnect];
+	}
+      [self _clearStatements];
+      if (0 != cInfo->_statements)
+	{
+	  NSFreeMapTable(cInfo->_statements);
+	}
+      RELEASE(options);
+      NSZoneFree(NSDefaultMallocZone(), extra);
+      extra = 0;
+    }
+  [super dealloc];
+}
+
+/* Queries are passed through SQLClient as text, but we also prepare them
+ * with the values to be bound, so that -backendQuery:recordType:listType:
+ * can use (and cache) a prepared statement with parameters.
+ */
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args
+{
+  NSMutableArray	*query;
+  NSMutableArray	*bound;
+  va_list		ap;
+
+  va_copy(ap, args);
+  query = [super prepareQuery: stmt args: args];
+  bound = [self prepare: stmt args: ap];
+  va_end(ap);
+  return boundQuery(stmt, query, bound);
+}
+
+- (NSMutableArray*) prepareQuery: (NSString*)stmt with: (NSDictionary*)values
+{
+  NSMutableArray	*query;
+  NSMutableArray	*bound;
+
+  query = [super prepareQuery: stmt with: values];
+  bound = [self prepare: stmt with: values];
+  return boundQuery(stmt, query, bound);
+}
+
 - (NSString*) quote: (id)obj
 {
   /* MySQL doesn't support timezones ... convert dates to simple GMT.
@@ -582,5 +1450,36 @@ static unsigned int trim(char *str)
   return [super quote: obj];
 }
 
+- (void) setOptions: (NSDictionary*)o
+{
+  id	n;
+
+  if (0 == extra)
+    {
+      extra = NSZoneMalloc(NSDefaultMallocZone(), sizeof(ConnectionInfo));
+      memset(extra, '\0', sizeof(ConnectionInfo));
+    }
+  ASSIGNCOPY(options, o);
+
+  /* The PreparedStatements option gives the number of queries for which
+   * prepared statements (with their values bound as parameters) are
+   * cached and results read using the binary protocol.  Zero (the
+   * default) means queries use the text protocol.
+   */
+  n = [options objectForKey: @"PreparedStatements"];
+  if ([n respondsToSelector: @selector(intValue)] && [n intValue] > 0)
+    {
+      cInfo->_maxStatements = [n intValue];
+    }
+  else
+    {
+      cInfo->_maxStatements = 0;
+    }
+  if (connection != 0)
+    {
+      [self _clearStatements];
+    }
+}
+
 @end
 
@@ -435,6 +435,8 @@ extern NSString	*SQLException;
 extern NSString	*SQLConnectionException;
 extern NSString	*SQLEmptyException;
 extern NSString	*SQLUniqueException;
+extern NSString	*SQLOverloadException;
+extern NSString	*SQLStatementIndexKey;
 
 /**
  * Returns the timestamp of the most recent call to SQLClientTimeNow().
@@ -525,6 +527,11 @@ SQLCLIENT_PRIVATE
   NSTimeInterval	_waitPool;	/** When we blocked for pool access */
   NSTimeInterval	_duration;      /** Duration logging threshold */
   uint64_t		_committed;	/** Count of committed transactions */
+  uint64_t		_queries;	/** Count of queries run */
+  uint64_t		_executes;	/** Count of statements executed */
+  uint64_t		_errors;	/** Count of failed operations */
+  uint64_t		_cacheHits;	/** Queries answered from cache */
+  uint64_t		_cacheMisses;	/** Queries loaded into cache */
   unsigned int		_debugging;	/** The current debugging level */
   GSCache		*_cache;	/** The cache for query results */
   NSThread		*_cacheThread;	/** Thread for cache queries */
@@ -532,6 +539,12 @@ SQLCLIENT_PRIVATE
   NSMapTable            *_observers;    /** Observations of async events */
   NSCountedSet          *_names;        /** Track notification names */
   SQLClientPool         *_pool;         /** The pool of the client (or nil) */
+  NSString              *_active;       /** Statement being executed */
+  NSString              *_activeFingerprint; /** Fingerprint of _active */
+  NSThread              *_activeThread; /** Thread executing statement */
+  NSTimeInterval        _activeStart;   /** When _active was started */
+  unsigned              _activeDepth;   /** Nesting of active statements */
+  volatile int          _activeSpin;    /** Guards the _active... ivars */
   /** Allow for extensions by allocating memory and pointing to it from
    * the _extra ivar.  That way we can avoid binary incompatibility between
    * minor releases.
@@ -539,6 +552,16 @@ SQLCLIENT_PRIVATE
   void			*_extra;
 }
 
+/** Returns a snapshot of the queries and statements currently being
+ * executed by all clients, slowest first.<br />
+ * Each element is a dictionary containing the Thread executing the
+ * statement, the name of the Client, a fingerprint of the Statement
+ * (with literal values replaced by '?') and the Elapsed time (seconds)
+ * since it started.<br />
+ * This is intended for diagnosing stalls without enabling debug logging.
+ */
++ (NSArray*) activeQueries;
+
 /**
  * Returns an array containing all the SQLClient instances .
  */
@@ -559,6 +582,14 @@ SQLCLIENT_PRIVATE
  */
 + (SQLClient*) existingClient: (NSString*)reference;
 
+/** Starts (interval greater than zero and n non-zero) or stops periodic
+ * logging of the n slowest queries and statements currently being
+ * executed (see +activeQueries).  Nothing is logged at times when no
+ * queries are in progress.
+ */
++ (void) setActiveQueryLogging: (NSTimeInterval)interval
+			  count: (NSUInteger)n;
+
 /**
  * Returns the maximum number of simultaneous database connections
  * permitted (set by +setMaxConnections: and defaults to 8) for
@@ -566,6 +597,19 @@ SQLCLIENT_PRIVATE
  */
 + (unsigned int) maxConnections;
 
+/**
+ * Returns the -metrics of all the clients, pools and shards in the array
+ * as a single document in the Prometheus text exposition format.<br />
+ * The HELP and TYPE lines of each metric family appear once, followed
+ * by the samples of every object, so use this method rather than
+ * concatenating the -prometheusMetrics of several objects (which would
+ * repeat each family and be rejected by a scraper).<br />
+ * Pool samples have a 'pool' label, client samples a 'client' label,
+ * and the samples of clients in a pool also have the 'pool' label and
+ * an 'index' label giving the position of the client in the pool.
+ */
++ (NSString*) prometheusMetricsFor: (NSArray*)objects;
+
 /**
  * <p>Use this method to reduce the number of database connections
  * currently active so that it is less than the limit set by the
@@ -824,6 +868,27 @@ SQLCLIENT_PRIVATE
  * ServerType ... is the name of the backend server to be used ... by
  * convention the name of a bundle containing the interface to that backend.
  * If this is missing then 'Postgres' is used.<br />
+ * PreparedStatements ... is the number of compiled statements which the
+ * MySQL and SQLite backends cache (per connection) for reuse.  The MySQL
+ * backend uses none by default (queries use the text protocol, and when
+ * this is set only queries built with -prepareQuery:args: or
+ * -prepareQuery:with: are prepared, with their values bound), while
+ * the SQLite backend caches 32 by default (only statements and queries
+ * with bound values, whose text does not change with the values, are
+ * cached).
+ * Zero disables caching.<br />
+ * JournalMode ... (SQLite backend) the journal mode (eg. WAL) to set
+ * when connecting.<br />
+ * BusyTimeout ... (SQLite backend) the number of milliseconds to wait
+ * for a locked database to become available before failing.<br />
+ * ReadOnly ... (SQLite backend) a boolean saying that the database is to
+ * be opened for reading only.<br />
+ * NoMutex and SharedCache ... (SQLite backend) booleans saying that the
+ * database is to be opened with SQLITE_OPEN_NOMUTEX (access is already
+ * serialised by the client) or SQLITE_OPEN_SHAREDCACHE.<br />
+ * PageSize, MmapSize, CacheSize, Synchronous and TempStore ... (SQLite
+ * backend) values for the page_size, mmap_size, cache_size, synchronous
+ * and temp_store pragmas, set each time the client connects.<br />
  * The database name may be of the format 'name@host:port' when you wish to
  * connect to a database on a different host over the network.
  */
@@ -860,6 +925,23 @@ SQLCLIENT_PRIVATE
  */
 - (NSDate*) lastOperation;
 
+/** Returns a snapshot of the usage counters of the receiver.<br />
+ * The dictionary contains the client's Name and the NSNumber values
+ * Connected, Queries, Statements, Errors, Committed, CacheHits and
+ * CacheMisses.<br />
+ * The counters are read without locking the receiver, so this may be
+ * called while the client is in use (the values are then approximate).
+ * Backends may add counters of their own (eg. the SQLite backend adds
+ * StatementCacheHits and StatementCacheMisses).
+ */
+- (NSDictionary*) metrics;
+
+/** Returns the counters from -metrics in the Prometheus text exposition
+ * format, with the client name as the 'client' label of each sample.<br />
+ * To export several clients or pools use +prometheusMetricsFor:
+ */
+- (NSString*) prometheusMetrics;
+
 /** Compares the receiver with the other client to see which one has been
  * inactive but connected for longest (if they are connected) and returns
  * that instance.<br />
@@ -893,15 +975,44 @@ SQLCLIENT_PRIVATE
  * any NSData objects following.  The NSData objects appear in the
  * statement strings as the marker sequence - <code>'?'''?'</code><br />
  * If the returned array contains a single object, that object is a
- * simple SQL query/statement.
+ * simple SQL query/statement.<br />
+ * NB. Values which the backend binds as parameters (see -bindsValue:)
+ * are also replaced by the marker and follow the statement in the
+ * array, rather than being quoted into it.  For the SQLite and MySQL
+ * backends this means strings, numbers and dates as well as NSData
+ * objects, so code which expects the first element to be the complete
+ * statement text must use -prepareQuery:args: (which always quotes
+ * values other than NSData) or -buildQuery: instead.
  */
 - (NSMutableArray*) prepare: (NSString*)stmt args: (va_list)args;
 
 /** This method is like [SQLClient-prepare:args:]  but takes a dictionary of
- * values to be substituted into the sql string.
+ * values to be substituted into the sql string.  As with -prepare:args:
+ * values which the backend binds as parameters are not quoted into the
+ * statement text.
  */
 - (NSMutableArray*) prepare: (NSString*)stmt with: (NSDictionary*)values;
 
+/** This method is like [SQLClient-prepare:args:] but prepares a query
+ * rather than a statement to be executed.  Since queries are passed to
+ * the backend as text alone, values (other than NSData objects) are
+ * always quoted into the text rather than being passed separately
+ * (see -bindsValue:).<br />
+ * A backend may override this to return text which also carries the
+ * values to be bound when the query is run.  The SQLite and MySQL
+ * backends do this so that queries differing only in their values share
+ * a prepared statement (see the PreparedStatements option).  Values in the select
+ * list should then be given a column alias, since otherwise the column
+ * is named after the parameter rather than the value.
+ */
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args;
+
+/** This method is like [SQLClient-prepare:with:] but prepares a query
+ * (see -prepareQuery:args:).
+ */
+- (NSMutableArray*) prepareQuery: (NSString*)stmt
+                            with: (NSDictionary*)values;
+
 /**
  * <p>Perform arbitrary query <em>which returns values.</em>
  * </p>
@@ -1367,6 +1478,19 @@ SQLCLIENT_PRIVATE
  */
 - (void) backendUnlisten: (NSString*)name;
 
+/** <override-subclass />
+ * Returns YES if the backend wants the value passed to -backendExecute:
+ * separately from the statement text (so that it may be bound as a
+ * parameter) rather than quoted into the statement.  Such values are
+ * replaced by a marker in the statement and appended to the array
+ * passed to -backendExecute: (see -prepare:args:).  This is not used
+ * for queries, which are passed to the backend as text alone (see
+ * -prepareQuery:args:), unless the backend overrides -prepareQuery:args:
+ * to bind query values as well (as the SQLite and MySQL backends do).<br />
+ * The default implementation returns YES for NSData objects only.
+ */
+- (BOOL) bindsValue: (id)obj;
+
 /** <override-subclass />
  * This method is <em>only</em> for the use of the
  * -insertBLOBs:intoStatement:length:withMarker:length:giving:
@@ -1681,13 +1805,108 @@ SQLCLIENT_PRIVATE
  * uncached data will be performed in the cache thread, and for cached
  * (but expired) data, the old (expired) results may be returned ...
  * in which case an asynchronous query to update the cache will be
- * executed as soon as possible in the cache thread.
+ * executed as soon as possible in the cache thread.<br />
+ * Only one query is performed to load any particular item into a cache
+ * at a time:  if other threads need the same (uncached) data while
+ * the query is in progress, they wait for its result rather than
+ * each querying the database (and if the query fails they all raise
+ * the same exception).  This applies to pools sharing the cache too,
+ * and a waiting pool does not tie up a connection while it waits.
  */
 - (NSMutableArray*) cache: (int)seconds
 	      simpleQuery: (SQLLitArg*)stmt
 	       recordType: (id)rtype
 	         listType: (id)ltype;
 
+/**
+ * Calls [SQLClient(Caching)-cache:sharedQuery:recordType:listType:] with
+ * the default record class and array class.
+ */
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt;
+
+/**
+ * Behaves exactly like
+ * [SQLClient(Caching)-cache:simpleQuery:recordType:listType:] except
+ * that, rather than returning a mutable copy of the cached data, the
+ * cached object itself is returned (retained and autoreleased so that
+ * it remains valid even if it is removed from the cache).<br />
+ * This makes a cache hit cost the same no matter how many records were
+ * retrieved, so it is the method to use for large, frequently read
+ * lookup tables.<br />
+ * The result is shared with every other caller which obtains the same
+ * cached data, so neither the returned array nor the records it contains
+ * may be modified.  If you need to change the data, take a mutable copy
+ * of it first.
+ */
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype;
+
+/** Returns the cached object corresponding to the supplied query/statement
+ * (or nil if no such object is cached) without copying it.<br />
+ * As with [SQLClient(Caching)-cache:sharedQuery:recordType:listType:],
+ * the result must not be modified.
+ */
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt;
+
+/**
+ * Removes from the receiver's cache all the items whose queries were
+ * tagged with tag using the -setCacheTags:forQuery: method.  The tagging
+ * is kept, so the results of those queries are removed again by any
+ * later invalidation of the tag.  Returns the number of tagged queries.
+ */
+- (NSUInteger) invalidateCacheTag: (NSString*)tag;
+
+/**
+ * Makes the receiver observe database notifications named tag (see
+ * the [SQLClient(Notifications)-addObserver:selector:name:] method),
+ * calling -invalidateCacheTag: with the notification name whenever one
+ * arrives.<br />
+ * This allows a trigger in the database to NOTIFY the tag of a table
+ * when the table changes, so that results cached from that table can be
+ * given long lifetimes without the risk of using stale data.<br />
+ * As with any other observation this may not be used on a client
+ * from a pool.  To invalidate the cache of a pool, create a separate
+ * client to the same database, set its cache to be the cache of the pool
+ * using -setCache: and use that client to observe the tags.<br />
+ * Use [SQLClient(Notifications)-removeObserver:name:] with the receiver
+ * as observer to stop observing a tag.
+ */
+- (void) observeCacheTag: (NSString*)tag;
+
+/**
+ * Configures proactive (refresh-ahead) updating of cached query results
+ * for all clients and pools.<br />
+ * When window is greater than zero and count is non-zero, count worker
+ * threads are started to re-run cached queries during the last window
+ * seconds of their lifetime, so that frequently used data is replaced
+ * before it expires rather than when a caller finds it has expired.<br />
+ * Only items which have been retrieved from the cache at least minHits
+ * times since they were last loaded are refreshed.  Other items are
+ * left to expire normally.<br />
+ * Queries for items cached via a pool are performed using a connection
+ * from that pool, but a refresh is skipped (and the item left to expire
+ * normally) if no connection is available promptly.<br />
+ * Items are no longer refreshed once the client or pool which loaded
+ * them has been deallocated.<br />
+ * Refresh-ahead is disabled by default, and may be disabled again by
+ * setting a window of zero or a thread count of zero.
+ */
++ (void) setCacheRefreshAhead: (NSTimeInterval)window
+		  minimumHits: (NSUInteger)minHits
+		      threads: (NSUInteger)count;
+
+/**
+ * Tags the cached results of stmt in the receiver's cache with each of
+ * the strings in the tags array (typically the names of the tables the
+ * query reads from), so that a later -invalidateCacheTag: for any of
+ * those tags removes the results from the cache.<br />
+ * The tags persist for as long as the cache, and may be set before or
+ * after the results are cached.
+ */
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt;
+
 /**
  * Sets the cache to be used by the receiver for storing the results of
  * requests made through it.<br />
@@ -1713,6 +1932,11 @@ SQLCLIENT_PRIVATE
 
 typedef struct _SQLClientPoolItem SQLClientPoolItem;
 
+/** The number of buckets in the histogram of times spent waiting for
+ * clients from a pool (see [SQLClientPool-metrics]).
+ */
+#define SQLClientPoolWaitBuckets        6
+
 /** <p>An SQLClientPool instance may be used to create/control a pool of
  * client objects.  Code may obtain autoreleased proxies to the clients
  * from the pool and use them safe in the knowledge that they won't be
@@ -1758,6 +1982,28 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
   NSTimeInterval        _failWaits;     /** Time waiting for timewouts */
   NSTimeInterval        _purgeAll;      /** Age to purge all connections */
   NSTimeInterval        _purgeMin;      /** Age to purge excess connections */
+  int                   _idleHead;      /** Newest connected free item */
+  int                   _idleTail;      /** Oldest connected free item */
+  int                   _deadHead;      /** Disconnected free items */
+  int                   _freeCount;     /** Number of free items */
+  NSMapTable            *_clients;      /** Maps clients to item indexes */
+  NSMapTable            *_owners;       /** Maps threads to shared item lists */
+  NSMutableArray        *_waiters;      /** Queue of waiting threads */
+  NSUInteger            _maxWaiters;    /** Limit on queued threads */
+  NSTimeInterval        _maxWait;       /** Limit on expected wait */
+  NSTimeInterval        _recentDelay;   /** Moving average of delays */
+  uint64_t              _rejected;      /** Count of rejected provisions */
+  int                   _target;        /** Auto-sized connection count */
+  int                   _peakUsed;      /** Most clients in use at once */
+  NSTimeInterval        _autoInterval;  /** Auto-sizing interval */
+  NSTimeInterval        _autoLast;      /** Time of last auto-sizing */
+  uint64_t              _autoImmediate; /** Immediate count at last sizing */
+  uint64_t              _autoWaited;    /** Waits/fails at last sizing */
+  int                   _idleCount;     /** Connected free items */
+  BOOL                  _reaper;        /** Purge in background thread? */
+  NSTimeInterval        _keepalive;     /** Idle time before probing */
+  NSString              *_probe;        /** Keepalive statement */
+  uint64_t              _waitHist[SQLClientPoolWaitBuckets]; /** Waits */
 }
 
 /** Returns the count of currently available connections in the pool.
@@ -1843,6 +2089,21 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
  */
 - (SQLClient*) provideClientBeforeDate: (NSDate*)when exclusive: (BOOL)isLocal;
 
+/** Fetches an (autoreleased) client from the pool as with the
+ * -provideClientBeforeDate:exclusive: method, but using the specified
+ * priority if it is necessary to wait for a client to become available.
+ * <br />
+ * When the pool is exhausted, threads wanting a client are queued, and
+ * each client returned to the pool is handed directly to the thread at
+ * the head of the queue, so clients are provided in the order in which
+ * they were requested.  A request with a higher priority is queued ahead
+ * of all requests with lower priorities.  Other methods use a priority
+ * of zero.
+ */
+- (SQLClient*) provideClientBeforeDate: (NSDate*)when
+			     exclusive: (BOOL)isLocal
+			      priority: (int)priority;
+
 /** Fetches an (autoreleased) client from the pool.<br />
  * This method blocks indefinitely waiting for a client to become
  * available in the pool.<br />
@@ -1851,6 +2112,21 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
  */
 - (SQLClient*) provideClientExclusive;
 
+/** Fetches an (autoreleased) client from the pool without waiting.<br />
+ * Returns nil if no client is free or if another thread is using the
+ * pool lock at the moment (so this never blocks).  If a client has
+ * already been provided to the current thread, that client is returned
+ * as in -provideClient
+ */
+- (SQLClient*) tryProvideClient;
+
+/** Fetches an (autoreleased) client for exclusive use by the current
+ * thread from the pool without waiting.<br />
+ * Returns nil if no client is free or if another thread is using the
+ * pool lock at the moment (so this never blocks).
+ */
+- (SQLClient*) tryProvideClientExclusive;
+
 /**
  * Disconnects the least recently active unused database clients in the
  * pool, but only while there are more than the minimum number of clients
@@ -1901,16 +2177,86 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
 - (void) setMax: (int)maxConnections min: (int)minConnections;
 
 /** Sets the ages (in seconds) after which idle connections are closed in
- * the -purge method. Where there are excess connections (more than the
- * minimum configured connection count) in the pool, minSeconds is used,
- * otherwise allSeconds is used.
+ * the -purge method (or in the background, see -setBackgroundPurge:).
+ * Where there are excess connections (more than the minimum configured
+ * connection count) in the pool, minSeconds is used, otherwise allSeconds
+ * is used.
  */
 - (void) setPurgeAll: (int)allSeconds min: (int)minSeconds;
 
+/** Enables (seconds greater than zero) or disables automatic sizing of
+ * the number of connections the pool keeps open.<br />
+ * When enabled, a background thread examines the pool every seconds.
+ * If more than one in twenty provisions since the last examination had
+ * to wait (or timed out or were rejected), the target number of open
+ * connections is increased (by a quarter, up to the maximum) and idle
+ * clients are connected in advance so that they are ready for use.
+ * Otherwise, if fewer clients than the target were in use at once during
+ * the period, the target is reduced by one (down to the minimum) and
+ * connections which have been idle for longer than the minimum purge
+ * time (see -setPurgeAll:min:) are closed until no more than the target
+ * are open.<br />
+ * Auto-sizing never limits the number of clients which may be provided
+ * (up to the maximum), it only controls how many connections are kept
+ * open while idle.
+ */
+- (void) setAutoSizeInterval: (NSTimeInterval)seconds;
+
+/** Enables or disables purging of idle connections in the background.<br />
+ * When enabled, a background thread closes connections which have been
+ * idle for longer than the purge ages (see -setPurgeAll:min:) about once
+ * a second, so there is no need to call -purge periodically.<br />
+ * Free connections are kept in the order in which they were returned to
+ * the pool, so each purge only examines the connections it closes.
+ */
+- (void) setBackgroundPurge: (BOOL)aFlag;
+
+/** Enables (seconds greater than zero) or disables keepalive probes.<br />
+ * When enabled, a background thread executes stmt (or 'SELECT 1' if stmt
+ * is nil) on each connection which has been idle in the pool for longer
+ * than seconds, at most once every seconds.  A connection whose probe
+ * fails is closed, so that the failure is discovered in the background
+ * rather than by the next thread to use the client.
+ */
+- (void) setKeepalive: (NSTimeInterval)seconds statement: (NSString*)stmt;
+
+/** Returns a snapshot of the usage of the pool for monitoring.<br />
+ * The counters are copied while briefly holding the pool lock, and the
+ * dictionary is built after the lock is released.  It contains:<br />
+ * Name: the pool name.<br />
+ * Immediate, Delayed, TimedOut, Rejected: counts of provisions by
+ * outcome.<br />
+ * WaitBounds: upper bounds (seconds) of the wait time histogram buckets,
+ * WaitBuckets: cumulative counts of provisions which waited no longer
+ * than each bound (the final count being for all provisions) and
+ * WaitSum: the total time spent waiting.<br />
+ * InUse, Idle, Disconnected, Waiting: current counts of clients provided,
+ * of connected and disconnected free clients, and of waiting threads.<br />
+ * Committed, CacheHits, CacheMisses: totals for the clients.<br />
+ * Clients: an array of the [SQLClient-metrics] of each client.
+ */
+- (NSDictionary*) metrics;
+
+/** Returns the information from -metrics in the Prometheus text
+ * exposition format, with the pool name as the 'pool' label.  Since all
+ * the clients in a pool have the same name, the samples for each client
+ * also have an 'index' label giving the position of the client in the
+ * pool.<br />
+ * To export several pools use [SQLClient+prometheusMetricsFor:] which
+ * writes each metric family once.
+ */
+- (NSString*) prometheusMetrics;
+
 /** Returns a string describing the usage of the pool.
  */
 - (NSString*) statistics;
 
+/** Returns the number of connections the pool is currently trying to keep
+ * open (see -setAutoSizeInterval:).  This is the minimum connection count
+ * if auto-sizing is not enabled.
+ */
+- (int) targetConnections;
+
 /** Returns a string describing the status of the pool.
  */
 - (NSString*) status;
@@ -1927,6 +2273,33 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
  */
 - (SQLTransaction*) transaction;
 
+/** Sets limits used to shed load when the database is too slow to keep
+ * up with demand.<br />
+ * If count is non-zero, a request for a client which would have to wait
+ * when count threads are already waiting is rejected.<br />
+ * If seconds is greater than zero, a request for a client which would
+ * have to wait is rejected if the expected wait (a moving average of the
+ * delays in recent provisions, where immediate provisions count as zero)
+ * is greater than seconds.<br />
+ * A rejected request raises SQLOverloadException immediately (rather
+ * than waiting for a client and perhaps timing out), so the application
+ * may fail the work quickly.  Rejections are counted in the statistics.
+ * <br />
+ * Both limits are zero (disabled) by default.
+ */
+- (void) setMaxWaiters: (NSUInteger)count maxWait: (NSTimeInterval)seconds;
+
+/** Returns the number of threads currently queued waiting for a client
+ * to become available in the pool.
+ */
+- (NSUInteger) waiting;
+
+/** Returns an array containing the time (in seconds) for which each of the
+ * threads currently waiting for a client has been waiting, in the order
+ * in which they will be served.
+ */
+- (NSArray*) waitTimes;
+
 @end
 
 /** This category lists the convenience methods provided by a pool instance
@@ -1948,6 +2321,14 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
 	      simpleQuery: (SQLLitArg*)stmt
 	       recordType: (id)rtype
 	         listType: (id)ltype;
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt;
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype;
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt;
+- (NSUInteger) invalidateCacheTag: (NSString*)tag;
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt;
 - (NSMutableArray*) columns: (NSMutableArray*)records;
 - (NSInteger) execute: (NSString*)stmt,...;
 - (NSInteger) execute: (NSString*)stmt with: (NSDictionary*)values;
@@ -1955,6 +2336,9 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
 - (NSMutableArray*) prepare: (NSString*)stmt, ...;
 - (NSMutableArray*) prepare: (NSString*)stmt args: (va_list)args;
 - (NSMutableArray*) prepare: (NSString*)stmt with: (NSDictionary*)values;
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args;
+- (NSMutableArray*) prepareQuery: (NSString*)stmt
+                            with: (NSDictionary*)values;
 - (NSMutableArray*) query: (NSString*)stmt,...;
 - (NSMutableArray*) query: (NSString*)stmt with: (NSDictionary*)values;
 - (SQLRecord*) queryRecord: (NSString*)stmt,...;
@@ -1982,6 +2366,403 @@ typedef struct _SQLClientPoolItem SQLClientPoolItem;
 		       listType: (id)ltype;
 @end
 
+/** <p>An SQLClientRouter instance may be used to split database traffic
+ * between a primary connection pool (which handles all statements that
+ * may modify the database) and one or more replica pools (which handle
+ * queries).
+ * </p>
+ * <p>The router responds to the same convenience methods as a pool, so
+ * code using a pool may generally use a router instead.  Queries (the
+ * -query:,... -simpleQuery: and -cache:query:,... families of methods)
+ * are sent to a replica pool, while statements (the -execute:,... family
+ * of methods) and transactions are sent to the primary pool.
+ * </p>
+ * <p>Replica databases are usually updated asynchronously, so a thread
+ * which has just modified the database may not see its own changes if
+ * it immediately queries a replica.  To avoid that, you may use the
+ * -setStickiness: method to have queries from a thread go to the primary
+ * pool for a while after that thread has modified the database.
+ * </p>
+ * <p>All the pools share the cache of the primary pool, so query results
+ * cached by one pool are available to the others.
+ * </p>
+ * <p>Any other message which a pool understands is passed on to the
+ * primary pool.
+ * </p>
+ */
+@interface	SQLClientRouter : NSObject
+{
+  NSLock                *_lock;         /** Protects round robin index */
+  SQLClientPool         *_primary;      /** Pool for statements */
+  NSArray               *_replicas;     /** Pools for queries */
+  NSString              *_key;          /** Thread dictionary key */
+  NSUInteger            _next;          /** Next replica (round robin) */
+  NSTimeInterval        _sticky;        /** Read-your-writes interval */
+  BOOL                  _leastLoaded;   /** Route by available clients */
+  uint64_t              _reads;         /** Count of routed queries */
+  uint64_t              _writes;        /** Count of routed statements */
+  uint64_t              _stuck;         /** Queries kept on primary */
+}
+
+/** Creates and returns an autoreleased SQLTransaction instance using the
+ * primary pool (see [SQLClientPool-batch:]).
+ */
+- (SQLTransaction*) batch: (BOOL)stopOnFailure;
+
+/** Returns the cache shared by all the pools in the router.
+ */
+- (GSCache*) cache;
+
+/** Initialises the receiver for a single writer and multiple readers
+ * of one database, as is appropriate for an SQLite database in WAL
+ * journal mode (see the JournalMode option of the SQLite backend).<br />
+ * The primary pool has a single client configured as specified by the
+ * reference name in config, and the replica pool has up to count clients
+ * configured in the same way but with the ReadOnly option set.<br />
+ * Unless the configuration says otherwise, the JournalMode option is
+ * set to WAL and the BusyTimeout option to 5000 milliseconds.  The
+ * writer is connected before the readers are created, so that the
+ * database file exists and is in WAL mode when the readers open it.<br />
+ * There is no replication delay (the readers see changes as soon as they
+ * are committed), so there is no need for stickiness.
+ */
+- (id) initWithConfiguration: (NSDictionary*)config
+			name: (NSString*)reference
+		     readers: (int)count;
+
+/** Initialises the receiver to route statements to the primary pool and
+ * queries to the pools in the replicas array.<br />
+ * If replicas is nil or empty, all traffic goes to the primary pool.<br />
+ * All the replica pools are set to use the cache of the primary pool.
+ */
+- (id) initWithPrimary: (SQLClientPool*)primary
+	      replicas: (NSArray*)replicas;
+
+/** Returns a flag indicating whether queries are routed to the replica
+ * with the most available connections (YES) or to each replica in
+ * turn (NO, the default).
+ */
+- (BOOL) leastLoaded;
+
+/** Records the fact that the current thread has modified the database,
+ * so that (if stickiness is set) subsequent queries from the thread are
+ * sent to the primary pool.  This is done automatically by the methods
+ * which execute statements and when transactions created by the
+ * -transaction and -batch: methods are executed, but you may call it
+ * if you modify the database by other means.
+ */
+- (void) noteWrite;
+
+/** Returns the primary pool.
+ */
+- (SQLClientPool*) primary;
+
+/** Returns the pool which would be used to handle a query in the current
+ * thread.  This may be the primary pool if there are no replicas or if
+ * the thread has recently modified the database (see -setStickiness:).
+ */
+- (SQLClientPool*) readPool;
+
+/** Returns the array of replica pools.
+ */
+- (NSArray*) replicas;
+
+/** Sets whether queries are routed to the replica pool with the most
+ * available connections (YES) or to each replica in turn (NO).
+ */
+- (void) setLeastLoaded: (BOOL)aFlag;
+
+/** Sets the interval (in seconds) for which queries from a thread are
+ * sent to the primary pool after that thread modifies the database.<br />
+ * A value of zero or less (the default) disables this read-your-writes
+ * behavior.
+ */
+- (void) setStickiness: (NSTimeInterval)seconds;
+
+/** Returns a string describing the routing of queries and statements.
+ */
+- (NSString*) statistics;
+
+/** Returns the read-your-writes interval set by -setStickiness:
+ */
+- (NSTimeInterval) stickiness;
+
+/** Creates and returns an autoreleased SQLTransaction instance using the
+ * primary pool (see [SQLClientPool-transaction]).
+ */
+- (SQLTransaction*) transaction;
+
+/** Returns the primary pool (see -primary), since that is the pool used
+ * for statements which modify the database.
+ */
+- (SQLClientPool*) writePool;
+
+@end
+
+/** This category lists the convenience methods provided by a router for
+ * proxying messages to the appropriate pool.<br />
+ * The behavior of each method is, of course, as documented for instances
+ * of the [SQLClient] class.
+ */
+@interface      SQLClientRouter (Convenience)
+- (SQLLiteral*) buildQuery: (NSString*)stmt,...;
+- (NSMutableArray*) cacheCheckSimpleQuery: (NSString*)stmt;
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt,...;
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt
+		     with: (NSDictionary*)values;
+- (NSMutableArray*) cache: (int)seconds simpleQuery: (SQLLitArg*)stmt;
+- (NSMutableArray*) cache: (int)seconds
+	      simpleQuery: (SQLLitArg*)stmt
+	       recordType: (id)rtype
+	         listType: (id)ltype;
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt;
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype;
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt;
+- (NSUInteger) invalidateCacheTag: (NSString*)tag;
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt;
+- (NSInteger) execute: (NSString*)stmt,...;
+- (NSInteger) execute: (NSString*)stmt with: (NSDictionary*)values;
+- (NSMutableArray*) prepare: (NSString*)stmt, ...;
+- (NSMutableArray*) query: (NSString*)stmt,...;
+- (NSMutableArray*) query: (NSString*)stmt with: (NSDictionary*)values;
+- (SQLRecord*) queryRecord: (NSString*)stmt,...;
+- (NSString*) queryString: (NSString*)stmt,...;
+- (SQLLiteral*) quotef: (NSString*)fmt, ...;
+- (NSInteger) simpleExecute: (NSArray*)info;
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt;
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+		     recordType: (id)rtype
+		       listType: (id)ltype;
+@end
+
+/** <p>An SQLClientShards instance is a front end to a set of connection
+ * pools (shards) for the same database, which reduces contention on the
+ * pool lock when many threads (on many processor cores) use the database
+ * at once.
+ * </p>
+ * <p>Each thread normally obtains its clients from its own shard (chosen
+ * by a hash of the thread), so threads using different shards do not
+ * compete for the same lock.  If the local shard has no free client, the
+ * other shards are tried (without waiting for their locks) before the
+ * thread waits for a client from its local shard.
+ * </p>
+ * <p>The convenience methods behave as those of [SQLClientPool].  The
+ * configuration methods apply to every shard, and the statistics and
+ * metrics are totals for all the shards.  Any other message is forwarded
+ * to the first shard (and so is only suitable for methods which do not
+ * depend on the shard, such as quoting).  Clients provided by the
+ * receiver may be returned to it or to the pool they belong to.
+ * </p>
+ */
+@interface	SQLClientShards : NSObject
+{
+  NSArray               *_shards;       /** The pools */
+  NSUInteger            _count;         /** Number of pools */
+  void                  *_counts;       /** Provision counts per shard */
+}
+
+/** Returns the total number of available connections in all the shards.
+ */
+- (int) availableConnections;
+
+/** Creates and returns an autoreleased SQLTransaction instance using the
+ * shard for the current thread (see [SQLClientPool-batch:]).
+ */
+- (SQLTransaction*) batch: (BOOL)stopOnFailure;
+
+/** Returns the cache shared by all the shards.
+ */
+- (GSCache*) cache;
+
+/** Initialises the receiver with count pools, each set up as by
+ * [SQLClientPool-initWithConfiguration:name:max:min:].<br />
+ * The maxConnections and minConnections values are for the receiver as
+ * a whole, and are divided between the shards.  Since each shard has a
+ * minimum of at least one connection, the total minimum is never less
+ * than the number of shards (which may exceed minConnections).<br />
+ * A count of zero means one shard per processor.<br />
+ * All the shards use the same cache.
+ */
+- (id) initWithConfiguration: (NSDictionary*)config
+			name: (NSString*)reference
+                         max: (int)maxConnections
+                         min: (int)minConnections
+                      shards: (NSUInteger)count;
+
+/** Returns the pool used by the current thread.
+ */
+- (SQLClientPool*) localShard;
+
+/** Returns the total number of connections the receiver may open.
+ */
+- (int) maxConnections;
+
+/** Returns the metrics of all the shards combined (see
+ * [SQLClientPool-metrics]).  The counts are totals for all the shards,
+ * and the Clients array contains the metrics of the clients of every
+ * shard.
+ */
+- (NSDictionary*) metrics;
+
+/** Returns the total minimum number of connections of the shards.
+ */
+- (int) minConnections;
+
+/** Returns the combined -metrics in the Prometheus text exposition
+ * format (see [SQLClientPool-prometheusMetrics]).
+ */
+- (NSString*) prometheusMetrics;
+
+/** Fetches an (autoreleased) client from the local shard if one is free,
+ * otherwise from any other shard which has one free, otherwise waits
+ * until before the specified date for the local shard to supply one.<br />
+ * Returns nil if no client could be provided in time.
+ */
+- (SQLClient*) provideClientBeforeDate: (NSDate*)when exclusive: (BOOL)isLocal;
+
+/** Calls -provideClientBeforeDate:exclusive: with a nil date and NO.
+ */
+- (SQLClient*) provideClient;
+
+/** Calls -provideClientBeforeDate:exclusive: with a nil date and YES.
+ */
+- (SQLClient*) provideClientExclusive;
+
+/** Purges idle connections in all the shards (see [SQLClientPool-purge]).
+ */
+- (void) purge;
+
+/** Sets the auto-sizing interval for all the shards (see
+ * [SQLClientPool-setAutoSizeInterval:]).
+ */
+- (void) setAutoSizeInterval: (NSTimeInterval)seconds;
+
+/** Enables or disables background purging in all the shards (see
+ * [SQLClientPool-setBackgroundPurge:]).
+ */
+- (void) setBackgroundPurge: (BOOL)aFlag;
+
+/** Sets the cache for all the shards.
+ */
+- (void) setCache: (GSCache*)aCache;
+
+/** Sets the cache thread for all the shards.
+ */
+- (void) setCacheThread: (NSThread*)aThread;
+
+/** Sets the client names for all the shards (see
+ * [SQLClientPool-setClientName:]), adding the index of the shard to s
+ * so that clients in different shards have different names.
+ */
+- (void) setClientName: (NSString*)s;
+
+/** Sets the debugging level for all the shards.
+ */
+- (void) setDebugging: (unsigned int)level;
+
+/** Sets the duration logging threshold for all the shards.
+ */
+- (void) setDurationLogging: (NSTimeInterval)threshold;
+
+/** Sets keepalive probes for all the shards (see
+ * [SQLClientPool-setKeepalive:statement:]).
+ */
+- (void) setKeepalive: (NSTimeInterval)seconds statement: (NSString*)stmt;
+
+/** Sets the total connection limits, dividing them between the shards as
+ * is done on initialisation.
+ */
+- (void) setMax: (int)maxConnections min: (int)minConnections;
+
+/** Sets load shedding limits for all the shards (see
+ * [SQLClientPool-setMaxWaiters:maxWait:]).  Since a thread waits for a
+ * client from its own shard, the count of waiting threads is divided
+ * between the shards.
+ */
+- (void) setMaxWaiters: (NSUInteger)count maxWait: (NSTimeInterval)seconds;
+
+/** Sets the purge ages for all the shards (see
+ * [SQLClientPool-setPurgeAll:min:]).
+ */
+- (void) setPurgeAll: (int)allSeconds min: (int)minSeconds;
+
+/** Returns the array of pools.
+ */
+- (NSArray*) shards;
+
+/** Returns a string describing the use of the shards followed by the
+ * statistics of each pool.
+ */
+- (NSString*) statistics;
+
+/** Returns a string describing the status of each pool.
+ */
+- (NSString*) status;
+
+/** Returns a client to the pool it was provided by.<br />
+ * Returns NO if the client was not provided by one of the shards.
+ */
+- (BOOL) swallowClient: (SQLClient*)client;
+
+/** Creates and returns an autoreleased SQLTransaction instance using the
+ * shard for the current thread (see [SQLClientPool-transaction]).
+ */
+- (SQLTransaction*) transaction;
+
+/** Returns the total number of threads waiting for clients.
+ */
+- (NSUInteger) waiting;
+
+@end
+
+/** This category lists the convenience methods provided by a sharded
+ * pool.  Each obtains a client using -provideClient, performs the
+ * operation, and returns the client.<br />
+ * The behavior of each method is, of course, as documented for instances
+ * of the [SQLClient] class.
+ */
+@interface      SQLClientShards (Convenience)
+- (SQLLiteral*) buildQuery: (NSString*)stmt,...;
+- (SQLLiteral*) buildQuery: (NSString*)stmt with: (NSDictionary*)values;
+- (NSMutableArray*) cacheCheckSimpleQuery: (NSString*)stmt;
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt,...;
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt
+		     with: (NSDictionary*)values;
+- (NSMutableArray*) cache: (int)seconds simpleQuery: (SQLLitArg*)stmt;
+- (NSMutableArray*) cache: (int)seconds
+	      simpleQuery: (SQLLitArg*)stmt
+	       recordType: (id)rtype
+	         listType: (id)ltype;
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt;
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype;
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt;
+- (NSUInteger) invalidateCacheTag: (NSString*)tag;
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt;
+- (NSInteger) execute: (NSString*)stmt,...;
+- (NSInteger) execute: (NSString*)stmt with: (NSDictionary*)values;
+- (NSMutableArray*) prepare: (NSString*)stmt, ...;
+- (NSMutableArray*) query: (NSString*)stmt,...;
+- (NSMutableArray*) query: (NSString*)stmt with: (NSDictionary*)values;
+- (SQLRecord*) queryRecord: (NSString*)stmt,...;
+- (NSString*) queryString: (NSString*)stmt,...;
+- (SQLLiteral*) quotef: (NSString*)fmt, ...;
+- (NSInteger) simpleExecute: (NSArray*)info;
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt;
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+		     recordType: (id)rtype
+		       listType: (id)ltype;
+@end
+
 /**
  * The SQLTransaction transaction class provides a convenient mechanism
  * for grouping together a series of SQL statements to be executed as a
@@ -2004,6 +2785,9 @@ SQLCLIENT_PRIVATE
   BOOL                  _stop;
   BOOL                  _reset;
   NSRecursiveLock       *_lock;
+  NSUInteger            _coalesce;
+  BOOL                  _savepoints;
+  SQLClientRouter       *_router;
 }
 
 /**
@@ -2140,6 +2924,21 @@ SQLCLIENT_PRIVATE
  */
 - (void) reset;
 
+/** Configures the transaction to combine consecutive single row INSERT
+ * statements (for the same table and column list) into multi-row
+ * INSERT statements when it is executed, as long as each combined
+ * statement is no longer than maxLength characters.<br />
+ * This greatly reduces the work done by the database server when large
+ * numbers of rows are inserted, but should only be used where the
+ * server supports the multi-row INSERT ... VALUES (...),(...) syntax.<br />
+ * The statements in the transaction are not altered, so if a batch
+ * fails (see -executeBatchReturningFailures:logExceptions:) the retries
+ * and failures are of the original individual statements.<br />
+ * A maxLength of zero (the default) disables this.<br />
+ * Returns the previous setting.
+ */
+- (NSUInteger) setCoalesceInserts: (NSUInteger)maxLength;
+
 /** Configures the transaction to be reset automatically whenever it is
  * successfully executed.  Normally transaction execution leaves all the
  * statements in the transaction after execution.<br />
@@ -2147,6 +2946,25 @@ SQLCLIENT_PRIVATE
  */
 - (BOOL) setResetOnExecute: (BOOL)aFlag;
 
+/** Configures how a batch is retried after it fails as a whole (see
+ * -executeBatchReturningFailures:logExceptions:).<br />
+ * Normally each statement is then retried in its own transaction, which
+ * costs a round trip to the database server (and a commit) for every
+ * statement in the batch.<br />
+ * If aFlag is YES, the statements are instead retried within a single
+ * transaction, with groups of statements sent in a single operation
+ * between SAVEPOINT and RELEASE SAVEPOINT.  When a group fails, the work
+ * is rolled back to the savepoint and the group is split in half and
+ * each half retried, so isolating the failing statements takes a
+ * number of round trips proportional to the number of failures (times
+ * the logarithm of the batch size) rather than to the batch size.<br />
+ * Subsidiary transactions are treated as single units which either
+ * succeed or fail as a whole in this mode.<br />
+ * This requires a database server which supports savepoints.<br />
+ * Returns the previous setting.
+ */
+- (BOOL) setUseSavepoints: (BOOL)aFlag;
+
 /**
  * Returns the total count of statements in this transaction including
  * those in any subsidiary transactions.  For a count of the statements
@@ -47,6 +47,7 @@
 #import	<Foundation/NSProcessInfo.h>
 #import	<Foundation/NSRunLoop.h>
 #import	<Foundation/NSSet.h>
+#import	<Foundation/NSSortDescriptor.h>
 #import	<Foundation/NSString.h>
 #import	<Foundation/NSThread.h>
 #import	<Foundation/NSTimer.h>
@@ -60,6 +61,7 @@
 #define SQLCLIENT_COMPILE_TIME_QUOTE_CHECK      1
 
 #include	<memory.h>
+#include	<pthread.h>
 
 #include	"SQLClient.h"
 
@@ -417,6 +419,21 @@ quoteBigInteger(int64_t i)
   return [s autorelease];
 }
 
+@interface      SQLClient (CacheFlight)
+- (id) _cacheLoaded: (SQLLitArg*)stmt;
++ (void) _refreshForget: (id)owner;
+@end
+@interface      SQLClient (Metrics)
++ (void) _prometheus: (NSMutableString*)s
+	     clients: (NSArray*)metrics
+	      labels: (NSArray*)labels;
++ (NSString*) _prometheusLabel: (NSString*)value;
+@end
+@interface      SQLClientPool (Private)
++ (void) _prometheus: (NSMutableString*)s
+	       pools: (NSArray*)pools
+	     clients: (NSArray*)clients;
+@end
 @interface      SQLClientPool (Swallow)
 - (BOOL) _swallowClient: (SQLClient*)client explicit: (BOOL)swallowed;
 @end
@@ -424,6 +441,7 @@ quoteBigInteger(int64_t i)
 + (SQLTransaction*) _transactionUsing: (id)clientOrPool
                                 batch: (BOOL)isBatched
                                  stop: (BOOL)stopOnFailure;
+- (void) _setRouter: (SQLClientRouter*)router;
 @end
 
 @implementation SQLLiteral
@@ -572,6 +590,12 @@ quoteBigInteger(int64_t i)
 }
 @end
 
+/* A CacheQuery describes a query whose results are to be loaded into a
+ * cache.  While the load is in progress the instance is also registered
+ * (keyed on the cache and query) in cacheFlights, so that other threads
+ * wanting the same data wait for it to arrive rather than performing
+ * the same query again.
+ */
 @interface	CacheQuery : NSObject
 {
 @public
@@ -579,17 +603,196 @@ quoteBigInteger(int64_t i)
   id		recordType;
   id		listType;
   unsigned	lifetime;
-}
+  GSCache	*cache;		// Not retained: used as part of the key
+  NSCondition	*cond;		// Set when the load is in progress
+  id		result;		// The loaded data
+  NSException	*exception;	// Set if the load failed
+  BOOL		done;		// Set when the load is complete
+  id		owner;		// Client or pool for refresh (not retained)
+  NSTimeInterval expires;	// When the loaded data expires
+  NSUInteger	hits;		// Cache hits since the data was loaded
+  BOOL		refreshing;	// Set while a refresh-ahead is in progress
+  BOOL		onMain;		// Set if the load runs in the main thread
+}
+- (void) land: (id)r exception: (NSException*)e;
+- (id) wait;
 @end
 
+/* Loads currently in progress, protected by flightLock.
+ */
+static NSMutableSet	*cacheFlights = nil;
+static NSLock		*flightLock = nil;
+
+/* Refresh-ahead state, protected by refreshCond.  The refreshMap maps
+ * each cache (not retained) to a dictionary of CacheQuery entries (keyed
+ * by query) recording when each item expires and how often it has been
+ * used.  The map and dictionaries are also protected by refreshLock so
+ * that cache hits (which only read them) need not wait for each other.
+ * The refreshBusy table counts the refreshes in progress for each owner.
+ */
+static NSCondition	*refreshCond = nil;
+static pthread_rwlock_t	refreshLock;
+static NSMapTable	*refreshMap = 0;
+static NSMapTable	*refreshBusy = 0;
+static NSTimeInterval	refreshWindow = 0.0;
+static NSUInteger	refreshHits = 0;
+static NSUInteger	refreshMax = 0;
+static NSUInteger	refreshThreads = 0;
+
 @implementation	CacheQuery
 - (void) dealloc
 {
   [query release];
+  [recordType release];
+  [listType release];
+  [cond release];
+  [result release];
+  [exception release];
   [super dealloc];
 }
+
+- (NSUInteger) hash
+{
+  return [query hash];
+}
+
+- (BOOL) isEqual: (id)other
+{
+  if (other == self)
+    {
+      return YES;
+    }
+  if ([other isKindOfClass: [CacheQuery class]]
+    && ((CacheQuery*)other)->cache == cache
+    && [((CacheQuery*)other)->query isEqual: query])
+    {
+      return YES;
+    }
+  return NO;
+}
+
+/* Called when a load completes (successfully or not) to remove the
+ * receiver from the set of loads in progress and wake any waiters.
+ * Only the first call has any effect.
+ */
+- (void) land: (id)r exception: (NSException*)e
+{
+  [flightLock lock];
+  if ([cacheFlights member: self] == self)
+    {
+      [cacheFlights removeObject: self];
+    }
+  [flightLock unlock];
+  [cond lock];
+  if (NO == done)
+    {
+      ASSIGN(result, r);
+      ASSIGN(exception, e);
+      done = YES;
+      [cond broadcast];
+    }
+  [cond unlock];
+}
+
+/* Waits for a load to complete and returns the result, raising the
+ * exception if the load failed.
+ */
+- (id) wait
+{
+  NSException	*e;
+  id		r;
+
+  [cond lock];
+  while (NO == done)
+    {
+      [cond wait];
+    }
+  r = [[result retain] autorelease];
+  e = [[exception retain] autorelease];
+  [cond unlock];
+  if (nil != e)
+    {
+      [e raise];
+    }
+  return r;
+}
 @end
 
+/* Records a hit on a cached item for refresh-ahead purposes.
+ */
+static void
+refreshNoteHit(GSCache *c, id stmt)
+{
+  if (refreshMax > 0)
+    {
+      NSMutableDictionary	*d;
+
+      pthread_rwlock_rdlock(&refreshLock);
+      d = (NSMutableDictionary*)NSMapGet(refreshMap, (void*)c);
+      if (nil != d)
+	{
+	  CacheQuery	*e = [d objectForKey: stmt];
+
+	  if (nil != e)
+	    {
+	      __sync_fetch_and_add(&e->hits, 1);
+	    }
+	}
+      pthread_rwlock_unlock(&refreshLock);
+    }
+}
+
+/* Records that an item has been loaded into a cache, so that the
+ * refresh-ahead workers know when it will expire.
+ */
+static void
+refreshNoteLoad(GSCache *c, CacheQuery *a, id owner)
+{
+  if (refreshMax > 0 && a->lifetime > 0 && nil != owner)
+    {
+      NSMutableDictionary	*d;
+      CacheQuery		*e;
+
+      pthread_rwlock_wrlock(&refreshLock);
+      d = (NSMutableDictionary*)NSMapGet(refreshMap, (void*)c);
+      if (nil == d)
+	{
+	  d = [NSMutableDictionary new];
+	  NSMapInsert(refreshMap, (void*)c, (void*)d);
+	  [d release];
+	}
+      e = [d objectForKey: a->query];
+      if (nil == e)
+	{
+	  e = [CacheQuery new];
+	  e->query = [a->query copy];
+	  e->cache = c;
+	  [d setObject: e forKey: e->query];
+	  [e release];
+	}
+      ASSIGN(e->recordType, a->recordType);
+      ASSIGN(e->listType, a->listType);
+      e->lifetime = a->lifetime;
+      e->expires = GSTickerTimeNow() + a->lifetime;
+      e->hits = 0;
+      e->owner = owner;
+      pthread_rwlock_unlock(&refreshLock);
+    }
+}
+
+/* Removes the refresh-ahead entries of a cache which is being freed.
+ */
+static void
+refreshForgetCache(GSCache *c)
+{
+  if (0 != refreshMap)
+    {
+      pthread_rwlock_wrlock(&refreshLock);
+      NSMapRemove(refreshMap, (void*)c);
+      pthread_rwlock_unlock(&refreshLock);
+    }
+}
+
 static Class aClass = 0;
 static Class rClass = 0;
 
@@ -1115,6 +1318,17 @@ NSString	*SQLEmptyException = @"SQLEmptyException";
  * field or index.
  */
 NSString	*SQLUniqueException = @"SQLUniqueException";
+/**
+ * Exception for when a pool rejects a request for a client because it
+ * is overloaded.
+ */
+NSString	*SQLOverloadException = @"SQLOverloadException";
+/**
+ * Key in the userInfo of an exception raised by a backend which executed
+ * several statements in a single operation, giving the index of the
+ * statement which failed (counting from zero) as an NSNumber.
+ */
+NSString	*SQLStatementIndexKey = @"SQLStatementIndexKey";
 
 @implementation	SQLClient (Logging)
 
@@ -1182,10 +1396,47 @@ static NSHashTable	*clientsHash = 0;
 static NSMapTable	*clientsMap = 0;
 static NSRecursiveLock	*clientsLock = nil;
 
+/* Each client records the statement it is executing in its own ivars,
+ * guarded by a spin lock in the client (so that starting and ending an
+ * operation never contends with other clients), and +activeQueries walks
+ * the clients to build a snapshot.  The lock here only protects the
+ * settings of the logging thread.
+ */
+#define	ACTIVE_LOCK(C)	\
+  while (__sync_lock_test_and_set(&(C)->_activeSpin, 1)) \
+    { while ((C)->_activeSpin) ; }
+#define	ACTIVE_UNLOCK(C)	__sync_lock_release(&(C)->_activeSpin)
+static NSLock		*activeLock = nil;
+static NSTimeInterval	activeInterval = 0.0;
+static NSUInteger	activeCount = 0;
+static BOOL		activeLogging = NO;
+
 /* Protect changes to the cache used for queries by any individual client.
  */
 static NSRecursiveLock	*cacheLock = nil;
 
+/* Map from each cache (not retained) to a dictionary mapping invalidation
+ * tags to the set of queries whose cached results should be removed when
+ * the tag is invalidated.  Protected by cacheLock.
+ */
+static NSMapTable	*cacheTagMap = 0;
+
+/* The caches created by clients tell us when they are freed, so that
+ * the information we hold about them (keyed on the cache) is removed.
+ */
+@interface	SQLClientCache : GSCache
+@end
+@implementation	SQLClientCache
+- (void) dealloc
+{
+  refreshForgetCache(self);
+  [cacheLock lock];
+  NSMapRemove(cacheTagMap, (void*)self);
+  [cacheLock unlock];
+  [super dealloc];
+}
+@end
+
 static NSString		*beginString = @"begin";
 static NSArray		*beginStatement = nil;
 static NSString		*commitString = @"commit";
@@ -1196,6 +1447,21 @@ static NSArray		*rollbackStatement = nil;
 
 @interface	SQLClient (Private)
 
+/* Records that the receiver has started executing stmt in the current
+ * thread.  Calls may be nested (eg. a statement executed while a query
+ * is in progress), in which case the outermost statement is the one
+ * recorded.
+ */
+- (void) _activeBegin: (NSString*)stmt;
+
+/* Clears the record of the statement the receiver is executing.
+ */
+- (void) _activeEnd;
+
+/* Body of the thread which periodically logs the slowest active queries.
+ */
++ (void) _activeLog: (id)ignored;
+
 /* Takes the timestamp of the end of the operation and checks how long
  * the operation took, returning a string containing a message to be
  * logged if the threshold was exceeded.
@@ -1217,10 +1483,28 @@ static NSArray		*rollbackStatement = nil;
  */
 - (NSRecursiveLock*) _lock;
 
+/** Internal method implementing the caching query methods.  If shared is
+ * YES the cached result is returned directly rather than being copied.
+ */
+- (id) _cache: (int)seconds
+  simpleQuery: (SQLLitArg*)stmt
+   recordType: (id)rtype
+     listType: (id)ltype
+       shared: (BOOL)shared;
+
+/** Internal method called when a database notification for an observed
+ * cache tag arrives (see -observeCacheTag:).
+ */
+- (void) _cacheTagNotified: (NSNotification*)n;
+
 /** Internal method to populate the cache with the result of a query.
  */
 - (void) _populateCache: (CacheQuery*)a;
 
+/** Body of the refresh-ahead worker threads.
+ */
++ (void) _refreshAhead: (id)ignored;
+
 /** Internal method called to record the 'main' thread in which automated
  * cache updates are to be performed.
  */
@@ -1247,6 +1531,148 @@ static NSTimeInterval   abandonAfter = 0.0;
 static unsigned int	maxConnections = 8;
 static int	        poolConnections = 0;
 
+static inline BOOL
+isWordChar(unichar c)
+{
+  return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+    || (c >= '0' && c <= '9') || '_' == c || c > 127) ? YES : NO;
+}
+
+/* Returns a fingerprint of an SQL statement, with quoted strings and
+ * numbers replaced by '?' and runs of white space reduced to a single
+ * space, so that statements differing only in their values look alike.
+ * The result is truncated to a reasonable length for logging.
+ */
+static NSString *
+fingerprint(NSString *stmt)
+{
+  NSUInteger	length = [stmt length];
+  NSUInteger	max = 1000;
+  NSUInteger	pos = 0;
+  NSUInteger	out = 0;
+  unichar	*buf;
+  unichar	*res;
+  NSString	*str;
+
+  if (length > 4 * max)
+    {
+      length = 4 * max;		// Don't bother examining huge statements
+    }
+  buf = (unichar*)malloc(sizeof(unichar) * (length * 2 + 1));
+  res = buf + length;
+  [stmt getCharacters: buf range: NSMakeRange(0, length)];
+  while (pos < length && out < max)
+    {
+      unichar	c = buf[pos++];
+
+      if ('\'' == c)
+	{
+	  while (pos < length)
+	    {
+	      if ('\'' == buf[pos++])
+		{
+		  if (pos < length && '\'' == buf[pos])
+		    {
+		      pos++;	// Escaped quote
+		    }
+		  else
+		    {
+		      break;
+		    }
+		}
+	    }
+	  res[out++] = '?';
+	}
+      else if (c >= '0' && c <= '9'
+	&& (0 == out || NO == isWordChar(res[out - 1])))
+	{
+	  while (pos < length && ((buf[pos] >= '0' && buf[pos] <= '9')
+	    || '.' == buf[pos]))
+	    {
+	      pos++;
+	    }
+	  res[out++] = '?';
+	}
+      else if (' ' == c || '\t' == c || '\r' == c || '\n' == c)
+	{
+	  if (out > 0 && ' ' != res[out - 1])
+	    {
+	      res[out++] = ' ';
+	    }
+	}
+      else
+	{
+	  res[out++] = c;
+	}
+    }
+  str = [NSString stringWithCharacters: res length: out];
+  free(buf);
+  return str;
+}
+
++ (NSArray*) activeQueries
+{
+  NSMutableArray	*a;
+  NSHashEnumerator	e;
+  NSTimeInterval	now = GSTickerTimeNow();
+  SQLClient		*o;
+
+  [SQLClient class];	// Ensure initialisation
+  a = [NSMutableArray array];
+  [clientsLock lock];
+  e = NSEnumerateHashTable(clientsHash);
+  while (nil != (o = (SQLClient*)NSNextHashEnumeratorItem(&e)))
+    {
+      NSString		*stmt;
+      NSString		*fp;
+      NSThread		*thread;
+      NSTimeInterval	elapsed;
+
+      /* Take the statement (retained so that it remains valid when the
+       * client finishes with it) then build its fingerprint outside the
+       * client's spin lock.  The fingerprint is stored in the client so
+       * that a long running statement is only fingerprinted once.
+       */
+      ACTIVE_LOCK(o);
+      stmt = [o->_active retain];
+      fp = [o->_activeFingerprint retain];
+      thread = [o->_activeThread retain];
+      elapsed = now - o->_activeStart;
+      ACTIVE_UNLOCK(o);
+      if (nil == stmt)
+	{
+	  continue;
+	}
+      if (nil == fp)
+	{
+	  fp = [fingerprint(stmt) retain];
+	  ACTIVE_LOCK(o);
+	  if (o->_active == stmt && nil == o->_activeFingerprint)
+	    {
+	      o->_activeFingerprint = [fp retain];
+	    }
+	  ACTIVE_UNLOCK(o);
+	}
+      [a addObject: [NSDictionary dictionaryWithObjectsAndKeys:
+	thread, @"Thread",
+	(nil == o->_name ? @"" : o->_name), @"Client",
+	fp, @"Statement",
+	[NSNumber numberWithDouble: (elapsed > 0.0 ? elapsed : 0.0)],
+	@"Elapsed",
+	nil]];
+      [thread release];
+      [fp release];
+      [stmt release];
+    }
+  NSEndHashTableEnumeration(&e);
+  [clientsLock unlock];
+
+  [a sortUsingDescriptors: [NSArray arrayWithObject:
+    [[[NSSortDescriptor alloc] initWithKey: @"Elapsed" ascending: NO]
+    autorelease]]];
+  return a;
+}
+
 + (NSArray*) allClients
 {
   NSMutableArray	*a;
@@ -1265,6 +1691,27 @@ static int	        poolConnections = 0;
   return a;
 }
 
++ (void) setActiveQueryLogging: (NSTimeInterval)interval
+			  count: (NSUInteger)n
+{
+  [SQLClient class];	// Ensure initialisation
+  if (0 == n)
+    {
+      interval = 0.0;
+    }
+  [activeLock lock];
+  activeInterval = (interval > 0.0) ? interval : 0.0;
+  activeCount = n;
+  if (activeInterval > 0.0 && NO == activeLogging)
+    {
+      activeLogging = YES;
+      [NSThread detachNewThreadSelector: @selector(_activeLog:)
+			       toTarget: SQLClientClass
+			     withObject: nil];
+    }
+  [activeLock unlock];
+}
+
 + (SQLClient*) clientWithConfiguration: (NSDictionary*)config
 				  name: (NSString*)reference
 {
@@ -1356,10 +1803,21 @@ static int	        poolConnections = 0;
       if (0 == clientsHash)
         {
           cacheLock = [NSRecursiveLock new];
+          cacheTagMap = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+            NSObjectMapValueCallBacks, 0);
+          cacheFlights = [NSMutableSet new];
+          flightLock = [NSLock new];
+          refreshCond = [NSCondition new];
+          pthread_rwlock_init(&refreshLock, NULL);
+          refreshMap = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+            NSObjectMapValueCallBacks, 0);
+          refreshBusy = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+            NSIntegerMapValueCallBacks, 0);
           clientsHash = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 0);
           clientsMap = NSCreateMapTable(NSObjectMapKeyCallBacks,
             NSNonRetainedObjectMapValueCallBacks, 0);
           clientsLock = [NSRecursiveLock new];
+          activeLock = [NSLock new];
           beginStatement = [[NSArray arrayWithObject: beginString] retain];
           commitStatement = [[NSArray arrayWithObject: commitString] retain];
           rollbackStatement
@@ -1382,6 +1840,33 @@ static int	        poolConnections = 0;
   return maxConnections;
 }
 
++ (NSString*) prometheusMetricsFor: (NSArray*)objects
+{
+  NSMutableString	*s = [NSMutableString stringWithCapacity: 4096];
+  NSMutableArray	*pools = [NSMutableArray array];
+  NSMutableArray	*clients = [NSMutableArray array];
+  NSEnumerator		*e = [objects objectEnumerator];
+  id			o;
+
+  while (nil != (o = [e nextObject]))
+    {
+      NSDictionary	*d = [o metrics];
+
+      /* Pools (and shards) list their clients, clients do not.
+       */
+      if (nil == [d objectForKey: @"Clients"])
+	{
+	  [clients addObject: d];
+	}
+      else
+	{
+	  [pools addObject: d];
+	}
+    }
+  [SQLClientPool _prometheus: s pools: pools clients: clients];
+  return s;
+}
+
 + (void) purgeConnections: (NSDate*)since
 {
   NSHashEnumerator	e;
@@ -1551,7 +2036,7 @@ static int	        poolConnections = 0;
    * First check validity and concatenate parts of the query.
    */
   va_start (ap, stmt);
-  sql = [[self prepare: stmt args: ap] objectAtIndex: 0];
+  sql = [[self prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   if ([sql length] < 1000)
@@ -1565,7 +2050,7 @@ static int	        poolConnections = 0;
 {
   NSString	*sql = nil;
 
-  sql = [[self prepare: stmt with: values] objectAtIndex: 0];
+  sql = [[self prepareQuery: stmt with: values] objectAtIndex: 0];
 
   if ([sql length] < 1000)
     {
@@ -1653,6 +2138,7 @@ static int	        poolConnections = 0;
 {
   NSNotificationCenter	*nc;
 
+  [SQLClient _refreshForget: self];
   nc = [NSNotificationCenter defaultCenter];
   [nc removeObserver: self];
   if (YES == connected) [self disconnect];
@@ -1975,6 +2461,20 @@ static int	        poolConnections = 0;
   return nil;
 }
 
+- (NSDictionary*) metrics
+{
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+    (nil == _name ? @"" : _name), @"Name",
+    [NSNumber numberWithBool: connected], @"Connected",
+    [NSNumber numberWithUnsignedLongLong: _queries], @"Queries",
+    [NSNumber numberWithUnsignedLongLong: _executes], @"Statements",
+    [NSNumber numberWithUnsignedLongLong: _errors], @"Errors",
+    [NSNumber numberWithUnsignedLongLong: _committed], @"Committed",
+    [NSNumber numberWithUnsignedLongLong: _cacheHits], @"CacheHits",
+    [NSNumber numberWithUnsignedLongLong: _cacheMisses], @"CacheMisses",
+    nil];
+}
+
 - (NSString*) name
 {
   return _name;
@@ -1997,7 +2497,28 @@ static int	        poolConnections = 0;
   return result;
 }
 
-- (NSMutableArray*) prepare: (NSString*)stmt args: (va_list)args
+- (NSString*) prometheusMetrics
+{
+  return [SQLClient prometheusMetricsFor: [NSArray arrayWithObject: self]];
+}
+
+/* Returns YES if obj is to be passed separately from the statement text.
+ * Queries (bind is NO) take only the statement text, so only data is
+ * passed separately (as it always has been) and everything else is
+ * quoted into the text.
+ */
+- (BOOL) _binds: (id)obj bind: (BOOL)bind
+{
+  if (YES == bind)
+    {
+      return [self bindsValue: obj];
+    }
+  return [obj isKindOfClass: [NSData class]];
+}
+
+- (NSMutableArray*) _prepare: (NSString*)stmt
+                        args: (va_list)args
+                        bind: (BOOL)bind
 {
   NSMutableArray	*ma = [NSMutableArray arrayWithCapacity: 2];
   NSString		*tmp = va_arg(args, NSString*);
@@ -2016,14 +2537,17 @@ static int	        poolConnections = 0;
       while (tmp != nil)
         {
           index++;
-          if ([tmp isKindOfClass: [NSData class]] == YES)
+          if ([tmp isKindOfClass: NSStringClass] == NO)
             {
-              [ma addObject: tmp];
-              tmp = @"'?'''?'";	// Marker.
-            }
-          else if ([tmp isKindOfClass: NSStringClass] == NO)
-            {
-              tmp = [self quote: tmp];
+              if ([self _binds: tmp bind: bind] == YES)
+                {
+                  [ma addObject: tmp];
+                  tmp = @"'?'''?'";	// Marker.
+                }
+              else
+                {
+                  tmp = [self quote: tmp];
+                }
             }
           else
             {
@@ -2045,7 +2569,15 @@ static int	        poolConnections = 0;
                     }
                   if (YES == autoquote)
                     {
-                      tmp = [self quote: tmp];
+                      if ([self _binds: tmp bind: bind] == YES)
+                        {
+                          [ma addObject: tmp];
+                          tmp = @"'?'''?'";	// Marker.
+                        }
+                      else
+                        {
+                          tmp = [self quote: tmp];
+                        }
                     }
                 }
             }
@@ -2072,7 +2604,9 @@ static int	        poolConnections = 0;
   return ma;
 }
 
-- (NSMutableArray*) prepare: (NSString*)stmt with: (NSDictionary*)values
+- (NSMutableArray*) _prepare: (NSString*)stmt
+                        with: (NSDictionary*)values
+                        bind: (BOOL)bind
 {
   unsigned int		l = [stmt length];
   NSRange		r;
@@ -2200,14 +2734,17 @@ static int	        poolConnections = 0;
 	    }
 	  else
             {
-              if ([o isKindOfClass: [NSData class]] == YES)
-                {
-                  [ma addObject: o];
-                  v = @"'?'''?'";
-                }
-              else if ([o isKindOfClass: NSStringClass] == NO)
+              if ([o isKindOfClass: NSStringClass] == NO)
                 {
-                  v = [self quote: o];
+                  if ([self _binds: o bind: bind] == YES)
+                    {
+                      [ma addObject: o];
+                      v = @"'?'''?'";
+                    }
+                  else
+                    {
+                      v = [self quote: o];
+                    }
                 }
               else
                 {
@@ -2230,7 +2767,15 @@ static int	        poolConnections = 0;
                         }
                       if (YES == autoquote)
                         {
-                          v = [self quote: o];
+                          if ([self _binds: o bind: bind] == YES)
+                            {
+                              [ma addObject: o];
+                              v = @"'?'''?'";
+                            }
+                          else
+                            {
+                              v = [self quote: o];
+                            }
                         }
                     }
                 }
@@ -2279,6 +2824,26 @@ static int	        poolConnections = 0;
   return ma;
 }
 
+- (NSMutableArray*) prepare: (NSString*)stmt args: (va_list)args
+{
+  return [self _prepare: stmt args: args bind: YES];
+}
+
+- (NSMutableArray*) prepare: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [self _prepare: stmt with: values bind: YES];
+}
+
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args
+{
+  return [self _prepare: stmt args: args bind: NO];
+}
+
+- (NSMutableArray*) prepareQuery: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [self _prepare: stmt with: values bind: NO];
+}
+
 - (NSMutableArray*) query: (NSString*)stmt, ...
 {
   va_list		ap;
@@ -2289,7 +2854,7 @@ static int	        poolConnections = 0;
    * First check validity and concatenate parts of the query.
    */
   va_start (ap, stmt);
-  query = [[self prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   result = [self simpleQuery: query];
@@ -2302,7 +2867,7 @@ static int	        poolConnections = 0;
   NSMutableArray	*result = nil;
   SQLLiteral            *query;
 
-  query = [[self prepare: stmt with: values] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt with: values] objectAtIndex: 0];
 
   result = [self simpleQuery: query];
 
@@ -2865,6 +3430,7 @@ static int	        poolConnections = 0;
       isRollback = YES;
     }
 
+  [self _activeBegin: statement];
   while (NO == done)
     {
       debug = nil;
@@ -2876,6 +3442,7 @@ static int	        poolConnections = 0;
 	  _lastStart = GSTickerTimeNow();
           result = [self backendExecute: info];
           _lastOperation = GSTickerTimeNow();
+          _executes++;
           [_statements addObject: statement];
 	  m = [self _checkDuration: _lastOperation];
           if (m)
@@ -2926,6 +3493,7 @@ static int	        poolConnections = 0;
       NS_HANDLER
         {
           result = -1;
+          _errors++;
           if (NO == _inTransaction)
             {
               [_statements removeAllObjects];
@@ -2944,12 +3512,14 @@ static int	        poolConnections = 0;
             }
           if (done)
             {
+              [self _activeEnd];
               [lock unlock];
               [localException raise];
             }
         }
       NS_ENDHANDLER
     }
+  [self _activeEnd];
   [lock unlock];
   if (nil != debug)
     {
@@ -2988,6 +3558,7 @@ static int	        poolConnections = 0;
 	format: @"Unable to connect to '%@' to run query %@",
 	[self name], stmt];
     }
+  [self _activeBegin: stmt];
   while (NO == done)
     {
       done = YES;
@@ -2998,6 +3569,7 @@ static int	        poolConnections = 0;
           _lastStart = GSTickerTimeNow();
           result = [self backendQuery: stmt recordType: rtype listType: ltype];
           _lastOperation = GSTickerTimeNow();
+          _queries++;
 	  m = [self _checkDuration: _lastOperation];
           if (m)
             {
@@ -3014,6 +3586,7 @@ static int	        poolConnections = 0;
         }
       NS_HANDLER
         {
+          _errors++;
           if (NO == _inTransaction)
             {
               if ([[localException name] isEqual: SQLConnectionException])
@@ -3031,12 +3604,14 @@ static int	        poolConnections = 0;
             }
           if (done)
             {
+              [self _activeEnd];
               [lock unlock];
               [localException raise];
             }
         }
       NS_ENDHANDLER
     }
+  [self _activeEnd];
   [lock unlock];
   if (nil != debug)
     {
@@ -3232,6 +3807,11 @@ static int	        poolConnections = 0;
   return;
 }
 
+- (BOOL) bindsValue: (id)obj
+{
+  return [obj isKindOfClass: [NSData class]];
+}
+
 - (unsigned) copyEscapedBLOB: (NSData*)blob into: (void*)buf
 {
   [NSException raise: NSInternalInconsistencyException
@@ -3309,20 +3889,270 @@ static int	        poolConnections = 0;
 
 @implementation	SQLClient (Private)
 
-- (NSMutableString*) _checkDuration: (NSTimeInterval)end
+- (void) _activeBegin: (NSString*)stmt
 {
-  NSMutableString	*m = nil;
-  NSTimeInterval	ti = _lastStart;
-
-  if (_waitLock > 0.0 && _waitLock < ti)
+  /* The depth is only changed by the thread using the client, so only
+   * the ivars read by +activeQueries need the spin lock.
+   */
+  if (0 == _activeDepth++)
     {
-      ti = _waitLock;
+      NSTimeInterval	now = GSTickerTimeNow();
+      NSThread		*thread = [NSThread currentThread];
+
+      [stmt retain];
+      ACTIVE_LOCK(self);
+      _active = stmt;
+      _activeThread = thread;
+      _activeStart = now;
+      ACTIVE_UNLOCK(self);
     }
-  if (_waitPool > 0.0 && _waitPool < ti)
+}
+
+- (void) _activeEnd
+{
+  if (_activeDepth > 0 && 0 == --_activeDepth)
     {
-      ti = _waitPool;
+      NSString	*old;
+      NSString	*fp;
+
+      ACTIVE_LOCK(self);
+      old = _active;
+      fp = _activeFingerprint;
+      _active = nil;
+      _activeFingerprint = nil;
+      _activeThread = nil;
+      ACTIVE_UNLOCK(self);
+      [fp release];
+      [old release];
     }
-  ti = end - ti;	// Total duration
+}
+
++ (void) _activeLog: (id)ignored
+{
+  for (;;)
+    {
+      NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+      NSTimeInterval	interval;
+      NSUInteger	count;
+      NSArray		*a;
+
+      [activeLock lock];
+      interval = activeInterval;
+      count = activeCount;
+      if (interval <= 0.0)
+	{
+	  activeLogging = NO;
+	}
+      [activeLock unlock];
+      if (interval <= 0.0)
+	{
+	  [arp release];
+	  return;
+	}
+      [NSThread sleepForTimeInterval: interval];
+      a = [self activeQueries];
+      if ([a count] > 0)
+	{
+	  NSMutableString	*m = [NSMutableString string];
+	  NSUInteger		index;
+
+	  if ([a count] > count)
+	    {
+	      a = [a subarrayWithRange: NSMakeRange(0, count)];
+	    }
+	  for (index = 0; index < [a count]; index++)
+	    {
+	      NSDictionary	*d = [a objectAtIndex: index];
+
+	      [m appendFormat: @"  %.3fs '%@' in %@: %@\n",
+		[[d objectForKey: @"Elapsed"] doubleValue],
+		[d objectForKey: @"Client"],
+		[d objectForKey: @"Thread"],
+		[d objectForKey: @"Statement"]];
+	    }
+	  NSLog(@"Slowest active queries:\n%@", m);
+	}
+      [arp release];
+    }
+}
+
+- (id) _cache: (int)seconds
+  simpleQuery: (SQLLitArg*)stmt
+   recordType: (id)rtype
+     listType: (id)ltype
+       shared: (BOOL)shared
+{
+  NSMutableArray	*result;
+  NSMutableDictionary	*md;
+  GSCache		*c;
+  id			toCache;
+  BOOL			cacheHit;
+  BOOL			refresh;
+  NSTimeInterval	start;
+  NSString		*s;
+
+  if (rtype == 0) rtype = rClass;
+  if (ltype == 0) ltype = aClass;
+
+  md = [[NSThread currentThread] threadDictionary];
+  [md setObject: rtype forKey: @"SQLClientRecordType"];
+  [md setObject: ltype forKey: @"SQLClientListType"];
+  start = GSTickerTimeNow();
+  c = [self cache];
+  toCache = nil;
+
+  if (seconds < 0)
+    {
+      seconds = -seconds;
+      refresh = YES;
+      result = nil;
+    }
+  else
+    {
+      refresh = NO;
+      result = [c objectForKey: stmt];
+    }
+
+  if (result == nil)
+    {
+      CacheQuery	*a;
+      CacheQuery	*f;
+
+      cacheHit = NO;
+      _cacheMisses++;
+      a = [CacheQuery new];
+      a->query = [stmt copy];
+      a->recordType = [rtype retain];
+      a->listType = [ltype retain];
+      a->lifetime = seconds;
+      a->cache = c;
+      [a autorelease];
+
+      /* If another thread is already loading this query into the cache
+       * we simply wait for its result.  Otherwise we register our own
+       * load so that any thread arriving while we run the query can
+       * wait for us.  A forced reload (negative lifetime) or a removal
+       * (zero lifetime) always runs the query itself.
+       */
+      f = nil;
+      if (seconds > 0 && NO == refresh)
+	{
+	  [flightLock lock];
+	  f = [[[cacheFlights member: a] retain] autorelease];
+	  if (nil != f && YES == f->onMain && YES == [NSThread isMainThread])
+	    {
+	      /* The other load is waiting for this thread to perform it,
+	       * so we must run the query ourselves rather than wait.
+	       */
+	      f = nil;
+	    }
+	  else if (nil == f)
+	    {
+	      a->cond = [NSCondition new];
+	      a->onMain = (nil == _cacheThread) ? NO : YES;
+	      [cacheFlights addObject: a];
+	    }
+	  [flightLock unlock];
+	}
+
+      if (nil != f)
+	{
+	  result = [f wait];
+	}
+      else
+	{
+	  NS_DURING
+	    {
+	      if (_cacheThread == nil)
+		{
+		  [self _populateCache: a];
+		}
+	      else
+		{
+		  /* Not really an asynchronous query because we wait until
+		   * it's done in order to have a result we can return.
+		   */
+		  [self performSelectorOnMainThread: @selector(_populateCache:)
+					 withObject: a
+				      waitUntilDone: YES
+					      modes: queryModes];
+		}
+	    }
+	  NS_HANDLER
+	    {
+	      if (nil != a->cond)
+		{
+		  [a land: nil exception: localException];
+		}
+	      [localException raise];
+	    }
+	  NS_ENDHANDLER
+	  result = [c objectForKey: stmt];
+	}
+    }
+  else
+    {
+      cacheHit = YES;
+      _cacheHits++;
+      refreshNoteHit(c, stmt);
+    }
+
+  if (seconds == 0)
+    {
+      // We have been told to remove the existing cached item.
+      [c setObject: nil forKey: stmt lifetime: seconds];
+      toCache = nil;
+    }
+
+  if (toCache != nil)
+    {
+      // We have a newly retrieved object ... cache it.
+      [c setObject: toCache forKey: stmt lifetime: seconds];
+    }
+
+  if (result != nil)
+    {
+      if (YES == shared)
+	{
+	  /* Return the original cached data ... the caller has promised
+	   * not to modify it, so we only need to make sure it survives
+	   * removal from the cache while the caller is using it.
+	   */
+	  result = [[result retain] autorelease];
+	}
+      else
+	{
+	  /*
+	   * Return an autoreleased copy ... not the original cached data.
+	   */
+	  result = [[result mutableCopy] autorelease];
+	}
+    }
+
+  _lastStart = start;
+  _lastOperation = GSTickerTimeNow();
+  if ((s = [self _checkDuration: _lastOperation]) != nil)
+    {
+      [self debug: @"%@ for cache-%@ query %@",
+	s, (YES == cacheHit) ? @"hit" : @"miss", stmt];
+    }
+  return result;
+}
+
+- (NSMutableString*) _checkDuration: (NSTimeInterval)end
+{
+  NSMutableString	*m = nil;
+  NSTimeInterval	ti = _lastStart;
+
+  if (_waitLock > 0.0 && _waitLock < ti)
+    {
+      ti = _waitLock;
+    }
+  if (_waitPool > 0.0 && _waitPool < ti)
+    {
+      ti = _waitPool;
+    }
+  ti = end - ti;	// Total duration
 
   if (ti > _duration)
     {
@@ -3557,13 +4387,200 @@ static int	        poolConnections = 0;
   GSCache	*cache;
   id		result;
 
-  result = [self simpleQuery: a->query
-                  recordType: a->recordType
-                    listType: a->listType];
-  cache = [self cache];
-  [cache setObject: result
-	    forKey: a->query
-	  lifetime: a->lifetime];
+  NS_DURING
+    {
+      result = [self simpleQuery: a->query
+		      recordType: a->recordType
+			listType: a->listType];
+      cache = [self cache];
+      [cache setObject: result
+		forKey: a->query
+	      lifetime: a->lifetime];
+    }
+  NS_HANDLER
+    {
+      if (nil != a->cond)
+	{
+	  [a land: nil exception: localException];
+	}
+      [localException raise];
+    }
+  NS_ENDHANDLER
+  if (nil != a->cond)
+    {
+      [a land: result exception: nil];
+    }
+  refreshNoteLoad(cache, a, (nil == _pool) ? (id)self : (id)_pool);
+}
+
++ (void) _refreshAhead: (id)ignored
+{
+  for (;;)
+    {
+      NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+      CacheQuery	*e = nil;
+      SQLClient		*db = nil;
+      id		owner;
+
+      [refreshCond lock];
+      while (nil == e)
+	{
+	  NSMutableArray	*cold = nil;
+	  NSMapEnumerator	me;
+	  NSMutableDictionary	*d;
+	  GSCache		*c;
+	  NSTimeInterval	now;
+
+	  if (refreshThreads > refreshMax)
+	    {
+	      refreshThreads--;
+	      [refreshCond unlock];
+	      [arp release];
+	      return;
+	    }
+
+	  /* Find an item which is due to expire within the refresh-ahead
+	   * window.  If it has been used often enough we refresh it,
+	   * otherwise we stop tracking it and let it expire normally.
+	   */
+	  now = GSTickerTimeNow();
+	  pthread_rwlock_rdlock(&refreshLock);
+	  me = NSEnumerateMapTable(refreshMap);
+	  while (nil == e && NSNextMapEnumeratorPair(&me, (void**)&c, (void**)&d))
+	    {
+	      NSEnumerator	*de = [d objectEnumerator];
+	      CacheQuery	*q;
+
+	      while (nil == e && nil != (q = [de nextObject]))
+		{
+		  if (NO == q->refreshing && q->expires - refreshWindow <= now)
+		    {
+		      if (q->hits >= refreshHits && q->expires > now)
+			{
+			  e = q;
+			}
+		      else
+			{
+			  if (nil == cold)
+			    {
+			      cold = [NSMutableArray array];
+			    }
+			  [cold addObject: q];
+			}
+		    }
+		}
+	    }
+	  NSEndMapTableEnumeration(&me);
+	  pthread_rwlock_unlock(&refreshLock);
+	  if (nil != cold)
+	    {
+	      pthread_rwlock_wrlock(&refreshLock);
+	    }
+	  while ([cold count] > 0)
+	    {
+	      CacheQuery	*q = [cold lastObject];
+
+	      /* The item may have been reloaded after we looked at it.
+	       */
+	      d = (NSMutableDictionary*)NSMapGet(refreshMap, (void*)q->cache);
+	      if ([d objectForKey: q->query] == q
+		&& q->expires - refreshWindow <= now)
+		{
+		  [d removeObjectForKey: q->query];
+		  if ([d count] == 0)
+		    {
+		      NSMapRemove(refreshMap, (void*)q->cache);
+		    }
+		}
+	      [cold removeLastObject];
+	    }
+	  if (nil != cold)
+	    {
+	      pthread_rwlock_unlock(&refreshLock);
+	    }
+	  if (nil == e)
+	    {
+	      [refreshCond waitUntilDate:
+		[NSDate dateWithTimeIntervalSinceNow: 1.0]];
+	    }
+	}
+      /* The owner is not retained, but it waits in -dealloc until we
+       * have finished using it (see +_refreshForget:).
+       */
+      e->refreshing = YES;
+      [[e retain] autorelease];
+      owner = e->owner;
+      NSMapInsert(refreshBusy, (void*)owner,
+	(void*)((NSInteger)NSMapGet(refreshBusy, (void*)owner) + 1));
+      [refreshCond unlock];
+
+      NS_DURING
+	{
+	  if ([owner isKindOfClass: [SQLClientPool class]])
+	    {
+	      /* Don't wait long for a pooled connection ... if the pool is
+	       * busy the item will simply be refreshed when it expires.
+	       */
+	      db = [owner provideClientBeforeDate:
+		[NSDate dateWithTimeIntervalSinceNow: 0.1]];
+	      if (nil != db)
+		{
+		  [db _populateCache: e];
+		  [owner swallowClient: db];
+		  db = nil;
+		}
+	    }
+	  else
+	    {
+	      [owner _populateCache: e];
+	    }
+	}
+      NS_HANDLER
+	{
+	  if (nil != db)
+	    {
+	      [owner swallowClient: db];
+	    }
+	  NSLog(@"SQLClient refresh-ahead of %@ failed: %@",
+	    e->query, localException);
+	}
+      NS_ENDHANDLER
+
+      /* A successful refresh will have updated the expiry time, so if
+       * the item is still due it could not be refreshed and we stop
+       * tracking it.
+       */
+      [refreshCond lock];
+      e->refreshing = NO;
+      if (e->expires - refreshWindow <= GSTickerTimeNow())
+	{
+	  NSMutableDictionary	*d;
+
+	  pthread_rwlock_wrlock(&refreshLock);
+	  d = (NSMutableDictionary*)NSMapGet(refreshMap, (void*)e->cache);
+	  if ([d objectForKey: e->query] == e)
+	    {
+	      [d removeObjectForKey: e->query];
+	      if ([d count] == 0)
+		{
+		  NSMapRemove(refreshMap, (void*)e->cache);
+		}
+	    }
+	  pthread_rwlock_unlock(&refreshLock);
+	}
+      if (1 == (NSInteger)NSMapGet(refreshBusy, (void*)owner))
+	{
+	  NSMapRemove(refreshBusy, (void*)owner);
+	}
+      else
+	{
+	  NSMapInsert(refreshBusy, (void*)owner,
+	    (void*)((NSInteger)NSMapGet(refreshBusy, (void*)owner) - 1));
+	}
+      [refreshCond broadcast];
+      [refreshCond unlock];
+      [arp release];
+    }
 }
 
 - (void) _recordMainThread
@@ -3591,10 +4608,26 @@ static int	        poolConnections = 0;
   [a->query release];
   a->query = aKey;
   d = [[NSThread currentThread] threadDictionary];
-  a->recordType = [d objectForKey: @"SQLClientRecordType"];
-  a->listType = [d objectForKey: @"SQLClientListType"];
+  a->recordType = [[d objectForKey: @"SQLClientRecordType"] retain];
+  a->listType = [[d objectForKey: @"SQLClientListType"] retain];
   a->lifetime = lifetime;
+  a->cache = [self cache];
   [a autorelease];
+
+  /* If the item is already being reloaded we keep the old value rather
+   * than starting another query for the same data.
+   */
+  [flightLock lock];
+  if (nil != [cacheFlights member: a])
+    {
+      [flightLock unlock];
+      return YES;
+    }
+  a->cond = [NSCondition new];
+  a->onMain = (nil == _cacheThread) ? NO : YES;
+  [cacheFlights addObject: a];
+  [flightLock unlock];
+
   if (_cacheThread == nil)
     {
       [self _populateCache: a];
@@ -3686,7 +4719,7 @@ static int	        poolConnections = 0;
   SQLLiteral    *query;
 
   va_start (ap, stmt);
-  query = [[self prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   result = [self simpleQuery: query];
@@ -3713,7 +4746,7 @@ static int	        poolConnections = 0;
   SQLLiteral    *query;
 
   va_start (ap, stmt);
-  query = [[self prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   result = [self simpleQuery: query];
@@ -3790,7 +4823,7 @@ static int	        poolConnections = 0;
   [cacheLock lock];
   if (nil == _cache)
     {
-      _cache = [GSCache new];
+      _cache = [SQLClientCache new];
       [_cache setName: [self clientName]];
       if (_cacheThread != nil)
 	{
@@ -3820,7 +4853,7 @@ static int	        poolConnections = 0;
   SQLLiteral    *query;
 
   va_start (ap, stmt);
-  query = [[self prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   return [self cache: seconds simpleQuery: query];
@@ -3832,7 +4865,7 @@ static int	        poolConnections = 0;
 {
   SQLLiteral    *query;
 
-  query = [[self prepare: stmt with: values] objectAtIndex: 0];
+  query = [[self prepareQuery: stmt with: values] objectAtIndex: 0];
   return [self cache: seconds simpleQuery: query];
 }
 
@@ -3850,96 +4883,154 @@ static int	        poolConnections = 0;
 	       recordType: (id)rtype
 	         listType: (id)ltype
 {
-  NSMutableArray	*result;
-  NSMutableDictionary	*md;
-  GSCache		*c;
-  id			toCache;
-  BOOL			cacheHit;
-  NSTimeInterval	start;
-  NSString		*s;
+  return [self _cache: seconds
+	  simpleQuery: stmt
+	   recordType: rtype
+	     listType: ltype
+	       shared: NO];
+}
 
-  if (rtype == 0) rtype = rClass;
-  if (ltype == 0) ltype = aClass;
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt
+{
+  return [self _cache: seconds
+	  simpleQuery: stmt
+	   recordType: nil
+	     listType: nil
+	       shared: YES];
+}
 
-  md = [[NSThread currentThread] threadDictionary];
-  [md setObject: rtype forKey: @"SQLClientRecordType"];
-  [md setObject: ltype forKey: @"SQLClientListType"];
-  start = GSTickerTimeNow();
-  c = [self cache];
-  toCache = nil;
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype
+{
+  return [self _cache: seconds
+	  simpleQuery: stmt
+	   recordType: rtype
+	     listType: ltype
+	       shared: YES];
+}
 
-  if (seconds < 0)
-    {
-      seconds = -seconds;
-      result = nil;
-    }
-  else
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt
+{
+  return [[[[self cache] objectForKey: stmt] retain] autorelease];
+}
+
+- (NSUInteger) invalidateCacheTag: (NSString*)tag
+{
+  NSMutableDictionary	*d;
+  NSArray		*queries = nil;
+  GSCache		*c = [self cache];
+  NSUInteger		count;
+
+  /* The tagging is kept, so that the results are removed again by a
+   * later invalidation after they have been reloaded.
+   */
+  [cacheLock lock];
+  d = (NSMutableDictionary*)NSMapGet(cacheTagMap, (void*)c);
+  if (nil != d)
     {
-      result = [c objectForKey: stmt];
+      queries = [[[d objectForKey: tag] allObjects] retain];
     }
+  [cacheLock unlock];
 
-  if (result == nil)
+  count = [queries count];
+  if (count > 0)
     {
-      CacheQuery	*a;
-
-      cacheHit = NO;
-      a = [CacheQuery new];
-      a->query = [stmt copy];
-      a->recordType = rtype;
-      a->listType = ltype;
-      a->lifetime = seconds;
-      [a autorelease];
+      NSUInteger	index;
 
-      if (_cacheThread == nil)
+      for (index = 0; index < count; index++)
 	{
-          [self _populateCache: a];
+	  [c setObject: nil
+		forKey: [queries objectAtIndex: index]
+	      lifetime: 0];
 	}
-      else
+      if (_debugging > 0)
 	{
-	  /* Not really an asynchronous query because we wait until it's
-	   * done in order to have a result we can return.
-	   */
-	  [self performSelectorOnMainThread: @selector(_populateCache:)
-				 withObject: a
-			      waitUntilDone: YES
-				      modes: queryModes];
+	  [self debug: @"Cache tag '%@' invalidated %lu items",
+	    tag, (unsigned long)count];
 	}
-      result = [c objectForKey: stmt];
-    }
-  else
-    {
-      cacheHit = YES;
     }
+  [queries release];
+  return count;
+}
 
-  if (seconds == 0)
+- (void) observeCacheTag: (NSString*)tag
+{
+  [self addObserver: self
+	   selector: @selector(_cacheTagNotified:)
+	       name: tag];
+}
+
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt
+{
+  NSUInteger	count = [tags count];
+
+  if (count > 0)
     {
-      // We have been told to remove the existing cached item.
-      [c setObject: nil forKey: stmt lifetime: seconds];
-      toCache = nil;
+      GSCache		*c = [self cache];
+      NSMutableDictionary	*d;
+      NSUInteger	index;
+
+      stmt = [[stmt copy] autorelease];
+      [cacheLock lock];
+      d = (NSMutableDictionary*)NSMapGet(cacheTagMap, (void*)c);
+      if (nil == d)
+	{
+	  d = [NSMutableDictionary new];
+	  NSMapInsert(cacheTagMap, (void*)c, (void*)d);
+	  [d release];
+	}
+      for (index = 0; index < count; index++)
+	{
+	  NSString	*tag = [tags objectAtIndex: index];
+	  NSMutableSet	*set = [d objectForKey: tag];
+
+	  if (nil == set)
+	    {
+	      set = [NSMutableSet new];
+	      [d setObject: set forKey: tag];
+	      [set release];
+	    }
+	  [set addObject: stmt];
+	}
+      [cacheLock unlock];
     }
+}
 
-  if (toCache != nil)
+- (void) _cacheTagNotified: (NSNotification*)n
+{
+  [self invalidateCacheTag: [n name]];
+}
+
++ (void) setCacheRefreshAhead: (NSTimeInterval)window
+		  minimumHits: (NSUInteger)minHits
+		      threads: (NSUInteger)count
+{
+  [SQLClient class];	// Ensure initialisation
+  if (window <= 0.0)
     {
-      // We have a newly retrieved object ... cache it.
-      [c setObject: toCache forKey: stmt lifetime: seconds];
+      count = 0;
     }
-
-  if (result != nil)
+  [refreshCond lock];
+  refreshWindow = window;
+  refreshHits = minHits;
+  refreshMax = count;
+  if (0 == count)
     {
-      /*
-       * Return an autoreleased copy ... not the original cached data.
-       */
-      result = [[result mutableCopy] autorelease];
+      pthread_rwlock_wrlock(&refreshLock);
+      NSResetMapTable(refreshMap);
+      pthread_rwlock_unlock(&refreshLock);
     }
-
-  _lastStart = start;
-  _lastOperation = GSTickerTimeNow();
-  if ((s = [self _checkDuration: _lastOperation]) != nil)
+  while (refreshThreads < refreshMax)
     {
-      [self debug: @"%@ for cache-%@ query %@",
-	s, (YES == cacheHit) ? @"hit" : @"miss", stmt];
+      refreshThreads++;
+      [NSThread detachNewThreadSelector: @selector(_refreshAhead:)
+			       toTarget: SQLClientClass
+			     withObject: nil];
     }
-  return result;
+  [refreshCond broadcast];
+  [refreshCond unlock];
 }
 
 - (void) setCache: (GSCache*)aCache
@@ -4011,6 +5102,181 @@ static int	        poolConnections = 0;
 }
 @end
 
+@implementation	SQLClient (CacheFlight)
+
+/* Called when a client or pool is deallocated, to stop refresh-ahead of
+ * the items it loaded.  Waits until no refresh-ahead worker is using it.
+ */
++ (void) _refreshForget: (id)owner
+{
+  NSMapEnumerator	me;
+  NSMutableDictionary	*d;
+  NSMutableArray	*empty = nil;
+  GSCache		*c;
+
+  if (0 == refreshMap)
+    {
+      return;
+    }
+  [refreshCond lock];
+  while (NSMapGet(refreshBusy, (void*)owner) != 0)
+    {
+      [refreshCond wait];
+    }
+  pthread_rwlock_wrlock(&refreshLock);
+  me = NSEnumerateMapTable(refreshMap);
+  while (NSNextMapEnumeratorPair(&me, (void**)&c, (void**)&d))
+    {
+      NSEnumerator	*de = [[d allValues] objectEnumerator];
+      CacheQuery	*q;
+
+      while (nil != (q = [de nextObject]))
+	{
+	  if (q->owner == owner)
+	    {
+	      [d removeObjectForKey: q->query];
+	    }
+	}
+      if ([d count] == 0)
+	{
+	  if (nil == empty)
+	    {
+	      empty = [NSMutableArray array];
+	    }
+	  [empty addObject: [NSValue valueWithPointer: c]];
+	}
+    }
+  NSEndMapTableEnumeration(&me);
+  while ([empty count] > 0)
+    {
+      NSMapRemove(refreshMap, [[empty lastObject] pointerValue]);
+      [empty removeLastObject];
+    }
+  pthread_rwlock_unlock(&refreshLock);
+  [refreshCond unlock];
+}
+/* Returns the cached data for stmt if it is present, otherwise waits for
+ * and returns the result of any load of that data already in progress,
+ * otherwise returns nil.
+ */
+- (id) _cacheLoaded: (SQLLitArg*)stmt
+{
+  GSCache	*c = [self cache];
+  id		result = [c objectForKey: stmt];
+
+  if (nil != result)
+    {
+      refreshNoteHit(c, stmt);
+    }
+  else
+    {
+      CacheQuery	*a;
+      CacheQuery	*f;
+
+      a = [CacheQuery new];
+      a->query = [stmt copy];
+      a->cache = c;
+      [flightLock lock];
+      f = [[[cacheFlights member: a] retain] autorelease];
+      [flightLock unlock];
+      [a release];
+      /* We can't wait for a load which is waiting for this thread.
+       */
+      if (nil != f && (NO == f->onMain || NO == [NSThread isMainThread]))
+	{
+	  result = [f wait];
+	}
+    }
+  if (nil != result)
+    {
+      _cacheHits++;
+    }
+  return [[result retain] autorelease];
+}
+@end
+
+@implementation	SQLClient (Metrics)
+
+/* Appends samples for the client metrics dictionaries in the array to s,
+ * in the Prometheus text exposition format, writing the HELP and TYPE
+ * lines of each family once.  The labels array holds the label set
+ * (without braces) to use for the samples of the client at the same
+ * position in the metrics array.
+ */
++ (void) _prometheus: (NSMutableString*)s
+	     clients: (NSArray*)metrics
+	      labels: (NSArray*)labels
+{
+  static NSString	*names[] = {
+    @"Queries", @"Statements", @"Errors", @"Committed",
+    @"CacheHits", @"CacheMisses", @"Connected" };
+  static NSString	*series[] = {
+    @"sqlclient_queries_total",
+    @"sqlclient_statements_total",
+    @"sqlclient_errors_total",
+    @"sqlclient_committed_total",
+    @"sqlclient_cache_hits_total",
+    @"sqlclient_cache_misses_total",
+    @"sqlclient_connected" };
+  static NSString	*help[] = {
+    @"Queries completed by the client.",
+    @"Statements executed by the client.",
+    @"Queries and statements which raised an exception.",
+    @"Transactions (or single operations) committed.",
+    @"Cached queries answered without using the database.",
+    @"Cached queries which had to be loaded from the database.",
+    @"Whether the client is connected to the database." };
+  NSUInteger	count = [metrics count];
+  unsigned	i;
+
+  if (0 == count)
+    {
+      return;
+    }
+  for (i = 0; i < sizeof(names)/sizeof(*names); i++)
+    {
+      NSUInteger	index;
+
+      [s appendFormat: @"# HELP %@ %@\n# TYPE %@ %@\n",
+	series[i], help[i], series[i],
+	[series[i] hasSuffix: @"_total"] ? @"counter" : @"gauge"];
+      for (index = 0; index < count; index++)
+	{
+	  NSDictionary	*d = [metrics objectAtIndex: index];
+
+	  [s appendFormat: @"%@{%@} %llu\n",
+	    series[i], [labels objectAtIndex: index],
+	    [[d objectForKey: names[i]] unsignedLongLongValue]];
+	}
+    }
+}
+
+/* Returns value escaped for use as a label value.
+ */
++ (NSString*) _prometheusLabel: (NSString*)value
+{
+  NSMutableString	*m;
+
+  if (nil == value)
+    {
+      return @"";
+    }
+  if ([value rangeOfCharacterFromSet: [NSCharacterSet
+    characterSetWithCharactersInString: @"\\\"\n"]].length == 0)
+    {
+      return value;
+    }
+  m = [[value mutableCopy] autorelease];
+  [m replaceOccurrencesOfString: @"\\" withString: @"\\\\"
+    options: NSLiteralSearch range: NSMakeRange(0, [m length])];
+  [m replaceOccurrencesOfString: @"\"" withString: @"\\\""
+    options: NSLiteralSearch range: NSMakeRange(0, [m length])];
+  [m replaceOccurrencesOfString: @"\n" withString: @"\\n"
+    options: NSLiteralSearch range: NSMakeRange(0, [m length])];
+  return m;
+}
+@end
+
 @implementation	SQLTransaction
 
 + (SQLTransaction*) _transactionUsing: (id)clientOrPool
@@ -4030,12 +5296,152 @@ static int	        poolConnections = 0;
   return [transaction autorelease];
 }
 
-- (void) _addSQL: (NSMutableString*)sql andArgs: (NSMutableArray*)args
+/* Sets the router whose primary pool owns the receiver, so that the
+ * router is told when the receiver executes (see -noteWrite).
+ */
+- (void) _setRouter: (SQLClientRouter*)router
 {
-  unsigned      count = [_info count];
-  unsigned      index;
+  ASSIGN(_router, router);
+}
 
-  for (index = 0; index < count; index++)
+/* Splits a single row insert statement into the part up to and including
+ * the VALUES keyword and the parenthesised row of values.
+ * Returns NO if the statement is not of that form (eg. if it inserts
+ * multiple rows, uses a SELECT, or has any clause after the values).
+ */
+static BOOL
+insertParts(NSString *stmt, NSString **head, NSString **row)
+{
+  static NSCharacterSet	*ws = nil;
+  NSUInteger		length;
+  NSUInteger		pos;
+  NSRange		r;
+
+  if (nil == ws)
+    {
+      ws = [[NSCharacterSet whitespaceAndNewlineCharacterSet] retain];
+    }
+  stmt = [stmt stringByTrimmingCharactersInSet: ws];
+  if ([stmt hasSuffix: @";"])
+    {
+      stmt = [[stmt substringToIndex: [stmt length] - 1]
+	stringByTrimmingCharactersInSet: ws];
+    }
+  length = [stmt length];
+  if (length < 20 || [stmt rangeOfString: @"insert into "
+    options: NSCaseInsensitiveSearch|NSAnchoredSearch].length == 0)
+    {
+      return NO;
+    }
+
+  /* Find the VALUES keyword (preceded by space or the column list and
+   * followed by the row of values).
+   */
+  r = NSMakeRange(0, length);
+  for (;;)
+    {
+      NSRange	v;
+      unichar	c;
+
+      v = [stmt rangeOfString: @"values" options: NSCaseInsensitiveSearch
+	range: r];
+      if (0 == v.length)
+	{
+	  return NO;
+	}
+      r.location = NSMaxRange(v);
+      r.length = length - r.location;
+      c = [stmt characterAtIndex: v.location - 1];
+      if (')' == c || [ws characterIsMember: c])
+	{
+	  NSString	*rest;
+
+	  rest = [[stmt substringFromIndex: NSMaxRange(v)]
+	    stringByTrimmingCharactersInSet: ws];
+	  if ([rest hasPrefix: @"("])
+	    {
+	      *head = [NSString stringWithFormat: @"%@ VALUES ",
+		[[stmt substringToIndex: v.location]
+		stringByTrimmingCharactersInSet: ws]];
+	      *row = rest;
+	      break;
+	    }
+	}
+    }
+
+  /* The row must be a single parenthesised list ending the statement.
+   */
+  length = [*row length];
+  if (length < 2)
+    {
+      return NO;
+    }
+  {
+    unichar	buf[256];
+    NSUInteger	base = 0;
+    NSUInteger	used = 0;
+    BOOL	quoted = NO;
+    int		depth = 0;
+
+    /* The row may contain large literals, so we scan it in chunks
+     * rather than copying it all to the stack.
+     */
+    for (pos = 0; pos < length; pos++)
+      {
+	unichar	c;
+
+	if (pos == base + used)
+	  {
+	    base = pos;
+	    used = length - base;
+	    if (used > sizeof(buf)/sizeof(*buf))
+	      {
+		used = sizeof(buf)/sizeof(*buf);
+	      }
+	    [*row getCharacters: buf range: NSMakeRange(base, used)];
+	  }
+	c = buf[pos - base];
+	if ('\'' == c)
+	  {
+	    quoted = (quoted ? NO : YES);
+	  }
+	else if (NO == quoted)
+	  {
+	    if ('(' == c)
+	      {
+		depth++;
+	      }
+	    else if (')' == c && 0 == --depth)
+	      {
+		break;
+	      }
+	  }
+      }
+    if (pos != length - 1)
+      {
+	return NO;
+      }
+  }
+  return YES;
+}
+
+/* Appends the statements/transactions from first up to (but excluding)
+ * last to sql, and their arguments to args, coalescing consecutive
+ * inserts into the same table and columns while the coalesced statement
+ * is no longer than limit.  The head and start of the insert currently
+ * being coalesced are passed in and updated.
+ */
+- (void) _addSQL: (NSMutableString*)sql
+	 andArgs: (NSMutableArray*)args
+	    from: (NSUInteger)first
+	      to: (NSUInteger)last
+	coalesce: (NSUInteger)limit
+	    head: (NSString**)head
+	   start: (NSUInteger*)start
+{
+  NSUInteger    index;
+
+  for (index = first; index < last; index++)
     {
       id        o = [_info objectAtIndex: index];
 
@@ -4045,10 +5451,40 @@ static int	        poolConnections = 0;
 
           if (c > 0)
             {
+              NSString  *stmt = [(NSArray*)o objectAtIndex: 0];
+              NSString  *h = nil;
+              NSString  *r = nil;
               unsigned  i;
 
-              [sql appendString: [(NSArray*)o objectAtIndex: 0]];
-              [sql appendString: @";"];
+              if (limit > 0 && YES == insertParts(stmt, &h, &r))
+                {
+                  if (nil != *head && [h isEqualToString: *head]
+                    && [sql length] - *start + [r length] + 1 <= limit)
+                    {
+                      /* Same table and columns as the previous insert,
+                       * so we add this row to that statement.
+                       */
+                      [sql deleteCharactersInRange:
+                        NSMakeRange([sql length] - 1, 1)];
+                      [sql appendString: @","];
+                      [sql appendString: r];
+                      [sql appendString: @";"];
+                    }
+                  else
+                    {
+                      *head = h;
+                      *start = [sql length];
+                      [sql appendString: h];
+                      [sql appendString: r];
+                      [sql appendString: @";"];
+                    }
+                }
+              else
+                {
+                  *head = nil;
+                  [sql appendString: stmt];
+                  [sql appendString: @";"];
+                }
               for (i = 1; i < c; i++)
                 {
                   [args addObject: [(NSArray*)o objectAtIndex: i]];
@@ -4057,11 +5493,42 @@ static int	        poolConnections = 0;
         }
       else
         {
-          [(SQLTransaction*)o _addSQL: sql andArgs: args];
+          [(SQLTransaction*)o _addSQL: sql
+                              andArgs: args
+                             coalesce: limit
+                                 head: head
+                                start: start];
         }
     }
 }
 
+- (void) _addSQL: (NSMutableString*)sql
+	 andArgs: (NSMutableArray*)args
+	coalesce: (NSUInteger)limit
+	    head: (NSString**)head
+	   start: (NSUInteger*)start
+{
+  [self _addSQL: sql
+        andArgs: args
+           from: 0
+             to: [_info count]
+       coalesce: limit
+           head: head
+          start: start];
+}
+
+- (void) _addSQL: (NSMutableString*)sql andArgs: (NSMutableArray*)args
+{
+  NSString      *head = nil;
+  NSUInteger    start = 0;
+
+  [self _addSQL: sql
+        andArgs: args
+       coalesce: _coalesce
+           head: &head
+          start: &start];
+}
+
 - (void) addPrepared: (NSArray*)statement
 {
   [_lock lock];
@@ -4168,6 +5635,7 @@ static int	        poolConnections = 0;
   [_lock lock];
   c = (SQLTransaction*)NSCopyObject(self, 0, z);
   c->_owner = [c->_owner retain];
+  c->_router = [c->_router retain];
   c->_info = [c->_info mutableCopy];
   c->_lock = [NSRecursiveLock new];
   [_lock unlock];
@@ -4192,6 +5660,7 @@ static int	        poolConnections = 0;
 - (void) dealloc
 {
   [_owner release]; _owner = nil;
+  [_router release]; _router = nil;
   [_info release]; _info = nil;
   [_lock release]; _lock = nil;
   [super dealloc];
@@ -4299,10 +5768,12 @@ static int	        poolConnections = 0;
         }
       NS_HANDLER
         {
+          [_router noteWrite];
           [_lock unlock];
           [localException raise];
         }
       NS_ENDHANDLER
+      [_router noteWrite];
       if (YES == _reset)
         {
           [self reset];
@@ -4311,6 +5782,336 @@ static int	        poolConnections = 0;
   [_lock unlock];
 }
 
+/* Executes the statements/transactions from first up to (but excluding)
+ * last as a single operation within a savepoint.  On failure the work is
+ * rolled back to the savepoint and the range is split in two and each
+ * half retried, until failing statements are isolated and added to the
+ * failures transaction.  Returns the number of statements executed.
+ * Must be called within a transaction.
+ */
+- (unsigned) _savepoint: (SQLClient*)db
+                   from: (NSUInteger)first
+                     to: (NSUInteger)last
+               failures: (SQLTransaction*)failures
+                    log: (BOOL)log
+                stopped: (BOOL*)stopped
+{
+  NSMutableArray        *info;
+  NSMutableString       *sql;
+  NSString              *head = nil;
+  NSUInteger            start = 0;
+  NSUInteger            index;
+  unsigned              total = 0;
+  unsigned              done;
+
+  if (first >= last)
+    {
+      return 0;
+    }
+  if (YES == *stopped)
+    {
+      /* We have stopped after an earlier failure, so everything else
+       * goes into the failures transaction.
+       */
+      for (index = first; index < last; index++)
+        {
+          id    o = [_info objectAtIndex: index];
+
+          if ([o isKindOfClass: NSArrayClass] == YES)
+            {
+              [failures addPrepared: o];
+            }
+          else
+            {
+              [failures append: (SQLTransaction*)o];
+            }
+        }
+      return 0;
+    }
+
+  info = [NSMutableArray array];
+  sql = [NSMutableString stringWithCapacity: 1024];
+  [info addObject: SQLClientProxyLiteral(sql)];
+  [sql appendString: @"savepoint sqlclient_batch;"];
+  [self _addSQL: sql
+        andArgs: info
+           from: first
+             to: last
+       coalesce: _coalesce
+           head: &head
+          start: &start];
+  for (index = first; index < last; index++)
+    {
+      id        o = [_info objectAtIndex: index];
+
+      if ([o isKindOfClass: NSArrayClass] == YES)
+        {
+          total++;
+        }
+      else
+        {
+          total += [(SQLTransaction*)o totalCount];
+        }
+    }
+  [sql appendString: @"release savepoint sqlclient_batch;"];
+
+  NS_DURING
+    {
+      [db simpleExecute: info];
+      done = total;
+    }
+  NS_HANDLER
+    {
+      NSException       *e = localException;
+
+      /* Undo the partial work of this group and release the savepoint
+       * (so that savepoints do not accumulate on the server while the
+       * range is split and retried).  If this fails the whole
+       * transaction is in doubt, so the exception is propagated.
+       */
+      [db simpleExecute:
+        [NSArray arrayWithObject: @"rollback to savepoint sqlclient_batch;"
+        @"release savepoint sqlclient_batch"]];
+      if (last - first > 1)
+        {
+          NSUInteger    middle = first + (last - first) / 2;
+
+          done = [self _savepoint: db
+                             from: first
+                               to: middle
+                         failures: failures
+                              log: log
+                          stopped: stopped];
+          done += [self _savepoint: db
+                              from: middle
+                                to: last
+                          failures: failures
+                               log: log
+                           stopped: stopped];
+        }
+      else
+        {
+          id    o = [_info objectAtIndex: first];
+
+          if (log == YES || [db debugging] > 0)
+            {
+              [db debug: @"Failure of %u executing batch %@: %@",
+                (unsigned)first, self, e];
+            }
+          if ([o isKindOfClass: NSArrayClass] == YES)
+            {
+              [failures addPrepared: o];
+            }
+          else
+            {
+              [failures append: (SQLTransaction*)o];
+            }
+          if (YES == _stop)
+            {
+              *stopped = YES;
+            }
+          done = 0;
+        }
+    }
+  NS_ENDHANDLER
+  return done;
+}
+
+/* Adds a statement or nested transaction taken from another transaction
+ * to the end of the receiver, without copying it.
+ */
+- (void) _addItem: (id)o
+{
+  [_info addObject: o];
+  if ([o isKindOfClass: NSArrayClass] == YES)
+    {
+      _count++;
+    }
+  else
+    {
+      _count += [(SQLTransaction*)o totalCount];
+    }
+}
+
+/* Returns YES if each statement in the receiver (and in any nested
+ * transactions) is a single non-empty statement, so that the position
+ * of a statement on the server matches its position in the receiver.
+ * A statement containing a semicolon may be several statements, so it
+ * is treated as not countable (even if the semicolon is in a literal).
+ */
+- (BOOL) _countable
+{
+  NSUInteger    count = [_info count];
+  NSUInteger    index;
+
+  for (index = 0; index < count; index++)
+    {
+      id        o = [_info objectAtIndex: index];
+
+      if ([o isKindOfClass: NSArrayClass] == YES)
+        {
+          NSString      *stmt;
+
+          if (0 == [(NSArray*)o count])
+            {
+              return NO;
+            }
+          stmt = [(NSArray*)o objectAtIndex: 0];
+          if (0 == [stmt length] || [stmt rangeOfString: @";"].length > 0)
+            {
+              return NO;
+            }
+        }
+      else if (NO == [(SQLTransaction*)o _countable])
+        {
+          return NO;
+        }
+    }
+  return YES;
+}
+
+/* Called after a batch wrapped in its own transaction has failed and
+ * been rolled back, with the index of the failed statement reported by
+ * the backend.  Adds the failing statement to failures and then executes
+ * the remaining statements as a new batch, so that each failure costs one
+ * round trip rather than every statement being retried individually.
+ * If the failure is in a nested transaction, the statements before it,
+ * the nested transaction (as a batch) and the statements after it are
+ * executed in turn so that their order is preserved.
+ * Returns NSNotFound if the index does not identify a statement (eg. if
+ * the failure was in the begin or commit of the transaction, or if the
+ * statements can't be counted reliably).
+ */
+- (NSUInteger) _isolate: (NSInteger)failed
+                     db: (SQLClient*)db
+               failures: (SQLTransaction*)failures
+                    log: (BOOL)log
+              exception: (NSException*)e
+{
+  SQLTransaction        *rest;
+  NSUInteger            count = [_info count];
+  NSUInteger            index;
+  NSUInteger            first;
+  NSUInteger            i;
+  NSInteger             pos = 0;
+  unsigned              executed = 0;
+  BOOL                  success = NO;
+  id                    o = nil;
+
+  if (failed < 0 || NO == [self _countable])
+    {
+      return NSNotFound;
+    }
+  for (index = 0; index < count; index++)
+    {
+      NSInteger n;
+
+      o = [_info objectAtIndex: index];
+      if ([o isKindOfClass: NSArrayClass] == YES)
+        {
+          n = 1;
+        }
+      else
+        {
+          n = [(SQLTransaction*)o totalCount];
+        }
+      if (failed < pos + n)
+        {
+          break;
+        }
+      pos += n;
+    }
+  if (index == count)
+    {
+      return NSNotFound;
+    }
+
+  rest = [SQLTransaction _transactionUsing: db batch: _batch stop: _stop];
+  rest->_savepoints = _savepoints;
+  if ([o isKindOfClass: NSArrayClass] == YES)
+    {
+      if (log == YES || [db debugging] > 0)
+        {
+          [db debug: @"Failure of %u executing batch %@: %@",
+            (unsigned)index, self, e];
+        }
+      [failures addPrepared: o];
+      first = 0;
+    }
+  else
+    {
+      SQLTransaction    *head;
+      unsigned          result;
+
+      /* The statements before the nested transaction must be executed
+       * before it, so they are done first, then the nested transaction
+       * (which isolates its own failures), then the statements after it.
+       */
+      head = [SQLTransaction _transactionUsing: db batch: _batch stop: _stop];
+      head->_savepoints = _savepoints;
+      for (i = 0; i < index; i++)
+        {
+          [head _addItem: [_info objectAtIndex: i]];
+        }
+      success = YES;
+      if (head->_count > 0)
+        {
+          result = [head executeBatchReturningFailures: failures
+                                         logExceptions: log];
+          executed += result;
+          if (result < head->_count)
+            {
+              success = NO;
+            }
+        }
+      if (NO == success && YES == _stop)
+        {
+          [failures append: (SQLTransaction*)o];
+        }
+      else
+        {
+          result = [(SQLTransaction*)o executeBatchReturningFailures: failures
+                                                       logExceptions: log];
+          executed += result;
+          success = (result == [(SQLTransaction*)o totalCount]) ? YES : NO;
+        }
+      first = index + 1;
+    }
+
+  for (i = first; i < count; i++)
+    {
+      o = [_info objectAtIndex: i];
+      if (i == index)
+        {
+          continue;
+        }
+      if (i > index && NO == success && YES == _stop)
+        {
+          /* We stop after a failure, so all subsequent statements are
+           * added to the failures.
+           */
+          if ([o isKindOfClass: NSArrayClass] == YES)
+            {
+              [failures addPrepared: o];
+            }
+          else
+            {
+              [failures append: (SQLTransaction*)o];
+            }
+        }
+      else
+        {
+          [rest _addItem: o];
+        }
+    }
+  if (rest->_count > 0)
+    {
+      executed += [rest executeBatchReturningFailures: failures
+                                        logExceptions: log];
+    }
+  return executed;
+}
+
 - (unsigned) executeBatch
 {
   return [self executeBatchReturningFailures: nil logExceptions: NO];
@@ -4329,6 +6130,7 @@ static int	        poolConnections = 0;
           NSRecursiveLock   *dbLock;
           SQLClientPool     *pool = nil;
           SQLClient         *db;
+          BOOL              wrapped;
 
           if ([_owner isKindOfClass: [SQLClientPool class]])
             {
@@ -4342,6 +6144,14 @@ static int	        poolConnections = 0;
 
           dbLock = [db _lock];
           [dbLock lock];
+
+          /* Note whether executing wraps the statements in a transaction
+           * of their own (in which case a failure rolls all of them back).
+           * If we have a pool, -execute is provided with the same client
+           * as we are (the one shared with this thread), so the client is
+           * in a transaction for both or neither of us.
+           */
+          wrapped = [db isInTransaction] ? NO : YES;
           NS_DURING
             {
               [self execute];
@@ -4349,12 +6159,105 @@ static int	        poolConnections = 0;
             }
           NS_HANDLER
             {
+              NSNumber          *failed;
+              NSUInteger        done = NSNotFound;
+
               if (log == YES || [db debugging] > 0)
                 {
                   [db debug: @"Initial failure executing batch %@: %@",
                     self, localException];
                 }
-              if (_batch == YES)
+              failed = [[localException userInfo]
+                objectForKey: SQLStatementIndexKey];
+              if (_batch == YES && YES == wrapped && nil != failed
+                && 0 == _coalesce && [_info count] > 1
+                && NO == [[localException name]
+                  isEqual: SQLConnectionException])
+                {
+                  /* The backend told us which statement failed, and the
+                   * leading 'begin' is statement zero.
+                   */
+                  done = [self _isolate: [failed integerValue] - 1
+                                     db: db
+                               failures: failures
+                                    log: log
+                              exception: localException];
+                }
+              if (NSNotFound != done)
+                {
+                  executed = (unsigned)done;
+                }
+              else if (_batch == YES && YES == _savepoints
+                && [_info count] > 1)
+                {
+                  SQLTransaction    *found;
+                  BOOL              wrap;
+
+                  /* Retry the statements in the same transaction, using
+                   * a savepoint around each group of statements so that
+                   * only a failing group is rolled back.  Failing groups
+                   * are split in half until the failing statements are
+                   * isolated.
+                   */
+                  found = [SQLTransaction _transactionUsing: _owner
+                                                      batch: _batch
+                                                       stop: _stop];
+                  wrap = [db isInTransaction] ? NO : YES;
+                  NS_DURING
+                    {
+                      NSUInteger        count = [_info count];
+                      BOOL              stopped = NO;
+
+                      if (YES == wrap)
+                        {
+                          [db begin];
+                        }
+                      executed = [self _savepoint: db
+                                             from: 0
+                                               to: count / 2
+                                         failures: found
+                                              log: log
+                                          stopped: &stopped];
+                      executed += [self _savepoint: db
+                                              from: count / 2
+                                                to: count
+                                          failures: found
+                                               log: log
+                                           stopped: &stopped];
+                      if (YES == wrap)
+                        {
+                          [db commit];
+                        }
+                      [failures append: found];
+                    }
+                  NS_HANDLER
+                    {
+                      /* The savepoint handling itself failed (perhaps the
+                       * connection was lost), so nothing was done.
+                       */
+                      if (YES == wrap && YES == [db isInTransaction])
+                        {
+                          NS_DURING
+                            {
+                              [db rollback];
+                            }
+                          NS_HANDLER
+                            {
+                              [db disconnect];
+                            }
+                          NS_ENDHANDLER
+                        }
+                      if (log == YES || [db debugging] > 0)
+                        {
+                          [db debug: @"Failure using savepoints for %@: %@",
+                            self, localException];
+                        }
+                      executed = 0;
+                      [failures append: self];
+                    }
+                  NS_ENDHANDLER
+                }
+              else if (_batch == YES)
                 {
                   SQLTransaction	*wrapper = nil;
                   NSUInteger  		count = [_info count];
@@ -4452,10 +6355,12 @@ static int	        poolConnections = 0;
         }
       NS_HANDLER
         {
+          [_router noteWrite];
           [_lock unlock];
           [localException raise];
         }
       NS_ENDHANDLER
+      [_router noteWrite];
       if (YES == _reset)
         {
           [self reset];
@@ -4540,6 +6445,28 @@ static int	        poolConnections = 0;
   [_lock unlock];
 }
 
+- (NSUInteger) setCoalesceInserts: (NSUInteger)maxLength
+{
+  NSUInteger    old;
+
+  [_lock lock];
+  old = _coalesce;
+  _coalesce = maxLength;
+  [_lock unlock];
+  return old;
+}
+
+- (BOOL) setUseSavepoints: (BOOL)aFlag
+{
+  BOOL  old;
+
+  [_lock lock];
+  old = _savepoints;
+  _savepoints = (aFlag ? YES : NO);
+  [_lock unlock];
+  return old;
+}
+
 - (BOOL) setResetOnExecute: (BOOL)aFlag
 {
   BOOL  old;
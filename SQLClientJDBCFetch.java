@@ -0,0 +1,131 @@
+/** Helper class for the SQLClient JDBC backend
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the SQLClient Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+
+import java.sql.ResultSet;
+import java.sql.SQLException;
+
+/* Reads rows from a result set in batches, so that the JDBC backend can
+ * fetch many rows with a single call across JNI rather than making
+ * several calls for every value.
+ *
+ * The column types are those used by JDBC.m:
+ *   0 - a string (read using getString())
+ *   1 - a boolean
+ *   2 - a date/time (read as a string)
+ *   3 - binary data
+ *
+ * The returned array contains an int[1] holding the number of rows read
+ * (zero at the end of the results), followed by two elements for each
+ * column: the data and an int[] with one entry per row.
+ * For string and date/time columns the data is a String containing all
+ * the values concatenated, and the int[] holds the end offset of each
+ * value (or -1 for a null value).
+ * For binary columns the data is a byte[] containing all the values
+ * concatenated, and the int[] holds the end offsets as for strings.
+ * For boolean columns the data is null and the int[] holds 1 (true),
+ * 0 (false) or -1 (null).
+ */
+public class SQLClientJDBCFetch
+{
+  public static Object[] fetch(ResultSet rs, int[] types, int max)
+    throws SQLException
+  {
+    int			columns = types.length;
+    Object[]		result = new Object[1 + columns * 2];
+    StringBuilder[]	text = new StringBuilder[columns];
+    java.io.ByteArrayOutputStream[]	bytes;
+    int[][]		ends = new int[columns][];
+    int			rows = 0;
+    int			c;
+
+    bytes = new java.io.ByteArrayOutputStream[columns];
+    for (c = 0; c < columns; c++)
+      {
+	ends[c] = new int[max];
+	if (3 == types[c])
+	  {
+	    bytes[c] = new java.io.ByteArrayOutputStream();
+	  }
+	else if (1 != types[c])
+	  {
+	    text[c] = new StringBuilder();
+	  }
+      }
+
+    while (rows < max && rs.next())
+      {
+	for (c = 0; c < columns; c++)
+	  {
+	    if (1 == types[c])
+	      {
+		boolean	b = rs.getBoolean(c + 1);
+
+		ends[c][rows] = rs.wasNull() ? -1 : (b ? 1 : 0);
+	      }
+	    else if (3 == types[c])
+	      {
+		byte[]	v = rs.getBytes(c + 1);
+
+		if (null == v)
+		  {
+		    ends[c][rows] = -1;
+		  }
+		else
+		  {
+		    bytes[c].write(v, 0, v.length);
+		    ends[c][rows] = bytes[c].size();
+		  }
+	      }
+	    else
+	      {
+		String	v = rs.getString(c + 1);
+
+		if (null == v)
+		  {
+		    ends[c][rows] = -1;
+		  }
+		else
+		  {
+		    text[c].append(v);
+		    ends[c][rows] = text[c].length();
+		  }
+	      }
+	  }
+	rows++;
+      }
+
+    result[0] = new int[] { rows };
+    for (c = 0; c < columns; c++)
+      {
+	if (3 == types[c])
+	  {
+	    result[1 + c * 2] = bytes[c].toByteArray();
+	  }
+	else if (1 != types[c])
+	  {
+	    result[1 + c * 2] = text[c].toString();
+	  }
+	result[2 + c * 2] = ends[c];
+      }
+    return result;
+  }
+}
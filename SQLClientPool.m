@@ -32,20 +32,59 @@
 #import	<Foundation/NSException.h>
 #import	<Foundation/NSInvocation.h>
 #import	<Foundation/NSLock.h>
+#import	<Foundation/NSMapTable.h>
 #import	<Foundation/NSString.h>
 #import	<Foundation/NSThread.h>
 #import	<Foundation/NSUserDefaults.h>
+#import	<Foundation/NSValue.h>
 
 #import	<Performance/GSCache.h>
 #import	"SQLClient.h"
 
+/* Free items are kept in two doubly linked lists threaded through the
+ * items array: one of connected clients (most recently returned at the
+ * head) and one of disconnected clients.  This lets us provide and
+ * swallow clients without scanning the whole pool.
+ */
 struct _SQLClientPoolItem {
     SQLClient           *c;     /** The clients of the pool. */
     NSThread            *o;     /** The thread owning the client */
     NSUInteger          u;      /** Count of client usage. */
     NSTimeInterval      t;      /** When client was removed from pool. */
+    int                 p;      /** Previous item in free list or -1 */
+    int                 n;      /** Next item in free list or -1 */
+    int                 l;      /** Free list (0 none, 1 idle, 2 dead) */
+    NSTimeInterval      f;      /** When client was returned to pool */
+    NSTimeInterval      k;      /** When client was last probed */
+    int                 s;      /** Next item shared with owner or -1 */
 };
 
+/* A thread waiting for a client to become available.  Waiters are queued
+ * in order of priority (and within a priority in order of arrival), and
+ * each client returned to the pool is handed directly to the waiter at
+ * the head of the queue.
+ */
+@interface      SQLClientPoolWaiter : NSObject
+{
+@public
+  NSCondition           *cond;          /** Signalled on handoff */
+  NSThread              *thread;        /** The waiting thread */
+  SQLClient             *client;        /** The client handed over */
+  NSTimeInterval        start;          /** When the wait began */
+  int                   priority;       /** Priority of the request */
+  BOOL                  exclusive;      /** Is this for exclusive use? */
+}
+@end
+
+@implementation SQLClientPoolWaiter
+- (void) dealloc
+{
+  [cond release];
+  [thread release];
+  [super dealloc];
+}
+@end
+
 @interface      SQLClient(Pool)
 - (void) _clearPool: (SQLClientPool*)p;
 - (void) _waitPool: (NSTimeInterval)ti;
@@ -68,14 +107,53 @@ struct _SQLClientPoolItem {
 + (void) _adjustPoolConnections: (int)n;
 @end
 
+@interface      SQLClient (CacheFlight)
+- (id) _cacheLoaded: (SQLLitArg*)stmt;
++ (void) _refreshForget: (id)owner;
+@end
+
+@interface      SQLClient (Metrics)
++ (void) _prometheus: (NSMutableString*)s
+	     clients: (NSArray*)metrics
+	      labels: (NSArray*)labels;
++ (NSString*) _prometheusLabel: (NSString*)value;
+@end
+
 @interface SQLClientPool (Private)
++ (void) _prometheus: (NSMutableString*)s
+	       pools: (NSArray*)pools
+	     clients: (NSArray*)clients;
+- (SQLClient*) _availableFor: (NSThread*)thread exclusive: (BOOL)isLocal;
+- (id) _cached: (int)seconds
+	 query: (SQLLitArg*)stmt
+    recordType: (id)rtype
+      listType: (id)ltype;
+- (void) _claim: (int)index
+        thread: (NSThread*)thread
+     exclusive: (BOOL)isLocal;
+- (void) _freeItem: (int)index;
+- (int) _indexOf: (SQLClient*)client;
 - (void) _lock;
+- (void) _keepalive;
+- (void) _noteWait: (NSTimeInterval)dif;
+- (void) _maintain;
+- (void) _maintenanceChanged;
+- (int) _popFree;
+- (void) _share: (int)index;
+- (int) _reap;
 - (SQLClient*) _provideClientBeforeDate: (NSDate*)when
 			      exclusive: (BOOL)isLocal
+			       priority: (int)priority
 			        blocked: (NSTimeInterval*)ti;
 - (SQLClient*) _provide;
 - (NSString*) _rc: (SQLClient*)o;
+- (void) _rebuild;
+- (void) _resize;
+- (int) _restore: (SQLClient*)client atTail: (BOOL)atTail;
+- (void) _takeItem: (int)index;
+- (SQLClient*) _tryProvideClientExclusive: (BOOL)isLocal;
 - (void) _unlock;
+- (void) _unshare: (int)index;
 @end
 
 @interface      SQLTransaction (Creation)
@@ -88,30 +166,259 @@ struct _SQLClientPoolItem {
 
 #if     defined(GNUSTEP)
 static Class      cls = Nil;
+#endif
+
+/* Pools needing background maintenance (not retained) are kept in the
+ * maintained table, and are examined by a single maintenance thread.
+ * The lock is not held while a pool is being maintained (that may mean
+ * slow network operations), but the pool is recorded in maintaining so
+ * that a pool being deallocated waits for its maintenance to complete.
+ */
+static NSHashTable      *maintained = 0;
+static SQLClientPool    *maintaining = nil;
+static NSCondition      *maintainLock = nil;
+static NSThread         *maintainThread = nil;
+
+/* Upper bounds (in seconds) of the buckets of the histogram of times
+ * spent waiting for clients.  The last bucket has no upper bound.
+ */
+static const NSTimeInterval     waitBounds[SQLClientPoolWaitBuckets - 1]
+  = { 0.001, 0.01, 0.1, 1.0, 10.0 };
 
 + (void) initialize
 {
+#if     defined(GNUSTEP)
   if (Nil == cls)
     {
       cls = [NSAutoreleasePool class];
     }
-}
 #endif
+  if (nil == maintainLock)
+    {
+      maintainLock = [NSCondition new];
+      maintained = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 0);
+    }
+}
 
-- (int) availableConnections
++ (void) _maintenance: (id)ignored
 {
-  int   available;
-  int   index;
+  for (;;)
+    {
+      NSAutoreleasePool *arp = [NSAutoreleasePool new];
+      NSHashEnumerator  e;
+      SQLClientPool     **pools;
+      SQLClientPool     *p;
+      NSUInteger        count;
+      NSUInteger        index;
+
+      /* Copy the pools without retaining them, since a pool may be
+       * waiting for the lock in order to remove itself in -dealloc.
+       */
+      [maintainLock lock];
+      count = NSCountHashTable(maintained);
+      pools = (SQLClientPool**)malloc(sizeof(SQLClientPool*) * (count + 1));
+      count = 0;
+      e = NSEnumerateHashTable(maintained);
+      while (nil != (p = (SQLClientPool*)NSNextHashEnumeratorItem(&e)))
+        {
+          pools[count++] = p;
+        }
+      NSEndHashTableEnumeration(&e);
+      [maintainLock unlock];
+      for (index = 0; index < count; index++)
+        {
+          p = pools[index];
 
-  [self _lock];
-  available = index = _max;
-  while (index-- > 0)
+          /* A pool which has been removed from the table since we copied
+           * it may be in the process of being deallocated, so we skip it.
+           */
+          [maintainLock lock];
+          if (NSHashGet(maintained, (void*)p) != p)
+            {
+              [maintainLock unlock];
+              continue;
+            }
+          maintaining = p;
+          [maintainLock unlock];
+          NS_DURING
+            {
+              [p _maintain];
+            }
+          NS_HANDLER
+            {
+              NSLog(@"Problem maintaining %@: %@", p, localException);
+            }
+          NS_ENDHANDLER
+          [maintainLock lock];
+          maintaining = nil;
+          [maintainLock broadcast];
+          [maintainLock unlock];
+        }
+      free(pools);
+      [arp release];
+      [NSThread sleepForTimeInterval: 1.0];
+    }
+}
+
+/* Appends the metrics of the pools in the array (see -metrics) and of
+ * the clients in the other array (see [SQLClient-metrics]) to s in the
+ * Prometheus text exposition format.  The HELP and TYPE lines of each
+ * family are written once, followed by the samples of every pool, so
+ * that the output for several pools is a valid exposition.
+ */
++ (void) _prometheus: (NSMutableString*)s
+	       pools: (NSArray*)pools
+	     clients: (NSArray*)clients
+{
+  NSMutableArray        *labels;
+  NSMutableArray        *metrics;
+  NSMutableArray        *samples;
+  NSUInteger            count = [pools count];
+  NSUInteger            p;
+  NSUInteger            index;
+
+  labels = [NSMutableArray arrayWithCapacity: count];
+  for (p = 0; p < count; p++)
+    {
+      NSDictionary      *d = [pools objectAtIndex: p];
+
+      [labels addObject: [NSString stringWithFormat: @"pool=\"%@\"",
+        [SQLClient _prometheusLabel: [d objectForKey: @"Name"]]]];
+    }
+
+  if (count > 0)
+    {
+      [s appendString: @"# HELP sqlclient_pool_provisions_total"
+        @" Requests for clients by outcome.\n"
+        @"# TYPE sqlclient_pool_provisions_total counter\n"];
+    }
+  for (p = 0; p < count; p++)
+    {
+      NSDictionary      *d = [pools objectAtIndex: p];
+      NSString          *pool = [labels objectAtIndex: p];
+
+      [s appendFormat: @"sqlclient_pool_provisions_total{%@,outcome=\"%@\"}"
+        @" %llu\n", pool, @"immediate",
+        [[d objectForKey: @"Immediate"] unsignedLongLongValue]];
+      [s appendFormat: @"sqlclient_pool_provisions_total{%@,outcome=\"%@\"}"
+        @" %llu\n", pool, @"delayed",
+        [[d objectForKey: @"Delayed"] unsignedLongLongValue]];
+      [s appendFormat: @"sqlclient_pool_provisions_total{%@,outcome=\"%@\"}"
+        @" %llu\n", pool, @"timeout",
+        [[d objectForKey: @"TimedOut"] unsignedLongLongValue]];
+      [s appendFormat: @"sqlclient_pool_provisions_total{%@,outcome=\"%@\"}"
+        @" %llu\n", pool, @"rejected",
+        [[d objectForKey: @"Rejected"] unsignedLongLongValue]];
+    }
+
+  if (count > 0)
+    {
+      [s appendString: @"# HELP sqlclient_pool_wait_seconds"
+        @" Time spent waiting for a client.\n"
+        @"# TYPE sqlclient_pool_wait_seconds histogram\n"];
+    }
+  for (p = 0; p < count; p++)
+    {
+      NSDictionary      *d = [pools objectAtIndex: p];
+      NSString          *pool = [labels objectAtIndex: p];
+      NSArray           *bounds = [d objectForKey: @"WaitBounds"];
+      NSArray           *buckets = [d objectForKey: @"WaitBuckets"];
+
+      for (index = 0; index < [buckets count]; index++)
+        {
+          NSString  *le;
+
+          if (index < [bounds count])
+            {
+              le = [NSString stringWithFormat: @"%g",
+                [[bounds objectAtIndex: index] doubleValue]];
+            }
+          else
+            {
+              le = @"+Inf";
+            }
+          [s appendFormat: @"sqlclient_pool_wait_seconds_bucket{%@,le=\"%@\"}"
+            @" %llu\n", pool, le,
+            [[buckets objectAtIndex: index] unsignedLongLongValue]];
+        }
+      [s appendFormat: @"sqlclient_pool_wait_seconds_sum{%@} %g\n",
+        pool, [[d objectForKey: @"WaitSum"] doubleValue]];
+      [s appendFormat: @"sqlclient_pool_wait_seconds_count{%@} %llu\n",
+        pool, [[buckets lastObject] unsignedLongLongValue]];
+    }
+
+  if (count > 0)
+    {
+      [s appendString: @"# HELP sqlclient_pool_clients"
+        @" Clients in the pool by state.\n"
+        @"# TYPE sqlclient_pool_clients gauge\n"];
+    }
+  for (p = 0; p < count; p++)
+    {
+      NSDictionary      *d = [pools objectAtIndex: p];
+      NSString          *pool = [labels objectAtIndex: p];
+
+      [s appendFormat: @"sqlclient_pool_clients{%@,state=\"in_use\"} %d\n",
+        pool, [[d objectForKey: @"InUse"] intValue]];
+      [s appendFormat: @"sqlclient_pool_clients{%@,state=\"idle\"} %d\n",
+        pool, [[d objectForKey: @"Idle"] intValue]];
+      [s appendFormat: @"sqlclient_pool_clients{%@,state=\"disconnected\"}"
+        @" %d\n", pool, [[d objectForKey: @"Disconnected"] intValue]];
+    }
+
+  if (count > 0)
+    {
+      [s appendString: @"# HELP sqlclient_pool_waiting"
+        @" Threads waiting for a client.\n"
+        @"# TYPE sqlclient_pool_waiting gauge\n"];
+    }
+  for (p = 0; p < count; p++)
+    {
+      NSDictionary      *d = [pools objectAtIndex: p];
+
+      [s appendFormat: @"sqlclient_pool_waiting{%@} %u\n",
+        [labels objectAtIndex: p],
+        [[d objectForKey: @"Waiting"] unsignedIntValue]];
+    }
+
+  /* Since all the clients in a pool have the same name, the samples for
+   * pool clients also carry the position of the client in its pool.
+   */
+  metrics = [NSMutableArray array];
+  samples = [NSMutableArray array];
+  for (p = 0; p < count; p++)
     {
-      if (_items[index].u > 0)
+      NSArray   *a = [[pools objectAtIndex: p] objectForKey: @"Clients"];
+      NSString  *pool = [labels objectAtIndex: p];
+
+      for (index = 0; index < [a count]; index++)
         {
-          available--;
+          NSDictionary  *d = [a objectAtIndex: index];
+
+          [metrics addObject: d];
+          [samples addObject: [NSString stringWithFormat:
+            @"%@,client=\"%@\",index=\"%u\"", pool,
+            [SQLClient _prometheusLabel: [d objectForKey: @"Name"]],
+            (unsigned)index]];
         }
     }
+  for (index = 0; index < [clients count]; index++)
+    {
+      NSDictionary      *d = [clients objectAtIndex: index];
+
+      [metrics addObject: d];
+      [samples addObject: [NSString stringWithFormat: @"client=\"%@\"",
+        [SQLClient _prometheusLabel: [d objectForKey: @"Name"]]]];
+    }
+  [SQLClient _prometheus: s clients: metrics labels: samples];
+}
+
+- (int) availableConnections
+{
+  int   available;
+
+  [self _lock];
+  available = _freeCount;
   [self _unlock];
   return available;
 }
@@ -150,6 +457,14 @@ static Class      cls = Nil;
   int                   count;
   int                   i;
 
+  [SQLClient _refreshForget: self];
+  [maintainLock lock];
+  NSHashRemove(maintained, (void*)self);
+  while (maintaining == self)
+    {
+      [maintainLock wait];
+    }
+  [maintainLock unlock];
   [_lock lock];
   count = _max;
   old = _items;
@@ -170,9 +485,21 @@ static Class      cls = Nil;
       free(old);
     }
   [_lock unlock];
+  if (0 != _clients)
+    {
+      NSFreeMapTable(_clients);
+      _clients = 0;
+    }
+  if (0 != _owners)
+    {
+      NSFreeMapTable(_owners);
+      _owners = 0;
+    }
   DESTROY(_lock);
   DESTROY(_config);
   DESTROY(_name);
+  DESTROY(_probe);
+  DESTROY(_waiters);
   [SQLClientPool _adjustPoolConnections: -count];
   [super dealloc];
 }
@@ -204,6 +531,12 @@ static Class      cls = Nil;
         }
       ASSIGNCOPY(_name, reference);
       _lock = [[NSConditionLock alloc] initWithCondition: 0];
+      _clients = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+        NSIntegerMapValueCallBacks, 0);
+      _owners = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+        NSIntegerMapValueCallBacks, 0);
+      _idleHead = _idleTail = _deadHead = -1;
+      _waiters = [NSMutableArray new];
       [self setMax: maxConnections min: minConnections];
     }
   return self;
@@ -236,6 +569,115 @@ static Class      cls = Nil;
   return  _name;
 }
 
+- (NSDictionary*) metrics
+{
+  NSMutableDictionary   *d;
+  NSMutableArray        *clients;
+  NSMutableArray        *bounds;
+  NSMutableArray        *buckets;
+  SQLClient             **c;
+  uint64_t              hist[SQLClientPoolWaitBuckets];
+  uint64_t              committed = 0;
+  uint64_t              hits = 0;
+  uint64_t              misses = 0;
+  uint64_t              total;
+  uint64_t              immediate;
+  uint64_t              delayed;
+  uint64_t              failed;
+  uint64_t              rejected;
+  NSTimeInterval        waits;
+  int                   used;
+  int                   idle;
+  int                   dead;
+  unsigned              waiting;
+  int                   count;
+  int                   index;
+
+  /* Copy the counters while holding the lock, and build the dictionary
+   * (and ask the clients for their metrics) after releasing it.
+   */
+  [_lock lock];
+  immediate = _immediate;
+  delayed = _delayed;
+  failed = _failed;
+  rejected = _rejected;
+  waits = _delayWaits + _failWaits;
+  memcpy(hist, _waitHist, sizeof(hist));
+  used = _max - _freeCount;
+  idle = _idleCount;
+  dead = _freeCount - _idleCount;
+  waiting = (unsigned)[_waiters count];
+  count = _max;
+  c = (SQLClient**)malloc(sizeof(SQLClient*) * count);
+  for (index = 0; index < count; index++)
+    {
+      c[index] = [_items[index].c retain];
+    }
+  [_lock unlock];
+
+  clients = [NSMutableArray arrayWithCapacity: count];
+  for (index = 0; index < count; index++)
+    {
+      NSDictionary      *m = [c[index] metrics];
+
+      committed += [[m objectForKey: @"Committed"] unsignedLongLongValue];
+      hits += [[m objectForKey: @"CacheHits"] unsignedLongLongValue];
+      misses += [[m objectForKey: @"CacheMisses"] unsignedLongLongValue];
+      [clients addObject: m];
+      [c[index] release];
+    }
+  free(c);
+
+  /* Immediate provisions did not wait, so they go in the first bucket.
+   * The bucket counts are cumulative, as for a Prometheus histogram.
+   */
+  hist[0] += immediate;
+  bounds = [NSMutableArray arrayWithCapacity: SQLClientPoolWaitBuckets];
+  buckets = [NSMutableArray arrayWithCapacity: SQLClientPoolWaitBuckets];
+  total = 0;
+  for (index = 0; index < SQLClientPoolWaitBuckets; index++)
+    {
+      total += hist[index];
+      if (index < SQLClientPoolWaitBuckets - 1)
+        {
+          [bounds addObject: [NSNumber numberWithDouble: waitBounds[index]]];
+        }
+      [buckets addObject: [NSNumber numberWithUnsignedLongLong: total]];
+    }
+
+  d = [NSMutableDictionary dictionaryWithCapacity: 20];
+  [d setObject: _name forKey: @"Name"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: immediate]
+        forKey: @"Immediate"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: delayed]
+        forKey: @"Delayed"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: failed]
+        forKey: @"TimedOut"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: rejected]
+        forKey: @"Rejected"];
+  [d setObject: bounds forKey: @"WaitBounds"];
+  [d setObject: buckets forKey: @"WaitBuckets"];
+  [d setObject: [NSNumber numberWithDouble: waits] forKey: @"WaitSum"];
+  [d setObject: [NSNumber numberWithInt: used] forKey: @"InUse"];
+  [d setObject: [NSNumber numberWithInt: idle] forKey: @"Idle"];
+  [d setObject: [NSNumber numberWithInt: dead] forKey: @"Disconnected"];
+  [d setObject: [NSNumber numberWithUnsignedInt: waiting]
+        forKey: @"Waiting"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: committed]
+        forKey: @"Committed"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: hits]
+        forKey: @"CacheHits"];
+  [d setObject: [NSNumber numberWithUnsignedLongLong: misses]
+        forKey: @"CacheMisses"];
+  [d setObject: clients forKey: @"Clients"];
+  return d;
+}
+
+- (NSString*) prometheusMetrics
+{
+  return [SQLClient prometheusMetricsFor: [NSArray arrayWithObject: self]];
+}
+
 - (SQLClient*) provideClient
 {
   return [self provideClientBeforeDate: nil exclusive: NO];
@@ -250,6 +692,17 @@ static Class      cls = Nil;
 {
   return [self _provideClientBeforeDate: when
 			      exclusive: isLocal
+			       priority: 0
+			        blocked: (NSTimeInterval*)NULL];
+}
+
+- (SQLClient*) provideClientBeforeDate: (NSDate*)when
+			     exclusive: (BOOL)isLocal
+			      priority: (int)priority
+{
+  return [self _provideClientBeforeDate: when
+			      exclusive: isLocal
+			       priority: priority
 			        blocked: (NSTimeInterval*)NULL];
 }
 
@@ -258,61 +711,42 @@ static Class      cls = Nil;
   return [self provideClientBeforeDate: nil exclusive: YES];
 }
 
-- (void) purge
+- (SQLClient*) tryProvideClient
 {
-  BOOL  more = YES;
-
-  [self _lock];
+  return [self _tryProvideClientExclusive: NO];
+}
 
-  while (YES == more)
-    {
-      SQLClient *found = nil;
-      int       connected = 0;
-      int       index;
+- (SQLClient*) tryProvideClientExclusive
+{
+  return [self _tryProvideClientExclusive: YES];
+}
 
-      more = NO;
-      for (index = 0; index < _max; index++)
-        {
-          if (YES == [_items[index].c connected])
-            {
-              /* This is a connected client.
-               */
-              connected++;
-              if (0 == _items[index].u)
-                {
-                  /* Not in use; so a candidate to be purged
-                   */
-                  found = [_items[index].c longestIdle: found];
-                }
-            }
-        }
-      if (nil != found)
-        {
-          NSTimeInterval        age;
+- (SQLClient*) _tryProvideClientExclusive: (BOOL)isLocal
+{
+  SQLClient     *client;
 
-          age = -[[found lastOperation] timeIntervalSinceNow];
-          if (_debugging > 2)
-            {
-              NSLog(@"%@ purge found %p age %g",
-                self, found, age);
-            }
-          if (age > _purgeAll
-            || (connected > _min && age > _purgeMin))
-            {
-              NS_DURING
-                {
-                  [found disconnect];
-                  more = YES;
-                }
-              NS_HANDLER
-                {
-                  NSLog(@"Error disconnecting client in pool: %@",
-                    localException);
-                }
-              NS_ENDHANDLER
-            }
-        }
+  if (NO == [_lock tryLock])
+    {
+      return nil;
+    }
+  client = [self _availableFor: [NSThread currentThread] exclusive: isLocal];
+  if (nil != client)
+    {
+      _immediate++;
+      _recentDelay *= 0.9;
+    }
+  [self _unlock];
+  if (nil != client && _debugging > 2)
+    {
+      NSLog(@"%@ provides %p%@", self, client, [self _rc: client]);
     }
+  return client;
+}
+
+- (void) purge
+{
+  [self _lock];
+  [self _reap];
   [self _unlock];
 }
 
@@ -375,6 +809,23 @@ static Class      cls = Nil;
   [self _unlock];
 }
 
+- (void) setKeepalive: (NSTimeInterval)seconds statement: (NSString*)stmt
+{
+  if (seconds < 0.0)
+    {
+      seconds = 0.0;
+    }
+  if (nil == stmt)
+    {
+      stmt = @"SELECT 1";
+    }
+  [_lock lock];
+  ASSIGNCOPY(_probe, stmt);
+  _keepalive = seconds;
+  [self _unlock];
+  [self _maintenanceChanged];
+}
+
 - (void) setMax: (int)maxConnections min: (int)minConnections
 {
   int   old;
@@ -413,6 +864,7 @@ static Class      cls = Nil;
         {
           _items[index].o = nil;
           _items[index].t = 0.0;
+          _items[index].k = 0.0;
           _items[index].u = 0;
           _items[index].c = [[SQLClient alloc] initWithConfiguration: _config
                                                                 name: _name
@@ -430,10 +882,45 @@ static Class      cls = Nil;
             }
         }
       _max = maxConnections;
+      [self _rebuild];
       [SQLClientPool _adjustPoolConnections: _max - old];
     }
   _min = minConnections;
+  if (_target < _min)
+    {
+      _target = _min;
+    }
+  if (_target > _max)
+    {
+      _target = _max;
+    }
+  [self _unlock];
+}
+
+- (void) setBackgroundPurge: (BOOL)aFlag
+{
+  _reaper = (YES == aFlag) ? YES : NO;
+  [self _maintenanceChanged];
+}
+
+- (void) setAutoSizeInterval: (NSTimeInterval)seconds
+{
+  if (seconds < 0.0)
+    {
+      seconds = 0.0;
+    }
+  [_lock lock];
+  _autoInterval = seconds;
+  _autoLast = [NSDate timeIntervalSinceReferenceDate];
+  _autoImmediate = _immediate;
+  _autoWaited = _delayed + _failed + _rejected;
+  _peakUsed = _max - _freeCount;
+  if (_target < _min)
+    {
+      _target = _min;
+    }
   [self _unlock];
+  [self _maintenanceChanged];
 }
 
 - (void) setPurgeAll: (int)allSeconds min: (int)minSeconds
@@ -462,6 +949,7 @@ static Class      cls = Nil;
     @"  Immediate provisions:   %llu\n"
     @"  Delayed provisions:     %llu\n"
     @"  Timed out provisions:   %llu\n"
+    @"  Rejected provisions:    %llu\n"
     @"  Slowest provision:      %g\n"
     @"  Average delay:          %g\n"
     @"  Average timeout:        %g\n"
@@ -470,6 +958,7 @@ static Class      cls = Nil;
     (unsigned long long)_immediate,
     (unsigned long long)_delayed,
     (unsigned long long)_failed,
+    (unsigned long long)_rejected,
     _longest,
     (_delayed > 0) ? _delayWaits / _delayed : 0.0,
     (_failed > 0) ? _failWaits / _failed : 0.0,
@@ -480,6 +969,11 @@ static Class      cls = Nil;
   return s;
 }
 
+- (int) targetConnections
+{
+  return (_autoInterval > 0.0) ? _target : _min;
+}
+
 - (NSString*) status
 {
   NSMutableArray        *idleInfo = nil;
@@ -614,6 +1108,24 @@ static Class      cls = Nil;
   s = [NSMutableString stringWithFormat: @" size min: %u, max: %u\n"
     @"  live:%u, used:%u, idle:%u, free:%u, dead:%u\n",
     _min, _max, live, used, idle, free, dead];
+  if ([_waiters count] > 0)
+    {
+      NSTimeInterval            longest = 0.0;
+
+      for (index = 0; index < [_waiters count]; index++)
+        {
+          SQLClientPoolWaiter   *w = [_waiters objectAtIndex: index];
+          NSTimeInterval        t;
+
+          t = [NSDate timeIntervalSinceReferenceDate] - w->start;
+          if (t > longest)
+            {
+              longest = t;
+            }
+        }
+      [s appendFormat: @"  waiting:%u, longest wait:%g\n",
+        (unsigned)[_waiters count], longest];
+    }
 
   if (liveInfo)
     {
@@ -666,43 +1178,43 @@ static Class      cls = Nil;
    */
   [client removeObserver: nil name: nil];
   [self _lock];
-  for (index = 0; index < _max && NO == found; index++)
+  index = [self _indexOf: client];
+  if (index >= 0 && _items[index].u > 0)
     {
-      if (_items[index].u > 0 && client == _items[index].c)
+      found = YES;
+      if (YES == swallowed)
         {
-          found = YES;
-          if (YES == swallowed)
+          if (NSNotFound == _items[index].u || 1 == _items[index].u)
             {
-              if (NSNotFound == _items[index].u || 1 == _items[index].u)
-                {
-                  /* This was only provided once, and has been explicitly
-                   * swallowed by the pool again, so we should increment
-                   * the reference count to prevent an implicit swallow
-                   * caused by deallocation.
-                   */
-                  _items[index].u = 0;
-                  if (client)
-                    {
-                      NSIncrementExtraRefCount(client);
-                    }
-                }
-              else
+              /* This was only provided once, and has been explicitly
+               * swallowed by the pool again, so we should increment
+               * the reference count to prevent an implicit swallow
+               * caused by deallocation.
+               */
+              _items[index].u = 0;
+              if (client)
                 {
-                  _items[index].u--;
+                  NSIncrementExtraRefCount(client);
                 }
             }
           else
             {
-              /* Nothing is using this client connection any more (it had
-               * -dealloc called), so we know the count must be zero.
-               */
-              _items[index].u = 0;
-            }
-          if (0 == _items[index].u)
-            {
-              DESTROY(_items[index].o);
+              _items[index].u--;
             }
         }
+      else
+        {
+          /* Nothing is using this client connection any more (it had
+           * -dealloc called), so we know the count must be zero.
+           */
+          _items[index].u = 0;
+        }
+      if (0 == _items[index].u)
+        {
+          [self _unshare: index];
+          DESTROY(_items[index].o);
+          [self _freeItem: index];
+        }
     }
   [self _unlock];
 
@@ -757,95 +1269,349 @@ static Class      cls = Nil;
                                       stop: NO];
 }
 
-@end
+- (void) setMaxWaiters: (NSUInteger)count maxWait: (NSTimeInterval)seconds
+{
+  if (seconds < 0.0)
+    {
+      seconds = 0.0;
+    }
+  [_lock lock];
+  _maxWaiters = count;
+  _maxWait = seconds;
+  [self _unlock];
+}
 
-@implementation SQLClientPool (Private)
+- (NSUInteger) waiting
+{
+  NSUInteger    count;
 
-- (void) _lock
+  [_lock lock];
+  count = [_waiters count];
+  [self _unlock];
+  return count;
+}
+
+- (NSArray*) waitTimes
 {
+  NSTimeInterval        now = [NSDate timeIntervalSinceReferenceDate];
+  NSMutableArray        *a;
+  NSUInteger            count;
+  NSUInteger            index;
+
   [_lock lock];
+  count = [_waiters count];
+  a = [NSMutableArray arrayWithCapacity: count];
+  for (index = 0; index < count; index++)
+    {
+      SQLClientPoolWaiter       *w = [_waiters objectAtIndex: index];
+
+      [a addObject: [NSNumber numberWithDouble: now - w->start]];
+    }
+  [self _unlock];
+  return a;
 }
 
-- (SQLClient*) _provideClientBeforeDate: (NSDate*)when
-			      exclusive: (BOOL)isLocal
-			        blocked: (NSTimeInterval*)ti
+@end
+
+@implementation SQLClientPool (Private)
+
+/* Checks the shared cache for the result of stmt (waiting for any load
+ * of it which is already in progress) so that the caching methods need
+ * not take a client from the pool unless the query must actually be
+ * performed.  The record and list types are set up in case the cache
+ * needs to refresh an expired item.
+ */
+- (id) _cached: (int)seconds
+	 query: (SQLLitArg*)stmt
+    recordType: (id)rtype
+      listType: (id)ltype
 {
-  NSThread              *thread = [NSThread currentThread];
-  NSTimeInterval        start = [NSDate timeIntervalSinceReferenceDate];
-  NSTimeInterval        now = start;
-  NSTimeInterval        block = 0.0;
-  NSTimeInterval    	dif = 0.0;
-  SQLClient             *client = nil;
-  int                   preferred = -1;
-  int                   found = -1;
-  int                   cond = 0;
-  int                   index;
+  NSMutableDictionary	*md;
 
-  /* If this is a request for a non-exclusive connection, we can simply
-   * check to see if there's already such a connection available.
-   */
-  if (NO == isLocal)
+  if (seconds <= 0)
     {
-      if (NO == [_lock tryLock])
-	{
-	  [_lock lock];
-	  block = start;
-	}
-      for (index = 0; index < _max; index++)
-        {
-          if (_items[index].o == thread && _items[index].u < NSNotFound
-            && NO == [_items[index].c isInTransaction])
-            {
-              preferred = index;        // Ignore any other connected client
-              break;
-            }
-          if (nil == _items[index].o && 0 == _items[index].u)
-            {
-              if (preferred < 0 && YES == [_items[index].c connected])
-                {
-                  preferred = index;
-                }
-              else
-                {
-                  found = index;
-                }
-            }
+      return nil;
+    }
+  md = [[NSThread currentThread] threadDictionary];
+  if (nil == rtype)
+    {
+      [md removeObjectForKey: @"SQLClientRecordType"];
+    }
+  else
+    {
+      [md setObject: rtype forKey: @"SQLClientRecordType"];
+    }
+  if (nil == ltype)
+    {
+      [md removeObjectForKey: @"SQLClientListType"];
+    }
+  else
+    {
+      [md setObject: ltype forKey: @"SQLClientListType"];
+    }
+  return [_items[0].c _cacheLoaded: stmt];
+}
+
+/* Marks the (free) item at index as provided to thread.
+ */
+- (void) _claim: (int)index
+        thread: (NSThread*)thread
+     exclusive: (BOOL)isLocal
+{
+  if (YES == isLocal)
+    {
+      _items[index].u = NSNotFound;
+    }
+  else
+    {
+      _items[index].u = 1;
+    }
+  _items[index].t = [NSDate timeIntervalSinceReferenceDate];
+  ASSIGN(_items[index].o, thread);
+  if (NO == isLocal)
+    {
+      [self _share: index];
+    }
+  if (_max - _freeCount > _peakUsed)
+    {
+      _peakUsed = _max - _freeCount;
+    }
+}
+
+/* Adds the item at index to the appropriate free list.
+ */
+- (void) _freeItem: (int)index
+{
+  SQLClientPoolItem     *item = &_items[index];
+
+  item->p = -1;
+  item->f = [NSDate timeIntervalSinceReferenceDate];
+  if (YES == [item->c connected])
+    {
+      _idleCount++;
+      item->l = 1;
+      item->n = _idleHead;
+      if (_idleHead >= 0)
+        {
+          _items[_idleHead].p = index;
         }
-      if (preferred >= 0)
+      else
         {
-          found = preferred;    // Prefer a connected client.
+          _idleTail = index;
         }
-      if (found >= 0)
+      _idleHead = index;
+    }
+  else
+    {
+      item->l = 2;
+      item->n = _deadHead;
+      if (_deadHead >= 0)
+        {
+          _items[_deadHead].p = index;
+        }
+      _deadHead = index;
+    }
+  _freeCount++;
+}
+
+- (int) _indexOf: (SQLClient*)client
+{
+  return (int)(intptr_t)NSMapGet(_clients, (void*)client) - 1;
+}
+
+/* Probes connected clients which have been idle in the pool for longer
+ * than the keepalive interval, so that server side idle timeouts do not
+ * close them and so that broken connections are discovered in the
+ * background rather than when a client is next used.  A client which
+ * fails its probe is disconnected.
+ * Must be called with the lock held; the lock is released while each
+ * client is probed.
+ */
+- (void) _keepalive
+{
+  NSThread      *thread = [NSThread currentThread];
+  int           index = _idleTail;
+
+  while (index >= 0)
+    {
+      NSTimeInterval    now = [NSDate timeIntervalSinceReferenceDate];
+      SQLClientPoolItem *item = &_items[index];
+      SQLClient         *c;
+      SQLClient         *next;
+
+      if (now - item->f < _keepalive)
+        {
+          break;        // This and all newer clients were used recently
+        }
+      if (now - item->k < _keepalive)
         {
-          _items[found].t = now;
-          if (0 == _items[found].u++)
+          index = item->p;      // Already probed recently
+          continue;
+        }
+      c = item->c;
+      next = (item->p >= 0) ? _items[item->p].c : nil;
+      [self _takeItem: index];
+      [self _claim: index thread: thread exclusive: YES];
+      [self _unlock];
+      NS_DURING
+        {
+          [c simpleExecute: [NSArray arrayWithObject: _probe]];
+        }
+      NS_HANDLER
+        {
+          NSLog(@"%@ keepalive probe of %@ failed: %@",
+            self, c, localException);
+          NS_DURING
             {
-              ASSIGN(_items[found].o, thread);
-              client = [_items[found].c autorelease];
+              [c disconnect];
             }
-          else
+          NS_HANDLER
             {
-              /* We have already provided this client, so we must retain it
-               * before we autorelease it, to keep retain counts  in sync.
-               */
-              client = [[_items[found].c retain] autorelease];
+              NSLog(@"Error disconnecting client in pool: %@",
+                localException);
             }
-          _immediate++;
+          NS_ENDHANDLER
+        }
+      NS_ENDHANDLER
+      [_lock lock];
+      index = [self _restore: c atTail: YES];
+      if (index >= 0)
+        {
+          _items[index].k = [NSDate timeIntervalSinceReferenceDate];
+        }
+
+      /* We continue with the next (newer) client if it is still idle,
+       * otherwise the list changed while we were unlocked, so we start
+       * again from the oldest client.
+       */
+      index = (nil == next) ? -1 : [self _indexOf: next];
+      if (index < 0 || 1 != _items[index].l)
+        {
+          index = _idleTail;
+        }
+    }
+}
+
+- (void) _lock
+{
+  [_lock lock];
+}
+
+/* Adds a wait for a client to the histogram of wait times.
+ * Must be called with the lock held.
+ */
+- (void) _noteWait: (NSTimeInterval)dif
+{
+  int   bucket = 0;
+
+  while (bucket < SQLClientPoolWaitBuckets - 1 && dif > waitBounds[bucket])
+    {
+      bucket++;
+    }
+  _waitHist[bucket]++;
+}
+
+/* Called periodically in the maintenance thread.
+ */
+- (void) _maintain
+{
+  NSTimeInterval        now = [NSDate timeIntervalSinceReferenceDate];
+
+  if (_autoInterval > 0.0 && now - _autoLast >= _autoInterval)
+    {
+      _autoLast = now;
+      [self _resize];
+    }
+  if (YES == _reaper || _keepalive > 0.0)
+    {
+      [self _lock];
+      if (YES == _reaper)
+        {
+          [self _reap];
+        }
+      if (_keepalive > 0.0)
+        {
+          [self _keepalive];
         }
       [self _unlock];
-      if (nil != client)
+    }
+}
+
+/* Adds the receiver to, or removes it from, the pools examined by the
+ * maintenance thread (starting the thread if necessary).
+ */
+- (void) _maintenanceChanged
+{
+  [maintainLock lock];
+  if (_autoInterval > 0.0 || YES == _reaper || _keepalive > 0.0)
+    {
+      NSHashInsertIfAbsent(maintained, (void*)self);
+      if (nil == maintainThread)
         {
-          if (_debugging > 2)
-            {
-              NSLog(@"%@ provides %p%@",
-                self, _items[found].c, [self _rc: client]);
-            }
-	  if (ti)
-	    {
-	      *ti = block;
-	    }
-          return client;
+          maintainThread = [[NSThread alloc]
+            initWithTarget: [SQLClientPool class]
+                  selector: @selector(_maintenance:)
+                    object: nil];
+          [maintainThread start];
+        }
+    }
+  else
+    {
+      NSHashRemove(maintained, (void*)self);
+    }
+  [maintainLock unlock];
+}
+
+/* Removes and returns the index of a free item (preferring a connected
+ * one), or returns -1 if none is available.
+ */
+- (int) _popFree
+{
+  int   index = (_idleHead >= 0) ? _idleHead : _deadHead;
+
+  if (index >= 0)
+    {
+      [self _takeItem: index];
+    }
+  return index;
+}
+
+- (SQLClient*) _provideClientBeforeDate: (NSDate*)when
+			      exclusive: (BOOL)isLocal
+			       priority: (int)priority
+			        blocked: (NSTimeInterval*)ti
+{
+  NSThread              *thread = [NSThread currentThread];
+  NSTimeInterval        start = [NSDate timeIntervalSinceReferenceDate];
+  NSTimeInterval        now = start;
+  NSTimeInterval        block = 0.0;
+  NSTimeInterval    	dif = 0.0;
+  NSTimeInterval        end;
+  SQLClientPoolWaiter   *w;
+  SQLClient             *client;
+  int                   index;
+
+  if (NO == [_lock tryLock])
+    {
+      [_lock lock];
+      block = start;
+    }
+
+  client = [self _availableFor: thread exclusive: isLocal];
+  if (nil != client)
+    {
+      _immediate++;
+      _recentDelay *= 0.9;
+      [self _unlock];
+      if (_debugging > 2)
+        {
+          NSLog(@"%@ provides %p%@", self, client, [self _rc: client]);
         }
+      if (ti)
+        {
+          *ti = block;
+        }
+      return client;
     }
 
   /* If we haven't been given a timeout, we should wait for a client
@@ -861,136 +1627,126 @@ static Class      cls = Nil;
         }
       when = future;
     }
+  end = [when timeIntervalSinceReferenceDate];
+  block = start;
 
-  /* We want to log stuff if we don't get a client quickly.
-   * Ideally we get the lock straight away,
-   * but if not we want to log every ten seconds (and possibly
-   * when we begin waiting).
+  /* Shed load rather than queueing if we are already overloaded.
    */
-  if ([_lock tryLockWhenCondition: 1])
+  if ((_maxWaiters > 0 && [_waiters count] >= _maxWaiters)
+    || (_maxWait > 0.0 && _recentDelay > _maxWait))
     {
-      _immediate++;
+      NSUInteger        count = [_waiters count];
+      NSTimeInterval    expected = _recentDelay;
+
+      _rejected++;
+      [self _unlock];
+      if (_debugging > 0)
+        {
+          NSLog(@"%@ rejected request with %u waiting (expected wait %g)",
+            self, (unsigned)count, expected);
+        }
+      [NSException raise: SQLOverloadException
+                  format: @"Pool '%@' overloaded: %u waiting,"
+        @" expected wait %g seconds", _name, (unsigned)count, expected];
     }
-  else
+
+  /* Join the queue of waiting threads (behind any others of the same or
+   * higher priority).
+   */
+  w = [SQLClientPoolWaiter new];
+  w->cond = [NSCondition new];
+  w->thread = [thread retain];
+  w->start = start;
+  w->priority = priority;
+  w->exclusive = isLocal;
+  index = [_waiters count];
+  while (index > 0
+    && ((SQLClientPoolWaiter*)[_waiters objectAtIndex: index - 1])->priority
+    < priority)
     {
-      NSTimeInterval    end = [when timeIntervalSinceReferenceDate];
-      NSDate            *until;
-      BOOL              locked;
+      index--;
+    }
+  [_waiters insertObject: w atIndex: index];
+  [self _unlock];
+  if (_debugging > 1)
+    {
+      NSLog(@"%@ has no clients available", self);
+    }
 
-      block = start;
-      if (_debugging > 1)
+  /* We want to log stuff if we don't get a client quickly, so we wake
+   * up to log every ten seconds while waiting.
+   */
+  for (;;)
+    {
+      [w->cond lock];
+      if (nil == w->client && now < end)
         {
-          NSLog(@"%@ has no clients available", self);
+          NSDate        *until;
+
+          until = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:
+            (end < now + 10.0) ? end : now + 10.0];
+          [w->cond waitUntilDate: until];
+          [until release];
         }
-      until = [[NSDate alloc]
-        initWithTimeIntervalSinceReferenceDate: now + 10.0];
-      locked = NO;
-      while (NO == locked && now < end)
+      client = w->client;
+      [w->cond unlock];
+      now = [NSDate timeIntervalSinceReferenceDate];
+      dif = now - start;
+      if (nil != client || now >= end)
         {
-          if (now >= end)
-            {
-              /* End date is passed ... try to get the lock immediately.
-               */
-              locked = [_lock tryLockWhenCondition: 1];
-            }
-          else if ([when earlierDate: until] != when)
-            { 
-              locked = [_lock lockWhenCondition: 1 beforeDate: until];
-            }
-          else
-            { 
-              locked = [_lock lockWhenCondition: 1 beforeDate: when];
-            }
-          now = [NSDate timeIntervalSinceReferenceDate];
-          dif = now - start;
-          if (NO == locked && now < end)
-            {
-              if (_debugging > 0 || dif > 30.0
-                || (_duration >= 0.0 && dif > _duration))
-                {
-                  NSLog(@"%@ still waiting after %g seconds:\n%@%@\n",
-                    self, dif, [self status], [NSThread callStackSymbols]);
-                }
-              [until release];
-              until = [[NSDate alloc] initWithTimeIntervalSinceNow: 10.0];
-            }
+          break;
         }
-      [until release];
-      if (dif > _longest)
+      if (_debugging > 0 || dif > 30.0
+        || (_duration >= 0.0 && dif > _duration))
         {
-          _longest = dif;
+          NSLog(@"%@ still waiting after %g seconds:\n%@%@\n",
+            self, dif, [self status], [NSThread callStackSymbols]);
         }
-      if (NO == locked)
+    }
+
+  if (nil == client)
+    {
+      /* Timed out ... but a client may have been handed to us at the
+       * last moment, so we must check again while holding the lock.
+       */
+      [_lock lock];
+      client = w->client;
+      if (nil == client)
         {
-          if (_debugging > 0 || dif > 30.0
-            || (_duration >= 0.0 && dif > _duration))
+          [_waiters removeObjectIdenticalTo: w];
+          if (dif > _longest)
             {
-              NSLog(@"%@ abandoned wait after %g seconds:\n%@",
-                self, dif, [self status]);
+              _longest = dif;
             }
           _failed++;
           _failWaits += dif;
-	  if (ti)
-	    {
-	      *ti = block;
-	    }
-          return nil;
+          /* A wait which timed out is at least as long as the time we
+           * waited, so it counts towards the estimate of the delay (if
+           * nobody gets a client, the estimate must still rise).
+           */
+          _recentDelay = _recentDelay * 0.9 + dif * 0.1;
+          [self _noteWait: dif];
         }
-      _delayed++;
-      _delayWaits += dif;
+      [self _unlock];
     }
+  [w release];
 
-  for (index = 0; index < _max && 0 == cond; index++)
+  if (nil == client)
     {
-      if (0 == _items[index].u)
+      if (_debugging > 0 || dif > 30.0
+        || (_duration >= 0.0 && dif > _duration))
         {
-          if (preferred >= 0 || found >= 0)
-            {
-              /* There's at least one more client available to be
-               * provided, so we want to re-lock with condition 1.
-               */
-              cond = 1;
-            }
-          if (preferred < 0 && YES == [_items[index].c connected])
-            {
-              preferred = index;
-            }
-          else
-            {
-              found = index;
-            }
+          NSLog(@"%@ abandoned wait after %g seconds:\n%@",
+            self, dif, [self status]);
         }
-      else if (NO == isLocal
-        && _items[index].o == thread
-        && _items[index].u < NSNotFound
-        && NO == [_items[index].c isInTransaction])
+      if (ti)
         {
-          /* We are allowed to re-use connections in the current thread,
-           * so if we have found one, treat it as the preferred choice.
-           */
-          preferred = index;
+          *ti = block;
         }
+      return nil;
     }
 
-  /* We prefer to use a client which is already connected, so we
-   * avoid opening unnecessary connections.
-   */
-  if (preferred >= 0)
-    {
-      found = preferred;
-    }
-  if (YES == isLocal)
-    {
-      _items[found].u = NSNotFound;
-    }
-  else
-    {
-      _items[found].u++;
-    }
-  _items[found].t = now;
-  ASSIGN(_items[found].o, thread);
-  [self _unlock];
-  client = [_items[found].c autorelease];
+  client = [client autorelease];
   if (_debugging > 0 || (_duration >= 0.0 && dif > _duration))
     {
       NSLog(@"%@ provided client %p after %g seconds", self, client, dif);
@@ -1006,6 +1762,49 @@ static Class      cls = Nil;
   return client;
 }
 
+/* Returns an autoreleased client for the thread without waiting, or nil
+ * if none is available.  Must be called with the lock held.
+ */
+- (SQLClient*) _availableFor: (NSThread*)thread exclusive: (BOOL)isLocal
+{
+  int   found;
+
+  /* If this is a request for a non-exclusive connection, a client already
+   * shared with this thread is preferred to any other (as long as it's
+   * not busy in a transaction).
+   */
+  if (NO == isLocal)
+    {
+      found = (int)(intptr_t)NSMapGet(_owners, (void*)thread) - 1;
+      while (found >= 0 && YES == [_items[found].c isInTransaction])
+        {
+          found = _items[found].s;
+        }
+      if (found >= 0)
+        {
+          _items[found].u++;
+          _items[found].t = [NSDate timeIntervalSinceReferenceDate];
+          /* We have already provided this client, so we must retain it
+           * before we autorelease it, to keep retain counts  in sync.
+           */
+          return [[_items[found].c retain] autorelease];
+        }
+    }
+
+  /* Otherwise we take a free client (preferring a connected one).
+   * Since free clients are always handed to queued waiters before the
+   * lock is released, there can only be a free client if nobody else
+   * is waiting, so taking one here does not jump the queue.
+   */
+  found = [self _popFree];
+  if (found >= 0)
+    {
+      [self _claim: found thread: thread exclusive: isLocal];
+      return [_items[found].c autorelease];
+    }
+  return nil;
+}
+
 - (SQLClient*) _provide
 {
   NSTimeInterval	start;
@@ -1013,6 +1812,7 @@ static Class      cls = Nil;
 
   db = [self _provideClientBeforeDate: nil
 			    exclusive: NO
+			     priority: 0
 			      blocked: &start];
   [db _waitPool: start];
   return db;
@@ -1031,15 +1831,8 @@ static Class      cls = Nil;
       rc = [o retainCount];
       ac = [cls autoreleaseCountForObject: o];
       [_lock lock];
-      uc = 0;
-      for (index = 0; index < _max; index++)
-        {
-          if (o == _items[index].c)
-            {
-              uc = _items[index].u;
-              break;
-            }
-        }
+      index = [self _indexOf: o];
+      uc = (index >= 0) ? _items[index].u : 0;
       [self _unlock];
       if (NSNotFound == uc)
         {
@@ -1063,21 +1856,373 @@ static Class      cls = Nil;
   return @"";
 }
 
-- (void) _unlock
+/* Rebuilds the free lists and the maps from clients and threads to
+ * items after the items array has been changed.
+ */
+- (void) _rebuild
 {
   int   index;
 
-  for (index = 0; index < _max; index++)
+  _idleHead = _idleTail = _deadHead = -1;
+  _freeCount = 0;
+  _idleCount = 0;
+  NSResetMapTable(_clients);
+  NSResetMapTable(_owners);
+  for (index = _max - 1; index >= 0; index--)
     {
-      /* Check to see if this client is free to be taken from the pool.
+      SQLClientPoolItem *item = &_items[index];
+
+      item->l = 0;
+      item->p = item->n = item->s = -1;
+      NSMapInsert(_clients, (void*)item->c, (void*)(intptr_t)(index + 1));
+      if (0 == item->u)
+        {
+          [self _freeItem: index];
+        }
+      else if (NSNotFound != item->u && nil != item->o)
+        {
+          [self _share: index];
+        }
+    }
+}
+
+/* Disconnects clients from the oldest end of the list of connected free
+ * clients while they have been idle for longer than the purge limits
+ * (see -setPurgeAll:min:).  Returns the number of clients disconnected.
+ * Must be called with the lock held; the lock is released while each
+ * client is disconnected.
+ */
+- (int) _reap
+{
+  NSThread      *thread = [NSThread currentThread];
+  int           keep;
+  int           count = 0;
+
+  keep = (_autoInterval > 0.0 && _target > _min) ? _target : _min;
+  while (_idleTail >= 0)
+    {
+      int               index = _idleTail;
+      SQLClient         *c = _items[index].c;
+      NSTimeInterval    age;
+      int               connected;
+
+      /* Clients in use are assumed to be connected.
        */
-      if (0 == _items[index].u)
+      connected = _idleCount + (_max - _freeCount);
+      age = [NSDate timeIntervalSinceReferenceDate] - _items[index].f;
+      if (_debugging > 2)
+        {
+          NSLog(@"%@ purge found %p age %g", self, c, age);
+        }
+      if (age <= _purgeAll && (connected <= keep || age <= _purgeMin))
+        {
+          break;
+        }
+      [self _takeItem: index];
+      [self _claim: index thread: thread exclusive: YES];
+      [self _unlock];
+      NS_DURING
+        {
+          [c disconnect];
+        }
+      NS_HANDLER
+        {
+          NSLog(@"Error disconnecting client in pool: %@", localException);
+        }
+      NS_ENDHANDLER
+      [_lock lock];
+      if ([self _restore: c atTail: YES] < 0 || YES == [c connected])
+        {
+          break;        // Failed to disconnect; avoid retrying forever
+        }
+      count++;
+    }
+  return count;
+}
+
+/* Auto-sizing ... adjusts the target number of open connections based
+ * on the provisions since the last adjustment, then opens or closes idle
+ * connections to move towards the target.
+ */
+- (void) _resize
+{
+  NSTimeInterval        now = [NSDate timeIntervalSinceReferenceDate];
+  NSThread              *thread = [NSThread currentThread];
+  uint64_t              immediate;
+  uint64_t              waited;
+  int                   connected;
+  int                   old;
+  int                   index;
+
+  [_lock lock];
+  immediate = _immediate - _autoImmediate;
+  waited = _delayed + _failed + _rejected - _autoWaited;
+  _autoImmediate = _immediate;
+  _autoWaited = _delayed + _failed + _rejected;
+  old = _target;
+  if (waited > 0 && waited * 20 > immediate + waited)
+    {
+      _target += (_target / 4 > 1) ? _target / 4 : 1;
+      if (_target > _max)
+        {
+          _target = _max;
+        }
+    }
+  else if (_peakUsed < _target && _target > _min)
+    {
+      _target--;
+    }
+  connected = 0;
+  for (index = 0; index < _max; index++)
+    {
+      if (YES == [_items[index].c connected])
+        {
+          connected++;
+        }
+    }
+  if (_target != old && _debugging > 0)
+    {
+      NSLog(@"%@ auto-size target changed from %d to %d (%d connected)",
+        self, old, _target, connected);
+    }
+
+  /* Connect idle clients in advance until we reach the target.
+   * Each client is marked as in use while we work on it outside the lock.
+   */
+  while (connected < _target && _deadHead >= 0)
+    {
+      SQLClient *c;
+
+      index = _deadHead;
+      [self _takeItem: index];
+      [self _claim: index thread: thread exclusive: YES];
+      c = _items[index].c;
+      [self _unlock];
+      NS_DURING
         {
-          [_lock unlockWithCondition: 1];
-          return;
+          [c connect];
         }
+      NS_HANDLER
+        {
+          NSLog(@"%@ failed to connect %@: %@", self, c, localException);
+        }
+      NS_ENDHANDLER
+      [_lock lock];
+      if ([self _restore: c atTail: NO] < 0 || NO == [c connected])
+        {
+          break;        // Don't keep trying if the server is unavailable
+        }
+      connected++;
     }
-  [_lock unlockWithCondition: 0];
+
+  /* Disconnect the longest idle clients (if they have been idle for
+   * long enough) until we are down to the target.
+   */
+  while (connected > _target && _idleTail >= 0)
+    {
+      SQLClient         *c;
+
+      index = _idleTail;
+      c = _items[index].c;
+      if (now - _items[index].f < _purgeMin)
+        {
+          break;
+        }
+      [self _takeItem: index];
+      [self _claim: index thread: thread exclusive: YES];
+      [self _unlock];
+      NS_DURING
+        {
+          [c disconnect];
+        }
+      NS_HANDLER
+        {
+          NSLog(@"%@ failed to disconnect %@: %@", self, c, localException);
+        }
+      NS_ENDHANDLER
+      [_lock lock];
+      [self _restore: c atTail: YES];
+      connected--;
+    }
+  _peakUsed = _max - _freeCount;
+  [self _unlock];
+}
+
+/* Returns a client which was claimed for background work to the pool.
+ * If atTail is YES and the client is connected, it is put at the oldest
+ * end of the idle list and keeps its original return time, so that the
+ * background work does not make it appear to have been used recently.
+ * The item is looked up again because -setMax:min: may have changed the
+ * items array while the lock was released for the background work; if
+ * the client was removed from the pool it is released and -1 is returned,
+ * otherwise the index of its item is returned.
+ */
+- (int) _restore: (SQLClient*)client atTail: (BOOL)atTail
+{
+  int                   index = [self _indexOf: client];
+  SQLClientPoolItem     *item;
+  NSTimeInterval        f;
+
+  if (index < 0)
+    {
+      [client release];
+      return -1;
+    }
+  item = &_items[index];
+  f = item->f;
+
+  item->u = 0;
+  DESTROY(item->o);
+  if (YES == atTail && YES == [item->c connected])
+    {
+      _idleCount++;
+      _freeCount++;
+      item->l = 1;
+      item->n = -1;
+      item->p = _idleTail;
+      if (_idleTail >= 0)
+        {
+          _items[_idleTail].n = index;
+        }
+      else
+        {
+          _idleHead = index;
+        }
+      _idleTail = index;
+    }
+  else
+    {
+      [self _freeItem: index];
+      if (YES == atTail)
+        {
+          item->f = f;
+        }
+    }
+  return index;
+}
+
+/* Adds the (shared) item at index to the list of items shared with the
+ * thread owning it.
+ */
+- (void) _share: (int)index
+{
+  NSThread      *thread = _items[index].o;
+
+  _items[index].s = (int)(intptr_t)NSMapGet(_owners, (void*)thread) - 1;
+  NSMapInsert(_owners, (void*)thread, (void*)(intptr_t)(index + 1));
+}
+
+/* Removes the item at index from whichever free list it is in.
+ */
+- (void) _takeItem: (int)index
+{
+  SQLClientPoolItem     *item = &_items[index];
+
+  if (0 == item->l)
+    {
+      return;
+    }
+  if (item->p >= 0)
+    {
+      _items[item->p].n = item->n;
+    }
+  else if (1 == item->l)
+    {
+      _idleHead = item->n;
+    }
+  else
+    {
+      _deadHead = item->n;
+    }
+  if (item->n >= 0)
+    {
+      _items[item->n].p = item->p;
+    }
+  else if (1 == item->l)
+    {
+      _idleTail = item->p;
+    }
+  if (1 == item->l)
+    {
+      _idleCount--;
+    }
+  item->l = 0;
+  item->p = item->n = -1;
+  _freeCount--;
+}
+
+- (void) _unlock
+{
+  /* Before releasing the lock, any free clients are handed directly to
+   * the longest waiting threads (highest priority first).
+   */
+  while (_freeCount > 0 && [_waiters count] > 0)
+    {
+      SQLClientPoolWaiter       *w = [_waiters objectAtIndex: 0];
+      NSTimeInterval            dif;
+      int                       index;
+
+      index = [self _popFree];
+      [self _claim: index thread: w->thread exclusive: w->exclusive];
+      dif = _items[index].t - w->start;
+      if (dif > _longest)
+        {
+          _longest = dif;
+        }
+      _delayed++;
+      _delayWaits += dif;
+      _recentDelay = _recentDelay * 0.9 + dif * 0.1;
+      [self _noteWait: dif];
+      [w->cond lock];
+      w->client = _items[index].c;
+      [w->cond signal];
+      [w->cond unlock];
+      [_waiters removeObjectAtIndex: 0];
+    }
+
+  /* The lock condition is 1 if there is a client free to be taken
+   * from the pool.
+   */
+  [_lock unlockWithCondition: (_freeCount > 0) ? 1 : 0];
+}
+
+/* Removes the item at index from the list of items shared with the
+ * thread owning it (if it is in that list).
+ */
+- (void) _unshare: (int)index
+{
+  NSThread      *thread = _items[index].o;
+  int           prev = -1;
+  int           i;
+
+  if (nil == thread)
+    {
+      return;
+    }
+  i = (int)(intptr_t)NSMapGet(_owners, (void*)thread) - 1;
+  while (i >= 0 && i != index)
+    {
+      prev = i;
+      i = _items[i].s;
+    }
+  if (i < 0)
+    {
+      return;
+    }
+  if (prev >= 0)
+    {
+      _items[prev].s = _items[index].s;
+    }
+  else if (_items[index].s >= 0)
+    {
+      NSMapInsert(_owners, (void*)thread,
+        (void*)(intptr_t)(_items[index].s + 1));
+    }
+  else
+    {
+      NSMapRemove(_owners, (void*)thread);
+    }
+  _items[index].s = -1;
 }
 
 @end
@@ -1093,7 +2238,7 @@ static Class      cls = Nil;
    * First check validity and concatenate parts of the query.
    */
   va_start (ap, stmt);
-  sql = [[_items[0].c prepare: stmt args: ap] objectAtIndex: 0];
+  sql = [[_items[0].c prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   return sql;
@@ -1122,52 +2267,63 @@ static Class      cls = Nil;
 - (NSMutableArray*) cache: (int)seconds
 		    query: (NSString*)stmt,...
 {
-  SQLClient             *db;
-  NSMutableArray        *result;
   SQLLiteral            *query;
   va_list	        ap;
 
   va_start (ap, stmt);
-  query = [[_items[0].c prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[_items[0].c prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
-  db = [self _provide];
-  NS_DURING
-    result = [db cache: seconds simpleQuery: query];
-  NS_HANDLER
-    [self swallowClient: db];
-    [localException raise];
-  NS_ENDHANDLER
-  [self swallowClient: db];
-  return result;
+  return [self cache: seconds
+	 simpleQuery: query
+	  recordType: nil
+	    listType: nil];
 }
 
 - (NSMutableArray*) cache: (int)seconds
 		    query: (NSString*)stmt
 		     with: (NSDictionary*)values
 {
-  SQLClient             *db;
-  NSMutableArray        *result;
+  SQLLiteral            *query;
 
-  db = [self _provide];
-  NS_DURING
-    result = [db cache: seconds query: stmt with: values];
-  NS_HANDLER
-    [self swallowClient: db];
-    [localException raise];
-  NS_ENDHANDLER
-  [self swallowClient: db];
-  return result;
+  query = [[_items[0].c prepareQuery: stmt with: values] objectAtIndex: 0];
+  return [self cache: seconds
+	 simpleQuery: query
+	  recordType: nil
+	    listType: nil];
 }
 
 - (NSMutableArray*) cache: (int)seconds simpleQuery: (SQLLitArg*)stmt;
+{
+  return [self cache: seconds
+	 simpleQuery: stmt
+	  recordType: nil
+	    listType: nil];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+	      simpleQuery: (SQLLitArg*)stmt
+	       recordType: (id)rtype
+	         listType: (id)ltype
 {
   SQLClient             *db;
   NSMutableArray        *result;
 
+  result = [self _cached: seconds
+		   query: stmt
+	      recordType: rtype
+		listType: ltype];
+  if (nil != result)
+    {
+      return [[result mutableCopy] autorelease];
+    }
+
   db = [self _provide];
   NS_DURING
-    result = [db cache: seconds simpleQuery: stmt];
+    result = [db cache: seconds
+           simpleQuery: stmt
+            recordType: rtype
+              listType: ltype];
   NS_HANDLER
     [self swallowClient: db];
     [localException raise];
@@ -1176,20 +2332,37 @@ static Class      cls = Nil;
   return result;
 }
 
-- (NSMutableArray*) cache: (int)seconds
-	      simpleQuery: (SQLLitArg*)stmt
-	       recordType: (id)rtype
-	         listType: (id)ltype
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt
+{
+  return [self cache: seconds
+	 sharedQuery: stmt
+	  recordType: nil
+	    listType: nil];
+}
+
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype
 {
   SQLClient             *db;
-  NSMutableArray        *result;
+  NSArray               *result;
+
+  result = [self _cached: seconds
+		   query: stmt
+	      recordType: rtype
+		listType: ltype];
+  if (nil != result)
+    {
+      return result;
+    }
 
   db = [self _provide];
   NS_DURING
     result = [db cache: seconds
-           simpleQuery: stmt
-            recordType: rtype
-              listType: ltype];
+	   sharedQuery: stmt
+	    recordType: rtype
+	      listType: ltype];
   NS_HANDLER
     [self swallowClient: db];
     [localException raise];
@@ -1198,6 +2371,21 @@ static Class      cls = Nil;
   return result;
 }
 
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt
+{
+  return [[[[self cache] objectForKey: stmt] retain] autorelease];
+}
+
+- (NSUInteger) invalidateCacheTag: (NSString*)tag
+{
+  return [_items[0].c invalidateCacheTag: tag];
+}
+
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt
+{
+  [_items[0].c setCacheTags: tags forQuery: stmt];
+}
+
 - (NSMutableArray*) columns: (NSMutableArray*)records
 {
   return [SQLClient columns: records];
@@ -1267,6 +2455,16 @@ static Class      cls = Nil;
   return [_items[0].c prepare: stmt with: values];
 }
 
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args
+{
+  return [_items[0].c prepareQuery: stmt args: args];
+}
+
+- (NSMutableArray*) prepareQuery: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [_items[0].c prepareQuery: stmt with: values];
+}
+
 - (NSMutableArray*) query: (NSString*)stmt, ...
 {
   SQLClient             *db;
@@ -1278,7 +2476,7 @@ static Class      cls = Nil;
    * First check validity and concatenate parts of the query.
    */
   va_start (ap, stmt);
-  query = [[_items[0].c prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[_items[0].c prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   db = [self _provide];
@@ -1318,7 +2516,7 @@ static Class      cls = Nil;
   va_list	ap;
 
   va_start (ap, stmt);
-  query = [[_items[0].c prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[_items[0].c prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   db = [self _provide];
@@ -1353,7 +2551,7 @@ static Class      cls = Nil;
   va_list	ap;
 
   va_start (ap, stmt);
-  query = [[_items[0].c prepare: stmt args: ap] objectAtIndex: 0];
+  query = [[_items[0].c prepareQuery: stmt args: ap] objectAtIndex: 0];
   va_end (ap);
 
   db = [self _provide];
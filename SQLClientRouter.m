@@ -0,0 +1,618 @@
+/* -*-objc-*- */
+
+/** Implementation of SQLClientRouter for GNUStep
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the SQLClient Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+
+#import	<Foundation/NSArray.h>
+#import	<Foundation/NSDictionary.h>
+#import	<Foundation/NSException.h>
+#import	<Foundation/NSInvocation.h>
+#import	<Foundation/NSLock.h>
+#import	<Foundation/NSString.h>
+#import	<Foundation/NSThread.h>
+#import	<Foundation/NSUserDefaults.h>
+#import	<Foundation/NSValue.h>
+
+#import	<Performance/GSCache.h>
+#import	<Performance/GSTicker.h>
+#import	"SQLClient.h"
+
+@interface      SQLTransaction (Creation)
+- (void) _setRouter: (SQLClientRouter*)router;
+@end
+
+/* The counters may be updated by many threads at once.
+ */
+#define	COUNT(X)	__sync_fetch_and_add(&(X), 1)
+
+@implementation	SQLClientRouter
+
+- (SQLTransaction*) batch: (BOOL)stopOnFailure
+{
+  SQLTransaction	*t = [_primary batch: stopOnFailure];
+
+  /* The write is noted when the batch is executed.
+   */
+  [t _setRouter: self];
+  return t;
+}
+
+- (GSCache*) cache
+{
+  return [_primary cache];
+}
+
+- (void) dealloc
+{
+  DESTROY(_lock);
+  DESTROY(_primary);
+  DESTROY(_replicas);
+  DESTROY(_key);
+  [super dealloc];
+}
+
+- (NSString*) description
+{
+  return [NSString stringWithFormat: @"%@ primary %@ replicas %@",
+    [super description], _primary, _replicas];
+}
+
+- (void) forwardInvocation: (NSInvocation*)anInvocation
+{
+  [anInvocation invokeWithTarget: _primary];
+}
+
+- (id) init
+{
+  return [self initWithPrimary: nil replicas: nil];
+}
+
+- (id) initWithConfiguration: (NSDictionary*)config
+			name: (NSString*)reference
+		     readers: (int)count
+{
+  NSMutableDictionary	*c;
+  NSMutableDictionary	*r;
+  NSMutableDictionary	*e;
+  SQLClientPool		*writer;
+  SQLClientPool		*readers;
+  SQLClient		*client;
+  NSArray		*a;
+  id			o;
+
+  if (nil == config)
+    {
+      config = (NSDictionary*)[NSUserDefaults standardUserDefaults];
+    }
+  if (NO == [reference isKindOfClass: [NSString class]])
+    {
+      reference = [config objectForKey: @"SQLClientName"];
+      if (NO == [reference isKindOfClass: [NSString class]])
+	{
+	  reference = @"Database";
+	}
+    }
+  if (count < 1)
+    {
+      count = 1;
+    }
+
+  /* Build a copy of the configuration in which the entry for the
+   * reference name defaults to WAL journal mode (so that the readers
+   * do not block the writer) and to waiting for a busy database, for
+   * use by the writer.
+   */
+  c = [[NSMutableDictionary new] autorelease];
+  o = [config objectForKey: @"SQLClientReferences"];
+  if ([o isKindOfClass: [NSDictionary class]])
+    {
+      r = [[o mutableCopy] autorelease];
+    }
+  else
+    {
+      r = [[NSMutableDictionary new] autorelease];
+    }
+  o = [r objectForKey: reference];
+  if ([o isKindOfClass: [NSDictionary class]])
+    {
+      e = [[o mutableCopy] autorelease];
+    }
+  else
+    {
+      e = [[NSMutableDictionary new] autorelease];
+    }
+  if (nil == [e objectForKey: @"JournalMode"])
+    {
+      [e setObject: @"WAL" forKey: @"JournalMode"];
+    }
+  if (nil == [e objectForKey: @"BusyTimeout"])
+    {
+      [e setObject: @"5000" forKey: @"BusyTimeout"];
+    }
+  [r setObject: e forKey: reference];
+  [c setObject: r forKey: @"SQLClientReferences"];
+
+  /* Open the writer first, so that the database file exists and is in
+   * WAL mode before any reader (which can neither create the file nor
+   * set the journal mode) connects.
+   */
+  writer = [[[SQLClientPool alloc] initWithConfiguration: c
+    name: reference max: 1 min: 1] autorelease];
+  client = [writer provideClient];
+  [client connect];
+  [writer swallowClient: client];
+
+  /* The readers use the same configuration with the ReadOnly option set.
+   */
+  c = [[c mutableCopy] autorelease];
+  r = [[r mutableCopy] autorelease];
+  e = [[e mutableCopy] autorelease];
+  [e setObject: @"YES" forKey: @"ReadOnly"];
+  [r setObject: e forKey: reference];
+  [c setObject: r forKey: @"SQLClientReferences"];
+  readers = [[[SQLClientPool alloc] initWithConfiguration: c
+    name: reference max: count min: 1] autorelease];
+  a = [NSArray arrayWithObject: readers];
+  return [self initWithPrimary: writer replicas: a];
+}
+
+- (id) initWithPrimary: (SQLClientPool*)primary
+	      replicas: (NSArray*)replicas
+{
+  if (nil == primary)
+    {
+      DESTROY(self);
+      [NSException raise: NSInvalidArgumentException
+		  format: @"[SQLClientRouter-initWithPrimary:replicas:]"
+	@" nil primary pool"];
+    }
+  if (nil != (self = [super init]))
+    {
+      GSCache	*cache = [primary cache];
+      NSUInteger	index;
+
+      _lock = [NSLock new];
+      ASSIGN(_primary, primary);
+      if (nil == replicas)
+	{
+	  replicas = [NSArray array];
+	}
+      ASSIGNCOPY(_replicas, replicas);
+      _key = [[NSString alloc] initWithFormat: @"SQLClientRouter-%p", self];
+
+      /* All the pools should share the same cache, so that results cached
+       * by a query on one replica are available via the others.
+       */
+      for (index = 0; index < [_replicas count]; index++)
+	{
+	  SQLClientPool	*pool = [_replicas objectAtIndex: index];
+
+	  if (NO == [pool isKindOfClass: [SQLClientPool class]])
+	    {
+	      DESTROY(self);
+	      [NSException raise: NSInvalidArgumentException
+			  format: @"[SQLClientRouter-initWithPrimary:replicas:]"
+		@" replica is not a pool"];
+	    }
+	  if (pool != _primary)
+	    {
+	      [pool setCache: cache];
+	    }
+	}
+    }
+  return self;
+}
+
+- (BOOL) leastLoaded
+{
+  return _leastLoaded;
+}
+
+- (NSMethodSignature*) methodSignatureForSelector: (SEL)aSelector
+{
+  NSMethodSignature	*sig = [super methodSignatureForSelector: aSelector];
+
+  if (nil == sig)
+    {
+      sig = [_primary methodSignatureForSelector: aSelector];
+    }
+  return sig;
+}
+
+- (void) noteWrite
+{
+  if (_sticky > 0.0)
+    {
+      NSMutableDictionary	*md;
+      NSNumber			*when;
+
+      md = [[NSThread currentThread] threadDictionary];
+      when = [NSNumber numberWithDouble: GSTickerTimeNow()];
+      [md setObject: when forKey: _key];
+    }
+}
+
+- (SQLClientPool*) primary
+{
+  return _primary;
+}
+
+- (SQLClientPool*) readPool
+{
+  NSUInteger	count = [_replicas count];
+  SQLClientPool	*pool;
+
+  if (0 == count)
+    {
+      return _primary;
+    }
+  if (_sticky > 0.0)
+    {
+      NSMutableDictionary	*md;
+      NSNumber			*when;
+
+      md = [[NSThread currentThread] threadDictionary];
+      when = [md objectForKey: _key];
+      if (nil != when)
+	{
+	  if (GSTickerTimeNow() - [when doubleValue] < _sticky)
+	    {
+	      COUNT(_stuck);
+	      return _primary;
+	    }
+	  [md removeObjectForKey: _key];
+	}
+    }
+  if (1 == count)
+    {
+      pool = [_replicas objectAtIndex: 0];
+    }
+  else if (YES == _leastLoaded)
+    {
+      NSUInteger	index;
+      int		best = -1;
+
+      pool = nil;
+      for (index = 0; index < count; index++)
+	{
+	  SQLClientPool	*p = [_replicas objectAtIndex: index];
+	  int		available = [p availableConnections];
+
+	  if (available > best)
+	    {
+	      best = available;
+	      pool = p;
+	    }
+	}
+    }
+  else
+    {
+      [_lock lock];
+      pool = [_replicas objectAtIndex: _next++ % count];
+      [_lock unlock];
+    }
+  return pool;
+}
+
+- (NSArray*) replicas
+{
+  return _replicas;
+}
+
+- (BOOL) respondsToSelector: (SEL)aSelector
+{
+  if (YES == [super respondsToSelector: aSelector])
+    {
+      return YES;
+    }
+  return [_primary respondsToSelector: aSelector];
+}
+
+- (void) setLeastLoaded: (BOOL)aFlag
+{
+  _leastLoaded = (YES == aFlag) ? YES : NO;
+}
+
+- (void) setStickiness: (NSTimeInterval)seconds
+{
+  if (seconds < 0.0)
+    {
+      seconds = 0.0;
+    }
+  _sticky = seconds;
+}
+
+- (NSString*) statistics
+{
+  return [NSString stringWithFormat:
+    @"  Routed queries:         %llu\n"
+    @"  Routed statements:      %llu\n"
+    @"  Queries kept on primary:%llu\n",
+    (unsigned long long)_reads,
+    (unsigned long long)_writes,
+    (unsigned long long)_stuck];
+}
+
+- (NSTimeInterval) stickiness
+{
+  return _sticky;
+}
+
+- (SQLTransaction*) transaction
+{
+  SQLTransaction	*t = [_primary transaction];
+
+  /* The write is noted when the transaction is executed.
+   */
+  [t _setRouter: self];
+  return t;
+}
+
+- (SQLClientPool*) writePool
+{
+  return _primary;
+}
+
+@end
+
+@implementation SQLClientRouter (Convenience)
+
+- (SQLLiteral*) buildQuery: (NSString*)stmt, ...
+{
+  SQLLiteral	*sql;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  sql = [[_primary prepareQuery: stmt args: ap] objectAtIndex: 0];
+  va_end (ap);
+
+  return sql;
+}
+
+- (NSMutableArray*) cacheCheckSimpleQuery: (NSString*)stmt
+{
+  return [_primary cacheCheckSimpleQuery: stmt];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt,...
+{
+  SQLLiteral            *query;
+  va_list	        ap;
+
+  va_start (ap, stmt);
+  query = [[_primary prepareQuery: stmt args: ap] objectAtIndex: 0];
+  va_end (ap);
+
+  COUNT(_reads);
+  return [[self readPool] cache: seconds simpleQuery: query];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt
+		     with: (NSDictionary*)values
+{
+  COUNT(_reads);
+  return [[self readPool] cache: seconds query: stmt with: values];
+}
+
+- (NSMutableArray*) cache: (int)seconds simpleQuery: (SQLLitArg*)stmt
+{
+  COUNT(_reads);
+  return [[self readPool] cache: seconds simpleQuery: stmt];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+	      simpleQuery: (SQLLitArg*)stmt
+	       recordType: (id)rtype
+	         listType: (id)ltype
+{
+  COUNT(_reads);
+  return [[self readPool] cache: seconds
+		    simpleQuery: stmt
+		     recordType: rtype
+		       listType: ltype];
+}
+
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt
+{
+  COUNT(_reads);
+  return [[self readPool] cache: seconds sharedQuery: stmt];
+}
+
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype
+{
+  COUNT(_reads);
+  return [[self readPool] cache: seconds
+		    sharedQuery: stmt
+		     recordType: rtype
+		       listType: ltype];
+}
+
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt
+{
+  return [_primary cacheCheckSharedQuery: stmt];
+}
+
+- (NSUInteger) invalidateCacheTag: (NSString*)tag
+{
+  return [_primary invalidateCacheTag: tag];
+}
+
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt
+{
+  [_primary setCacheTags: tags forQuery: stmt];
+}
+
+- (NSInteger) execute: (NSString*)stmt, ...
+{
+  NSArray	*info;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  info = [_primary prepare: stmt args: ap];
+  va_end (ap);
+  return [self simpleExecute: info];
+}
+
+- (NSInteger) execute: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [self simpleExecute: [_primary prepare: stmt with: values]];
+}
+
+- (NSMutableArray*) prepare: (NSString*)stmt, ...
+{
+  va_list		ap;
+  NSMutableArray	*result;
+
+  va_start (ap, stmt);
+  result = [_primary prepare: stmt args: ap];
+  va_end (ap);
+
+  return result;
+}
+
+- (NSMutableArray*) query: (NSString*)stmt, ...
+{
+  SQLLiteral            *query;
+  va_list		ap;
+
+  va_start (ap, stmt);
+  query = [[_primary prepareQuery: stmt args: ap] objectAtIndex: 0];
+  va_end (ap);
+
+  return [self simpleQuery: query];
+}
+
+- (NSMutableArray*) query: (NSString*)stmt with: (NSDictionary*)values
+{
+  COUNT(_reads);
+  return [[self readPool] query: stmt with: values];
+}
+
+- (SQLRecord*) queryRecord: (NSString*)stmt, ...
+{
+  NSArray	*result;
+  SQLRecord	*record;
+  SQLLiteral    *query;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  query = [[_primary prepareQuery: stmt args: ap] objectAtIndex: 0];
+  va_end (ap);
+
+  result = [self simpleQuery: query];
+  if ([result count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns more than one record -\n%@\n", query];
+    }
+  record = [result lastObject];
+  if (record == nil)
+    {
+      [NSException raise: SQLEmptyException
+		  format: @"Query returns no data -\n%@\n", query];
+    }
+  return record;
+}
+
+- (NSString*) queryString: (NSString*)stmt, ...
+{
+  NSArray	*result;
+  SQLRecord	*record;
+  SQLLiteral    *query;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  query = [[_primary prepareQuery: stmt args: ap] objectAtIndex: 0];
+  va_end (ap);
+
+  result = [self simpleQuery: query];
+  if ([result count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns more than one record -\n%@\n", query];
+    }
+  record = [result lastObject];
+  if (record == nil)
+    {
+      [NSException raise: SQLEmptyException
+		  format: @"Query returns no data -\n%@\n", query];
+    }
+  if ([record count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns multiple fields -\n%@\n", query];
+    }
+  return [[record lastObject] description];
+}
+
+- (SQLLiteral*) quotef: (NSString*)fmt, ...
+{
+  va_list	ap;
+  NSString	*str;
+  SQLLiteral	*quoted;
+
+  va_start(ap, fmt);
+  str = [[NSString allocWithZone: NSDefaultMallocZone()]
+    initWithFormat: fmt arguments: ap];
+  va_end(ap);
+  quoted = [_primary quoteString: str];
+  [str release];
+  return quoted;
+}
+
+- (NSInteger) simpleExecute: (NSArray*)info
+{
+  NSInteger	result;
+
+  COUNT(_writes);
+  NS_DURING
+    result = [_primary simpleExecute: info];
+  NS_HANDLER
+    [self noteWrite];
+    [localException raise];
+  NS_ENDHANDLER
+  [self noteWrite];
+  return result;
+}
+
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+{
+  COUNT(_reads);
+  return [[self readPool] simpleQuery: stmt];
+}
+
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+		     recordType: (id)rtype
+		       listType: (id)ltype
+{
+  COUNT(_reads);
+  return [[self readPool] simpleQuery: stmt
+			   recordType: rtype
+			     listType: ltype];
+}
+
+@end
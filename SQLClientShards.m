@@ -0,0 +1,863 @@
+/* -*-objc-*- */
+
+/** Implementation of SQLClientShards for GNUStep
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of the SQLClient Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+
+#import	<Foundation/NSArray.h>
+#import	<Foundation/NSDate.h>
+#import	<Foundation/NSDictionary.h>
+#import	<Foundation/NSException.h>
+#import	<Foundation/NSInvocation.h>
+#import	<Foundation/NSProcessInfo.h>
+#import	<Foundation/NSString.h>
+#import	<Foundation/NSThread.h>
+
+#import	<Performance/GSCache.h>
+#import	"SQLClient.h"
+
+/* Counts of provisions made for the threads using a shard.  Each shard
+ * has its own counts (padded to a separate cache line) so that threads
+ * using different shards do not contend for them.
+ */
+typedef struct {
+  uint64_t	local;		// Clients from the local shard
+  uint64_t	stolen;		// Clients from other shards
+  uint64_t	waited;		// Clients waited for
+  char		pad[64 - 3 * sizeof(uint64_t)];
+} ShardCounts;
+
+#define	COUNT(X)	__sync_fetch_and_add(&(X), 1)
+
+/* Returns the share of total for the shard at index when it is divided
+ * as evenly as possible between count shards.
+ */
+static inline int
+shareOf(NSUInteger total, NSUInteger count, NSUInteger index)
+{
+  return (int)((total + count - 1 - index) / count);
+}
+
+@implementation	SQLClientShards
+
+/* Returns the index of the shard used by the current thread.  Thread
+ * objects are aligned in memory, so the low bits of the address are
+ * mixed with higher bits to spread threads evenly across the shards.
+ */
+static inline NSUInteger
+shardIndex(NSUInteger count)
+{
+  uintptr_t	h = (uintptr_t)[NSThread currentThread];
+
+  h ^= h >> 4;
+  h ^= h >> 12;
+  return (NSUInteger)(h % count);
+}
+
+- (int) availableConnections
+{
+  NSUInteger	index;
+  int		total = 0;
+
+  for (index = 0; index < _count; index++)
+    {
+      total += [[_shards objectAtIndex: index] availableConnections];
+    }
+  return total;
+}
+
+- (SQLTransaction*) batch: (BOOL)stopOnFailure
+{
+  return [[self localShard] batch: stopOnFailure];
+}
+
+- (GSCache*) cache
+{
+  return [[_shards objectAtIndex: 0] cache];
+}
+
+- (void) dealloc
+{
+  if (0 != _counts)
+    {
+      free(_counts);
+      _counts = 0;
+    }
+  DESTROY(_shards);
+  [super dealloc];
+}
+
+- (NSString*) description
+{
+  return [NSString stringWithFormat: @"%@ shards %@",
+    [super description], _shards];
+}
+
+- (void) forwardInvocation: (NSInvocation*)anInvocation
+{
+  [anInvocation invokeWithTarget: [_shards objectAtIndex: 0]];
+}
+
+- (id) init
+{
+  return [self initWithConfiguration: nil
+				name: nil
+				 max: 2
+				 min: 1
+			      shards: 0];
+}
+
+- (id) initWithConfiguration: (NSDictionary*)config
+			name: (NSString*)reference
+                         max: (int)maxConnections
+                         min: (int)minConnections
+                      shards: (NSUInteger)count
+{
+  if (nil != (self = [super init]))
+    {
+      NSMutableArray	*a;
+      GSCache		*cache = nil;
+      NSUInteger	index;
+
+      if (0 == count)
+	{
+	  count = [[NSProcessInfo processInfo] activeProcessorCount];
+	}
+      if (maxConnections < 1)
+	{
+	  maxConnections = 1;
+	}
+      if (count > (NSUInteger)maxConnections)
+	{
+	  count = maxConnections;	// At least one connection per shard
+	}
+      if (count < 1)
+	{
+	  count = 1;
+	}
+      a = [NSMutableArray arrayWithCapacity: count];
+      for (index = 0; index < count; index++)
+	{
+	  SQLClientPool	*pool;
+	  int		max;
+	  int		min;
+
+	  /* Divide the connections as evenly as possible between shards.
+	   */
+	  max = shareOf(maxConnections, count, index);
+	  min = shareOf(minConnections, count, index);
+	  if (min < 1)
+	    {
+	      min = 1;
+	    }
+	  if (min > max)
+	    {
+	      min = max;
+	    }
+	  pool = [[SQLClientPool alloc] initWithConfiguration: config
+							 name: reference
+							  max: max
+							  min: min];
+	  if (nil == pool)
+	    {
+	      DESTROY(self);
+	      return nil;
+	    }
+	  if (nil == cache)
+	    {
+	      cache = [pool cache];
+	    }
+	  else
+	    {
+	      [pool setCache: cache];
+	    }
+	  [a addObject: pool];
+	  [pool release];
+	}
+      _shards = [a copy];
+      _count = count;
+      _counts = calloc(count, sizeof(ShardCounts));
+    }
+  return self;
+}
+
+- (SQLClientPool*) localShard
+{
+  return [_shards objectAtIndex: shardIndex(_count)];
+}
+
+- (int) maxConnections
+{
+  NSUInteger	index;
+  int		total = 0;
+
+  for (index = 0; index < _count; index++)
+    {
+      total += [[_shards objectAtIndex: index] maxConnections];
+    }
+  return total;
+}
+
+- (NSMethodSignature*) methodSignatureForSelector: (SEL)aSelector
+{
+  NSMethodSignature	*sig = [super methodSignatureForSelector: aSelector];
+
+  if (nil == sig)
+    {
+      sig = [[_shards objectAtIndex: 0] methodSignatureForSelector: aSelector];
+    }
+  return sig;
+}
+
+/* The counters of all the shards are added together, and the clients
+ * of all the shards are listed.
+ */
+- (NSDictionary*) metrics
+{
+  NSMutableDictionary	*d = nil;
+  NSMutableArray	*buckets = nil;
+  NSMutableArray	*clients = [NSMutableArray array];
+  NSUInteger		index;
+
+  for (index = 0; index < _count; index++)
+    {
+      NSDictionary	*m = [[_shards objectAtIndex: index] metrics];
+      NSArray		*b = [m objectForKey: @"WaitBuckets"];
+      NSEnumerator	*e;
+      NSString		*k;
+      NSUInteger	i;
+
+      [clients addObjectsFromArray: [m objectForKey: @"Clients"]];
+      if (nil == d)
+	{
+	  d = [[m mutableCopy] autorelease];
+	  buckets = [[b mutableCopy] autorelease];
+	  continue;
+	}
+      e = [m keyEnumerator];
+      while (nil != (k = [e nextObject]))
+	{
+	  NSNumber	*v = [m objectForKey: k];
+	  NSNumber	*t = [d objectForKey: k];
+
+	  if ([v isKindOfClass: [NSNumber class]]
+	    && [t isKindOfClass: [NSNumber class]])
+	    {
+	      const char	*type = [v objCType];
+
+	      if ('d' == *type || 'f' == *type)
+		{
+		  t = [NSNumber numberWithDouble:
+		    [t doubleValue] + [v doubleValue]];
+		}
+	      else
+		{
+		  t = [NSNumber numberWithUnsignedLongLong:
+		    [t unsignedLongLongValue] + [v unsignedLongLongValue]];
+		}
+	      [d setObject: t forKey: k];
+	    }
+	}
+      for (i = 0; i < [b count] && i < [buckets count]; i++)
+	{
+	  [buckets replaceObjectAtIndex: i
+	    withObject: [NSNumber numberWithUnsignedLongLong:
+	      [[buckets objectAtIndex: i] unsignedLongLongValue]
+	      + [[b objectAtIndex: i] unsignedLongLongValue]]];
+	}
+    }
+  [d setObject: buckets forKey: @"WaitBuckets"];
+  [d setObject: clients forKey: @"Clients"];
+  return d;
+}
+
+- (int) minConnections
+{
+  NSUInteger	index;
+  int		total = 0;
+
+  for (index = 0; index < _count; index++)
+    {
+      total += [[_shards objectAtIndex: index] minConnections];
+    }
+  return total;
+}
+
+- (NSString*) prometheusMetrics
+{
+  return [SQLClient prometheusMetricsFor: [NSArray arrayWithObject: self]];
+}
+
+- (SQLClient*) provideClient
+{
+  return [self provideClientBeforeDate: nil exclusive: NO];
+}
+
+- (SQLClient*) provideClientBeforeDate: (NSDate*)when exclusive: (BOOL)isLocal
+{
+  NSUInteger	home = shardIndex(_count);
+  SQLClientPool	*pool = [_shards objectAtIndex: home];
+  ShardCounts	*counts = &((ShardCounts*)_counts)[home];
+  SQLClient	*client;
+  NSUInteger	index;
+
+  client = (YES == isLocal)
+    ? [pool tryProvideClientExclusive] : [pool tryProvideClient];
+  if (nil != client)
+    {
+      COUNT(counts->local);
+      return client;
+    }
+
+  /* Try to steal a free client from one of the other shards, starting
+   * with the next one so that threads do not all raid the same shard.
+   */
+  for (index = 1; index < _count; index++)
+    {
+      SQLClientPool	*other;
+
+      other = [_shards objectAtIndex: (home + index) % _count];
+      client = (YES == isLocal)
+	? [other tryProvideClientExclusive] : [other tryProvideClient];
+      if (nil != client)
+	{
+	  COUNT(counts->stolen);
+	  return client;
+	}
+    }
+
+  COUNT(counts->waited);
+  return [pool provideClientBeforeDate: when exclusive: isLocal];
+}
+
+- (SQLClient*) provideClientExclusive
+{
+  return [self provideClientBeforeDate: nil exclusive: YES];
+}
+
+- (void) purge
+{
+  [_shards makeObjectsPerformSelector: @selector(purge)];
+}
+
+- (BOOL) respondsToSelector: (SEL)aSelector
+{
+  if (YES == [super respondsToSelector: aSelector])
+    {
+      return YES;
+    }
+  return [[_shards objectAtIndex: 0] respondsToSelector: aSelector];
+}
+
+- (void) setAutoSizeInterval: (NSTimeInterval)seconds
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setAutoSizeInterval: seconds];
+    }
+}
+
+- (void) setBackgroundPurge: (BOOL)aFlag
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setBackgroundPurge: aFlag];
+    }
+}
+
+- (void) setCache: (GSCache*)aCache
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setCache: aCache];
+    }
+}
+
+- (void) setCacheThread: (NSThread*)aThread
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setCacheThread: aThread];
+    }
+}
+
+- (void) setClientName: (NSString*)s
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      NSString	*n = nil;
+
+      if (nil != s)
+	{
+	  n = [NSString stringWithFormat: @"%@-%lu", s, (unsigned long)index];
+	}
+      [[_shards objectAtIndex: index] setClientName: n];
+    }
+}
+
+- (void) setDebugging: (unsigned int)level
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setDebugging: level];
+    }
+}
+
+- (void) setDurationLogging: (NSTimeInterval)threshold
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setDurationLogging: threshold];
+    }
+}
+
+- (void) setKeepalive: (NSTimeInterval)seconds statement: (NSString*)stmt
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setKeepalive: seconds statement: stmt];
+    }
+}
+
+- (void) setMax: (int)maxConnections min: (int)minConnections
+{
+  NSUInteger	index;
+
+  if (maxConnections < (int)_count)
+    {
+      maxConnections = (int)_count;	// At least one connection per shard
+    }
+  for (index = 0; index < _count; index++)
+    {
+      int	max = shareOf(maxConnections, _count, index);
+      int	min = shareOf(minConnections, _count, index);
+
+      if (min < 1)
+	{
+	  min = 1;
+	}
+      if (min > max)
+	{
+	  min = max;
+	}
+      [[_shards objectAtIndex: index] setMax: max min: min];
+    }
+}
+
+- (void) setMaxWaiters: (NSUInteger)count maxWait: (NSTimeInterval)seconds
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      NSUInteger	n = 0;
+
+      /* A thread waits in its local shard, so the limit on waiting
+       * threads is divided between the shards (but never becomes zero,
+       * since that would remove the limit).
+       */
+      if (count > 0)
+	{
+	  n = (NSUInteger)shareOf(count, _count, index);
+	  if (0 == n)
+	    {
+	      n = 1;
+	    }
+	}
+      [[_shards objectAtIndex: index] setMaxWaiters: n maxWait: seconds];
+    }
+}
+
+- (void) setPurgeAll: (int)allSeconds min: (int)minSeconds
+{
+  NSUInteger	index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [[_shards objectAtIndex: index] setPurgeAll: allSeconds
+					      min: minSeconds];
+    }
+}
+
+- (NSArray*) shards
+{
+  return _shards;
+}
+
+- (NSString*) statistics
+{
+  NSMutableString	*s;
+  NSUInteger		index;
+  uint64_t		local = 0;
+  uint64_t		stolen = 0;
+  uint64_t		waited = 0;
+
+  for (index = 0; index < _count; index++)
+    {
+      ShardCounts	*counts = &((ShardCounts*)_counts)[index];
+
+      local += counts->local;
+      stolen += counts->stolen;
+      waited += counts->waited;
+    }
+  s = [NSMutableString stringWithFormat:
+    @"  Provided from local shard:%llu\n"
+    @"  Provided from other shard:%llu\n"
+    @"  Waited for local shard:   %llu\n",
+    (unsigned long long)local,
+    (unsigned long long)stolen,
+    (unsigned long long)waited];
+  for (index = 0; index < _count; index++)
+    {
+      [s appendString: [[_shards objectAtIndex: index] statistics]];
+    }
+  return s;
+}
+
+- (NSString*) status
+{
+  NSMutableString	*s = [NSMutableString string];
+  NSUInteger		index;
+
+  for (index = 0; index < _count; index++)
+    {
+      [s appendString: [[_shards objectAtIndex: index] status]];
+    }
+  return s;
+}
+
+- (BOOL) swallowClient: (SQLClient*)client
+{
+  SQLClientPool	*pool = [client pool];
+
+  if (nil == pool || NSNotFound == [_shards indexOfObjectIdenticalTo: pool])
+    {
+      return NO;
+    }
+  return [pool swallowClient: client];
+}
+
+- (SQLTransaction*) transaction
+{
+  return [[self localShard] transaction];
+}
+
+- (NSUInteger) waiting
+{
+  NSUInteger	index;
+  NSUInteger	total = 0;
+
+  for (index = 0; index < _count; index++)
+    {
+      total += [[_shards objectAtIndex: index] waiting];
+    }
+  return total;
+}
+
+@end
+
+@implementation SQLClientShards (Convenience)
+
+- (SQLLiteral*) buildQuery: (NSString*)stmt, ...
+{
+  SQLLiteral	*sql;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  sql = [[[_shards objectAtIndex: 0] prepareQuery: stmt args: ap]
+    objectAtIndex: 0];
+  va_end (ap);
+
+  return sql;
+}
+
+- (SQLLiteral*) buildQuery: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [[_shards objectAtIndex: 0] buildQuery: stmt with: values];
+}
+
+- (NSMutableArray*) cacheCheckSimpleQuery: (NSString*)stmt
+{
+  return [[_shards objectAtIndex: 0] cacheCheckSimpleQuery: stmt];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt,...
+{
+  SQLLiteral            *query;
+  va_list	        ap;
+
+  va_start (ap, stmt);
+  query = [[[_shards objectAtIndex: 0] prepareQuery: stmt args: ap]
+    objectAtIndex: 0];
+  va_end (ap);
+
+  return [[self localShard] cache: seconds simpleQuery: query];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+		    query: (NSString*)stmt
+		     with: (NSDictionary*)values
+{
+  return [[self localShard] cache: seconds query: stmt with: values];
+}
+
+- (NSMutableArray*) cache: (int)seconds simpleQuery: (SQLLitArg*)stmt
+{
+  return [[self localShard] cache: seconds simpleQuery: stmt];
+}
+
+- (NSMutableArray*) cache: (int)seconds
+	      simpleQuery: (SQLLitArg*)stmt
+	       recordType: (id)rtype
+	         listType: (id)ltype
+{
+  return [[self localShard] cache: seconds
+		      simpleQuery: stmt
+		       recordType: rtype
+			 listType: ltype];
+}
+
+- (NSArray*) cache: (int)seconds sharedQuery: (SQLLitArg*)stmt
+{
+  return [[self localShard] cache: seconds sharedQuery: stmt];
+}
+
+- (NSArray*) cache: (int)seconds
+       sharedQuery: (SQLLitArg*)stmt
+	recordType: (id)rtype
+	  listType: (id)ltype
+{
+  return [[self localShard] cache: seconds
+		      sharedQuery: stmt
+		       recordType: rtype
+			 listType: ltype];
+}
+
+- (NSArray*) cacheCheckSharedQuery: (NSString*)stmt
+{
+  return [[_shards objectAtIndex: 0] cacheCheckSharedQuery: stmt];
+}
+
+- (NSUInteger) invalidateCacheTag: (NSString*)tag
+{
+  return [[_shards objectAtIndex: 0] invalidateCacheTag: tag];
+}
+
+- (void) setCacheTags: (NSArray*)tags forQuery: (SQLLitArg*)stmt
+{
+  [[_shards objectAtIndex: 0] setCacheTags: tags forQuery: stmt];
+}
+
+- (NSInteger) execute: (NSString*)stmt, ...
+{
+  NSArray	*info;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  info = [[_shards objectAtIndex: 0] prepare: stmt args: ap];
+  va_end (ap);
+  return [self simpleExecute: info];
+}
+
+- (NSInteger) execute: (NSString*)stmt with: (NSDictionary*)values
+{
+  return [self simpleExecute:
+    [[_shards objectAtIndex: 0] prepare: stmt with: values]];
+}
+
+- (NSMutableArray*) prepare: (NSString*)stmt, ...
+{
+  va_list		ap;
+  NSMutableArray	*result;
+
+  va_start (ap, stmt);
+  result = [[_shards objectAtIndex: 0] prepare: stmt args: ap];
+  va_end (ap);
+
+  return result;
+}
+
+- (NSMutableArray*) query: (NSString*)stmt, ...
+{
+  SQLLiteral            *query;
+  va_list		ap;
+
+  va_start (ap, stmt);
+  query = [[[_shards objectAtIndex: 0] prepareQuery: stmt args: ap]
+    objectAtIndex: 0];
+  va_end (ap);
+
+  return [self simpleQuery: query];
+}
+
+- (NSMutableArray*) query: (NSString*)stmt with: (NSDictionary*)values
+{
+  SQLLiteral            *query;
+
+  query = [[[_shards objectAtIndex: 0] prepareQuery: stmt with: values]
+    objectAtIndex: 0];
+  return [self simpleQuery: query];
+}
+
+- (SQLRecord*) queryRecord: (NSString*)stmt, ...
+{
+  NSArray	*result;
+  SQLRecord	*record;
+  SQLLiteral    *query;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  query = [[[_shards objectAtIndex: 0] prepareQuery: stmt args: ap]
+    objectAtIndex: 0];
+  va_end (ap);
+
+  result = [self simpleQuery: query];
+  if ([result count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns more than one record -\n%@\n", query];
+    }
+  record = [result lastObject];
+  if (record == nil)
+    {
+      [NSException raise: SQLEmptyException
+		  format: @"Query returns no data -\n%@\n", query];
+    }
+  return record;
+}
+
+- (NSString*) queryString: (NSString*)stmt, ...
+{
+  NSArray	*result;
+  SQLRecord	*record;
+  SQLLiteral    *query;
+  va_list	ap;
+
+  va_start (ap, stmt);
+  query = [[[_shards objectAtIndex: 0] prepareQuery: stmt args: ap]
+    objectAtIndex: 0];
+  va_end (ap);
+
+  result = [self simpleQuery: query];
+  if ([result count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns more than one record -\n%@\n", query];
+    }
+  record = [result lastObject];
+  if (record == nil)
+    {
+      [NSException raise: SQLEmptyException
+		  format: @"Query returns no data -\n%@\n", query];
+    }
+  if ([record count] > 1)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"Query returns multiple fields -\n%@\n", query];
+    }
+  return [[record lastObject] description];
+}
+
+- (SQLLiteral*) quotef: (NSString*)fmt, ...
+{
+  va_list	ap;
+  NSString	*str;
+  SQLLiteral	*quoted;
+
+  va_start(ap, fmt);
+  str = [[NSString allocWithZone: NSDefaultMallocZone()]
+    initWithFormat: fmt arguments: ap];
+  va_end(ap);
+  quoted = [[_shards objectAtIndex: 0] quoteString: str];
+  [str release];
+  return quoted;
+}
+
+- (NSInteger) simpleExecute: (NSArray*)info
+{
+  SQLClient     *db;
+  NSInteger     result;
+
+  db = [self provideClient];
+  NS_DURING
+    result = [db simpleExecute: info];
+  NS_HANDLER
+    [[db pool] swallowClient: db];
+    [localException raise];
+  NS_ENDHANDLER
+  [[db pool] swallowClient: db];
+  return result;
+}
+
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+{
+  SQLClient             *db;
+  NSMutableArray        *result;
+
+  db = [self provideClient];
+  NS_DURING
+    result = [db simpleQuery: stmt];
+  NS_HANDLER
+    [[db pool] swallowClient: db];
+    [localException raise];
+  NS_ENDHANDLER
+  [[db pool] swallowClient: db];
+  return result;
+}
+
+- (NSMutableArray*) simpleQuery: (SQLLitArg*)stmt
+		     recordType: (id)rtype
+		       listType: (id)ltype
+{
+  SQLClient             *db;
+  NSMutableArray        *result;
+
+  db = [self provideClient];
+  NS_DURING
+    result = [db simpleQuery: stmt
+                  recordType: rtype
+                    listType: ltype];
+  NS_HANDLER
+    [[db pool] swallowClient: db];
+    [localException raise];
+  NS_ENDHANDLER
+  [[db pool] swallowClient: db];
+  return result;
+}
+
+@end
@@ -25,10 +25,12 @@
    $Date$ $Revision$
    */ 
 
+#import	<Foundation/NSArray.h>
 #import	<Foundation/NSAutoreleasePool.h>
 #import	<Foundation/NSCalendarDate.h>
 #import	<Foundation/NSData.h>
 #import	<Foundation/NSDate.h>
+#import	<Foundation/NSDictionary.h>
 #import	<Foundation/NSException.h>
 #import	<Foundation/NSLock.h>
 #import	<Foundation/NSMapTable.h>
@@ -45,14 +47,536 @@
 #define SQLCLIENT_PRIVATE       @public
 
 #include	"SQLClient.h"
+#include	<ctype.h>
+#include	<stdlib.h>
 #include	<string.h>
+#include	<strings.h>
 #include	<sqlite3.h>
 
 @interface SQLClientSQLite : SQLClient
 @end
 
+/* A query prepared with its values to be bound as parameters.  The rest
+ * of SQLClient sees the text of the query with the values quoted into it
+ * (that is used for logging and as the key for caching query results),
+ * while the backend executes the statement with parameters so that the
+ * compiled statement can be reused whatever the values.
+ */
+@interface SQLiteQuery : NSString
+{
+@public
+  NSString	*text;	// The query with values quoted into it
+  NSArray	*info;	// The statement with markers, then the values
+}
+@end
+
+/* The compiled form of an SQL string ... one prepared statement for each
+ * of the SQL statements in the string.
+ */
+typedef struct {
+  unsigned	count;
+  sqlite3_stmt	*stmts[];
+} Compiled;
+
+typedef struct {
+  sqlite3		*_db;
+  NSDictionary		*_options;
+  NSMapTable		*_statements;	// Compiled SQL keyed by text
+  NSMutableArray	*_recent;	// Cache keys, least recently used first
+  NSUInteger		_maxStatements;
+  NSUInteger		_hits;
+  NSUInteger		_misses;
+} ConnectionInfo;
+
+#define	cInfo			((ConnectionInfo*)(self->extra))
+#define	connection		(cInfo->_db)
+#define	options			(cInfo->_options)
+
+/* Default number of compiled SQL strings cached per connection.
+ */
+#define	DEFAULT_STATEMENTS	32
+
+static void
+freeCompiled(Compiled *c)
+{
+  unsigned	i;
+
+  for (i = 0; i < c->count; i++)
+    {
+      sqlite3_finalize(c->stmts[i]);
+    }
+  free(c);
+}
+
+/* Resets the compiled statements (so that they do not keep a read
+ * transaction open) and clears their bindings.
+ */
+static void
+resetCompiled(Compiled *c)
+{
+  unsigned	i;
+
+  for (i = 0; i < c->count; i++)
+    {
+      sqlite3_reset(c->stmts[i]);
+      sqlite3_clear_bindings(c->stmts[i]);
+    }
+}
+
+/* Binds values from args (starting at the index in *next) to the
+ * parameters of the statement, updating *next.  The data is not copied,
+ * so the values must not be changed or released until the statement has
+ * been reset and its bindings cleared.
+ */
+static void
+bindValues(sqlite3_stmt *s, NSArray *args, NSUInteger *next)
+{
+  NSUInteger	count = [args count];
+  int		params = sqlite3_bind_parameter_count(s);
+  int		i;
+
+  for (i = 1; i <= params && *next < count; i++)
+    {
+      id	o = [args objectAtIndex: (*next)++];
+
+      if ([o isKindOfClass: [NSData class]])
+	{
+	  if ([o length] == 0)
+	    {
+	      sqlite3_bind_zeroblob(s, i, 0);
+	    }
+	  else
+	    {
+	      sqlite3_bind_blob(s, i, [o bytes], [o length], SQLITE_STATIC);
+	    }
+	}
+      else if ([o isKindOfClass: [NSDate class]])
+	{
+	  /* Dates are stored as the interval since the reference date,
+	   * as they are when quoted (see -quote:).
+	   */
+	  sqlite3_bind_double(s, i, [o timeIntervalSinceReferenceDate]);
+	}
+      else if ([o isKindOfClass: [NSDecimalNumber class]])
+	{
+	  /* A decimal number reports its type as double, but binding it
+	   * as a double would lose precision, so it is bound as the text
+	   * of its value (as it is when quoted).
+	   */
+	  sqlite3_bind_text(s, i, [[o description] UTF8String], -1,
+	    SQLITE_TRANSIENT);
+	}
+      else if ([o isKindOfClass: [NSNumber class]])
+	{
+	  const char	*t = [o objCType];
+
+	  if ('f' == *t || 'd' == *t)
+	    {
+	      sqlite3_bind_double(s, i, [o doubleValue]);
+	    }
+	  else
+	    {
+	      sqlite3_bind_int64(s, i, [o longLongValue]);
+	    }
+	}
+      else if ([o isKindOfClass: [NSString class]])
+	{
+	  sqlite3_bind_text(s, i, [o UTF8String], -1, SQLITE_STATIC);
+	}
+      else
+	{
+	  sqlite3_bind_null(s, i);
+	}
+    }
+}
+
+/* Returns YES if the SQL statement modifies the database schema, in which
+ * case any cached statements may refer to tables which no longer exist.
+ */
+static BOOL
+isSchemaChange(const char *sql)
+{
+  while (isspace(*sql))
+    {
+      sql++;
+    }
+  if (strncasecmp(sql, "create", 6) == 0
+    || strncasecmp(sql, "drop", 4) == 0
+    || strncasecmp(sql, "alter", 5) == 0)
+    {
+      return YES;
+    }
+  return NO;
+}
+
+@implementation	SQLiteQuery
+
+- (unichar) characterAtIndex: (NSUInteger)index
+{
+  return [text characterAtIndex: index];
+}
+
+- (id) copyWithZone: (NSZone*)z
+{
+  return [self retain];
+}
+
+- (void) dealloc
+{
+  [text release];
+  [info release];
+  [super dealloc];
+}
+
+- (NSString*) description
+{
+  return text;
+}
+
+- (void) getCharacters: (unichar*)buffer range: (NSRange)aRange
+{
+  [text getCharacters: buffer range: aRange];
+}
+
+- (NSUInteger) hash
+{
+  return [text hash];
+}
+
+- (BOOL) isEqual: (id)other
+{
+  return [text isEqual: other];
+}
+
+- (NSUInteger) length
+{
+  return [text length];
+}
+
+- (const char*) UTF8String
+{
+  return [text UTF8String];
+}
+
+@end
+
+/* If the values of the query could be bound (they are in the statement
+ * prepared for execution), replaces the text of the query with a proxy
+ * to an SQLiteQuery holding both the text and the bound form.
+ */
+static NSMutableArray *
+boundQuery(NSMutableArray *query, NSMutableArray *bound)
+{
+  if (1 == [query count] && [bound count] > 1)
+    {
+      SQLiteQuery	*q;
+
+      q = (SQLiteQuery*)NSAllocateObject([SQLiteQuery class], 0,
+	NSDefaultMallocZone());
+      q->text = [SQLClientUnProxyLiteral([query objectAtIndex: 0]) retain];
+      q->info = [bound retain];
+      [query replaceObjectAtIndex: 0 withObject: SQLClientProxyLiteral(q)];
+      [q release];
+    }
+  return query;
+}
+
 @implementation	SQLClientSQLite
 
+- (void) _clearStatements
+{
+  if (0 != cInfo->_statements)
+    {
+      NSMapEnumerator	e = NSEnumerateMapTable(cInfo->_statements);
+      NSString		*k;
+      Compiled		*v;
+
+      while (NSNextMapEnumeratorPair(&e, (void**)&k, (void**)&v) != 0)
+	{
+	  freeCompiled(v);
+	}
+      NSEndMapTableEnumeration(&e);
+      NSResetMapTable(cInfo->_statements);
+    }
+  [cInfo->_recent removeAllObjects];
+}
+
+/* Sets the named pragma to the value of the configuration option (if
+ * the option is present).
+ */
+- (void) _pragma: (NSString*)name option: (NSString*)key
+{
+  id	o = [options objectForKey: key];
+
+  if ([o isKindOfClass: [NSNumber class]])
+    {
+      o = [o stringValue];
+    }
+  if ([o isKindOfClass: [NSString class]] && [o length] > 0)
+    {
+      NSString	*s;
+
+      s = [NSString stringWithFormat: @"PRAGMA %@=%@", name, o];
+      if (sqlite3_exec(connection, [s UTF8String], 0, 0, 0) != SQLITE_OK)
+	{
+	  [self debug: @"Unable to set %@ of '%@' - %s",
+	    name, [self name], sqlite3_errmsg(connection)];
+	}
+    }
+}
+
+/* Steps through a prepared statement until it is done, adding any rows
+ * produced to records (if records is not nil).
+ * Returns the final result code.
+ */
+- (int) _step: (sqlite3_stmt*)prepared
+      records: (NSMutableArray*)records
+   recordType: (id)rtype
+{
+  int	result;
+
+  if ((result = sqlite3_step(prepared)) == SQLITE_ROW && nil != records)
+    {
+      int		columns = sqlite3_column_count(prepared);
+      NSString		*keys[columns];
+      int		i;
+
+      for (i = 0; i < columns; i++)
+	{
+	  keys[i] = [NSString stringWithUTF8String: 
+	    sqlite3_column_name(prepared, i)];
+	}
+
+      do
+	{
+	  id		values[columns];
+	  SQLRecord	*record;
+
+	  for (i = 0; i < columns; i++)
+	    {
+	      int	type = sqlite3_column_type(prepared, i);
+
+	      switch (type)
+		{
+		  case SQLITE_INTEGER:
+		    values[i] = [NSNumber numberWithInt:
+		      sqlite3_column_int(prepared, i)];
+		    break;
+
+		  case SQLITE_FLOAT:
+		    values[i] = [NSNumber numberWithDouble:
+		      sqlite3_column_double(prepared, i)];
+		    break;
+
+		  case SQLITE_TEXT:
+		    values[i] = [NSString stringWithUTF8String:
+		      (char *)sqlite3_column_text(prepared, i)];
+		    break;
+
+		  case SQLITE_BLOB:
+		    values[i] = [NSData dataWithBytes:
+		      sqlite3_column_blob(prepared, i)
+		      length: sqlite3_column_bytes(prepared, i)];
+		    break;
+
+		  case SQLITE_NULL:
+		  default:
+		    values[i] = nil;
+		    break;
+		}
+	    }
+
+	  record = [rtype newWithValues: values
+				   keys: keys
+				  count: columns];
+	  [records addObject: record];
+	  [record release];
+	}
+      while ((result = sqlite3_step(prepared)) == SQLITE_ROW);
+    }
+  while (SQLITE_ROW == result)
+    {
+      result = sqlite3_step(prepared);	// Discard unwanted rows
+    }
+  return result;
+}
+
+/* Executes the SQL (which may contain multiple statements), adding any
+ * rows produced to records.  If key (the text of the SQL) is not nil, the
+ * compiled statements are reset and kept in a cache for reuse, unless the
+ * SQL changes the schema, in which case the cache is emptied.
+ */
+- (void) _perform: (NSString*)key
+	      sql: (const char*)sql
+	   length: (unsigned)length
+	     args: (NSArray*)args
+	  records: (NSMutableArray*)records
+       recordType: (id)rtype
+{
+  NSUInteger		next = 1;	// Index of first value to bind
+  Compiled * volatile	c = 0;
+  const char		*end = sql + length;
+  BOOL			cacheable;
+  volatile BOOL		changed = NO;
+  NSString		*m = nil;
+  int			result = SQLITE_DONE;
+  unsigned		i;
+
+  cacheable = (cInfo->_maxStatements > 0 && nil != key) ? YES : NO;
+
+  if (YES == cacheable && 0 == cInfo->_statements)
+    {
+      cInfo->_statements = NSCreateMapTable(NSObjectMapKeyCallBacks,
+	NSNonOwnedPointerMapValueCallBacks, 0);
+      cInfo->_recent = [NSMutableArray new];
+    }
+  if (YES == cacheable)
+    {
+      c = (Compiled*)NSMapGet(cInfo->_statements, (void*)key);
+    }
+
+  if (0 != c)
+    {
+      NSUInteger	index;
+
+      cInfo->_hits++;
+      index = [cInfo->_recent indexOfObject: key];
+      if (index != NSNotFound && index + 1 < [cInfo->_recent count])
+	{
+	  id	k = [[cInfo->_recent objectAtIndex: index] retain];
+
+	  [cInfo->_recent removeObjectAtIndex: index];
+	  [cInfo->_recent addObject: k];
+	  [k release];
+	}
+
+      /* The statements must be reset even if an exception is raised
+       * while reading the results, or they would keep a read transaction
+       * open (blocking checkpoints and making the connection busy).
+       */
+      NS_DURING
+	{
+	  for (i = 0; i < c->count && SQLITE_DONE == result; i++)
+	    {
+	      bindValues(c->stmts[i], args, &next);
+	      result = [self _step: c->stmts[i]
+			   records: records
+			recordType: rtype];
+	      if (result != SQLITE_DONE)
+		{
+		  m = [NSString stringWithUTF8String:
+		    sqlite3_errmsg(connection)];
+		}
+	    }
+	}
+      NS_HANDLER
+	{
+	  resetCompiled(c);
+	  [localException raise];
+	}
+      NS_ENDHANDLER
+      resetCompiled(c);
+      if (result != SQLITE_DONE)
+	{
+	  if (SQLITE_SCHEMA == result)
+	    {
+	      [self _clearStatements];
+	    }
+	  [NSException raise: SQLException format: @"%@", m];
+	}
+      return;
+    }
+
+  /* Not cached ... compile and execute each statement in turn (a later
+   * statement may depend upon the effects of an earlier one).
+   */
+  cInfo->_misses++;
+  c = (Compiled*)malloc(sizeof(Compiled) + sizeof(sqlite3_stmt*));
+  c->count = 0;
+  NS_DURING
+    {
+      while (sql < end)
+	{
+	  sqlite3_stmt	*prepared = 0;
+	  const char	*tail = 0;
+	  Compiled	*n;
+
+	  result = sqlite3_prepare_v2(connection, sql, end - sql,
+	    &prepared, &tail);
+	  if (result != SQLITE_OK)
+	    {
+	      m = [NSString stringWithUTF8String: sqlite3_errmsg(connection)];
+	      [NSException raise: SQLException
+		format: @"Unable to prepare '%s' - %@", sql, m];
+	    }
+	  sql = tail;
+	  if (0 == prepared)
+	    {
+	      continue;	// Whitespace or comment
+	    }
+	  n = (Compiled*)realloc(c,
+	    sizeof(Compiled) + sizeof(sqlite3_stmt*) * (c->count + 1));
+	  n->stmts[n->count++] = prepared;
+	  c = n;
+	  if (YES == isSchemaChange(sqlite3_sql(prepared)))
+	    {
+	      changed = YES;
+	    }
+	  bindValues(prepared, args, &next);
+	  result = [self _step: prepared records: records recordType: rtype];
+	  sqlite3_reset(prepared);
+	  sqlite3_clear_bindings(prepared);
+	  if (result != SQLITE_DONE)
+	    {
+	      m = [NSString stringWithUTF8String: sqlite3_errmsg(connection)];
+	      [NSException raise: SQLException format: @"%@", m];
+	    }
+	}
+    }
+  NS_HANDLER
+    {
+      freeCompiled(c);
+      if (YES == changed)
+	{
+	  [self _clearStatements];
+	}
+      [localException raise];
+    }
+  NS_ENDHANDLER
+
+  if (YES == changed)
+    {
+      /* Cached statements may refer to tables/indexes which have gone.
+       */
+      [self _clearStatements];
+      cacheable = NO;
+    }
+  if (NO == cacheable || 0 == c->count)
+    {
+      freeCompiled(c);
+      return;
+    }
+
+  /* Discard the least recently used entry if the cache is full.
+   */
+  if ([cInfo->_recent count] >= cInfo->_maxStatements)
+    {
+      id	old = [cInfo->_recent objectAtIndex: 0];
+      Compiled	*o = (Compiled*)NSMapGet(cInfo->_statements, (void*)old);
+
+      if (0 != o)
+	{
+	  freeCompiled(o);
+	}
+      NSMapRemove(cInfo->_statements, (void*)old);
+      [cInfo->_recent removeObjectAtIndex: 0];
+    }
+  key = [[NSString alloc] initWithString: key];
+  NSMapInsert(cInfo->_statements, (void*)key, (void*)c);
+  [cInfo->_recent addObject: key];
+  [key release];
+}
+
 /* use [self database] as path to database file */
 - (BOOL) backendConnect
 {
@@ -62,8 +586,17 @@
 	{
 	  NSString	*dbase = [self database];
 	  sqlite3	*sql;
+	  int		flags;
 	  int		result;
 
+	  if (0 == extra)
+	    {
+	      extra = NSZoneMalloc(NSDefaultMallocZone(),
+		sizeof(ConnectionInfo));
+	      memset(extra, '\0', sizeof(ConnectionInfo));
+	      cInfo->_maxStatements = DEFAULT_STATEMENTS;
+	    }
+
 	  [[self class] purgeConnections: nil];
 
 	  if ([self debugging] > 0)
@@ -71,18 +604,61 @@
 	      [self debug: @"Connect to '%@' as %@",
 		[self database], [self name]];
 	    }
-	  result = sqlite3_open([dbase fileSystemRepresentation], &sql);
+	  if ([[options objectForKey: @"ReadOnly"] boolValue] == YES)
+	    {
+	      flags = SQLITE_OPEN_READONLY;
+	    }
+	  else
+	    {
+	      flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	    }
+	  /* Access to the connection is serialised by the client lock, so
+	   * SQLite need not do its own locking.
+	   */
+	  if ([[options objectForKey: @"NoMutex"] boolValue] == YES)
+	    {
+	      flags |= SQLITE_OPEN_NOMUTEX;
+	    }
+	  if ([[options objectForKey: @"SharedCache"] boolValue] == YES)
+	    {
+	      flags |= SQLITE_OPEN_SHAREDCACHE;
+	    }
+	  result = sqlite3_open_v2([dbase fileSystemRepresentation], &sql,
+	    flags, 0);
 	  if (result != 0)
 	    {
 	      [self debug: @"Error connecting to '%@' (%@) - %s",
 		[self name], [self database], sqlite3_errmsg(sql)];
 	      sqlite3_close(sql);
-	      extra = 0;
+	      connection = 0;
 	    }
 	  else
 	    {
+	      id	o;
+
 	      connected = YES;
-              extra = sql;
+              connection = sql;
+
+	      o = [options objectForKey: @"BusyTimeout"];
+	      if ([o intValue] > 0)
+		{
+		  sqlite3_busy_timeout(sql, [o intValue]);
+		}
+
+	      /* The page size must be set before the journal mode (it can
+	       * not be changed in WAL mode).  The journal mode is persistent
+	       * in the database file, so it can only be set by a connection
+	       * which may write to it.
+	       */
+	      [self _pragma: @"page_size" option: @"PageSize"];
+	      if (0 == (flags & SQLITE_OPEN_READONLY))
+		{
+		  [self _pragma: @"journal_mode" option: @"JournalMode"];
+		}
+	      [self _pragma: @"mmap_size" option: @"MmapSize"];
+	      [self _pragma: @"cache_size" option: @"CacheSize"];
+	      [self _pragma: @"synchronous" option: @"Synchronous"];
+	      [self _pragma: @"temp_store" option: @"TempStore"];
 
 	      if ([self debugging] > 0)
 		{
@@ -114,8 +690,9 @@
 	    {
 	      [self debug: @"Disconnecting client %@", [self clientName]];
 	    }
-	  sqlite3_close((sqlite3 *)extra);
-	  extra = 0;
+	  [self _clearStatements];
+	  sqlite3_close(connection);
+	  connection = 0;
 	  if ([self debugging] > 0)
 	    {
 	      [self debug: @"Disconnected client %@", [self clientName]];
@@ -123,7 +700,7 @@
 	}
       NS_HANDLER
 	{
-	  extra = 0;
+	  connection = 0;
 	  [self debug: @"Error disconnecting from database (%@): %@",
 	    [self clientName], localException];
 	}
@@ -147,10 +724,9 @@
 
   NS_DURING
     {
+      NSString		*key;
       const char	*statement;
       unsigned		length;
-      int		result;
-      char		*err;
 
       /*
        * Ensure we have a working connection.
@@ -162,20 +738,33 @@
 	    [self name], stmt];
 	} 
 
-      statement = (char*)[stmt UTF8String];
-      length = strlen(statement);
-      statement = [self insertBLOBs: info
-	              intoStatement: statement
-			     length: length
-			 withMarker: "'?'''?'"
-			     length: 7
-			     giving: &length];
-
-      result = sqlite3_exec((sqlite3 *)extra, statement, 0, 0, &err);
-      if (result != SQLITE_OK)
+      /* Values to be bound are marked in the statement text ... replace
+       * the markers with SQLite parameters.  The text is then the same
+       * for every execution (whatever the values), so the compiled
+       * statement can be reused.  Text without parameters probably has
+       * literal values in it, so it is not worth caching (it would push
+       * reusable statements out of the cache).
+       */
+      key = nil;
+      if ([info count] > 1)
 	{
-	  [NSException raise: SQLException format: @"%s", err];
+	  NSMutableString	*m = [[stmt mutableCopy] autorelease];
+
+	  [m replaceOccurrencesOfString: @"'?'''?'"
+			     withString: @"?"
+				options: NSLiteralSearch
+				  range: NSMakeRange(0, [m length])];
+	  stmt = m;
+	  key = stmt;
 	}
+      statement = [stmt UTF8String];
+      length = strlen(statement);
+      [self _perform: key
+		 sql: statement
+	      length: length
+		args: info
+	     records: nil
+	  recordType: nil];
     }
   NS_HANDLER
     {
@@ -216,10 +805,10 @@
 
   NS_DURING
     {
-      char		*statement;
-      int		result;
-      sqlite3_stmt	*prepared;
-      const char	*stmtEnd;
+      NSString		*sql = stmt;
+      NSString		*key = nil;
+      NSArray		*args = nil;
+      const char	*statement;
 
       /*
        * Ensure we have a working connection.
@@ -231,78 +820,34 @@
 	    [self name], stmt];
 	} 
 
-      statement = (char*)[stmt UTF8String];
-      result = sqlite3_prepare((sqlite3 *)extra,
-	statement, strlen(statement), &prepared, &stmtEnd);
-      if (result != SQLITE_OK)
+      /* A query built by -prepareQuery:args: or -prepareQuery:with: has
+       * its values to be bound, so (as in -backendExecute:) we replace
+       * the markers with parameters and cache the compiled statement.
+       * Other query text contains literal values, so we don't cache it.
+       */
+      if (YES == SQLClientIsLiteral(stmt))
 	{
-	  [NSException raise: SQLException
-	    format: @"Unable to prepare '%@'", stmt];
+	  sql = SQLClientUnProxyLiteral(stmt);
 	}
-      if ((result = sqlite3_step(prepared)) == SQLITE_ROW)
-        {
-	  int		columns = sqlite3_column_count(prepared);
-	  NSString	*keys[columns];
-	  int		i;
-
-	  for (i = 0; i < columns; i++)
-	    {
-	      keys[i] = [NSString stringWithUTF8String: 
-		sqlite3_column_name(prepared, i)];
-	    }
-
-          do
-	    {
-	      id		values[columns];
-	      SQLRecord		*record;
-
-	      for (i = 0; i < columns; i++)
-		{
-		  int	type = sqlite3_column_type(prepared, i);
-
-		  switch (type)
-		    {
-		      case SQLITE_INTEGER:
-			values[i] = [NSNumber numberWithInt:
-			  sqlite3_column_int(prepared, i)];
-			break;
-
-		      case SQLITE_FLOAT:
-			values[i] = [NSNumber numberWithDouble:
-			  sqlite3_column_double(prepared, i)];
-			break;
-
-		      case SQLITE_TEXT:
-			values[i] = [NSString stringWithUTF8String:
-			  (char *)sqlite3_column_text(prepared, i)];
-			break;
-
-		      case SQLITE_BLOB:
-			values[i] = [NSData dataWithBytes:
-			  sqlite3_column_blob(prepared, i)
-			  length: sqlite3_column_bytes(prepared, i)];
-			break;
-
-		      case SQLITE_NULL:
-			values[i] = nil;
-			break;
-		    }
-		}
-
-	      record = [rtype newWithValues: values
-				       keys: keys
-				      count: columns];
-	      [records addObject: record];
-	      [record release];
-	    }
-	  while ((result = sqlite3_step(prepared)) == SQLITE_ROW);
-        }
-      if (result != SQLITE_DONE)
-        {
-	  [NSException raise: SQLException
-		      format: @"%s", sqlite3_errmsg((sqlite3 *)extra)];
+      if ([sql isKindOfClass: [SQLiteQuery class]])
+	{
+	  NSMutableString	*m;
+
+	  args = ((SQLiteQuery*)sql)->info;
+	  m = [[[args objectAtIndex: 0] mutableCopy] autorelease];
+	  [m replaceOccurrencesOfString: @"'?'''?'"
+			     withString: @"?"
+				options: NSLiteralSearch
+				  range: NSMakeRange(0, [m length])];
+	  sql = key = m;
 	}
-      sqlite3_finalize(prepared);
+      statement = [sql UTF8String];
+      [self _perform: key
+		 sql: statement
+	      length: strlen(statement)
+		args: args
+	     records: records
+	  recordType: rtype];
     }
   NS_HANDLER
     {
@@ -327,34 +872,81 @@
   return [records autorelease];
 }
 
-static char hex[16] = "0123456789ABCDEF";
-- (unsigned) copyEscapedBLOB: (NSData*)blob into: (void*)buf
+- (BOOL) bindsValue: (id)obj
 {
-  const unsigned char	*bytes = [blob bytes];
-  unsigned char		*ptr = buf;
-  unsigned		length = [blob length];
-  unsigned		i;
+  if ([obj isKindOfClass: [NSData class]]
+    || [obj isKindOfClass: [NSDate class]]
+    || [obj isKindOfClass: [NSNumber class]]
+    || [obj isKindOfClass: [NSString class]])
+    {
+      return YES;
+    }
+  return NO;
+}
 
-  *ptr++ = 'X';
-  *ptr++ = '\'';
-  for (i = 0; i < length; i++)
+- (void) dealloc
+{
+  if (extra != 0)
     {
-      unsigned char     c = bytes[i];
+      if (YES == connected)
+	{
+	  [self disconnect];
+	}
+      if (0 != cInfo->_statements)
+	{
+	  NSFreeMapTable(cInfo->_statements);
+	}
+      RELEASE(cInfo->_recent);
+      RELEASE(options);
+      NSZoneFree(NSDefaultMallocZone(), extra);
+      extra = 0;
+    }
+  [super dealloc];
+}
+
+/* Adds the hits and misses of the compiled statement cache to the
+ * metrics of the client.
+ */
+- (NSDictionary*) metrics
+{
+  NSMutableDictionary	*m;
 
-      *ptr++ = hex[c / 16];
-      *ptr++ = hex[c % 16];;
+  m = [[[super metrics] mutableCopy] autorelease];
+  if (0 != extra)
+    {
+      [m setObject: [NSNumber numberWithUnsignedInteger: cInfo->_hits]
+	    forKey: @"StatementCacheHits"];
+      [m setObject: [NSNumber numberWithUnsignedInteger: cInfo->_misses]
+	    forKey: @"StatementCacheMisses"];
     }
-  *ptr++ = '\'';
-  return ((void*)ptr - buf);
+  return m;
 }
 
-- (unsigned) lengthOfEscapedBLOB: (NSData*)blob
+/* Queries are passed through SQLClient as text, but we also prepare them
+ * with the values to be bound, so that -backendQuery:recordType:listType:
+ * can use (and cache) a compiled statement with parameters.
+ */
+- (NSMutableArray*) prepareQuery: (NSString*)stmt args: (va_list)args
 {
-  /*
-   * A blob is X'xx' where xx is  hexadecimal encoded binary data ...
-   * two hex digits per byte.
-   */
-  return 3 + [blob length] * 2;
+  NSMutableArray	*query;
+  NSMutableArray	*bound;
+  va_list		ap;
+
+  va_copy(ap, args);
+  query = [super prepareQuery: stmt args: args];
+  bound = [self prepare: stmt args: ap];
+  va_end(ap);
+  return boundQuery(query, bound);
+}
+
+- (NSMutableArray*) prepareQuery: (NSString*)stmt with: (NSDictionary*)values
+{
+  NSMutableArray	*query;
+  NSMutableArray	*bound;
+
+  query = [super prepareQuery: stmt with: values];
+  bound = [self prepare: stmt with: values];
+  return boundQuery(query, bound);
 }
 
 - (NSString*) quote: (id)obj
@@ -366,5 +958,38 @@ static char hex[16] = "0123456789ABCDEF";
   return [super quote: obj];
 }
 
+- (void) setOptions: (NSDictionary*)o
+{
+  id	n;
+
+  if (0 == extra)
+    {
+      extra = NSZoneMalloc(NSDefaultMallocZone(), sizeof(ConnectionInfo));
+      memset(extra, '\0', sizeof(ConnectionInfo));
+    }
+  ASSIGNCOPY(options, o);
+
+  /* The PreparedStatements option gives the number of SQL strings whose
+   * compiled statements are cached for reuse.
+   */
+  n = [options objectForKey: @"PreparedStatements"];
+  if (nil == n)
+    {
+      cInfo->_maxStatements = DEFAULT_STATEMENTS;
+    }
+  else if ([n respondsToSelector: @selector(intValue)] && [n intValue] > 0)
+    {
+      cInfo->_maxStatements = [n intValue];
+    }
+  else
+    {
+      cInfo->_maxStatements = 0;
+    }
+  if (connection != 0)
+    {
+      [self _clearStatements];
+    }
+}
+
 @end
 
@@ -128,6 +128,144 @@ main()
 
   NSLog(@"Records - %@", records);
 
+  /* Benchmark decoding of date/time values over a million row result
+   * (the cross product of a thousand row table with itself).
+   */
+  NS_DURING
+  [db execute: @"drop table yyy", nil];
+  NS_HANDLER
+  NS_ENDHANDLER
+  [db execute: @"create table yyy ( "
+    @"ts timestamp, "
+    @"dt datetime, "
+    @"d date"
+    @")",
+    nil];
+  {
+    NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+    NSMutableString	*m = [NSMutableString stringWithCapacity: 80000];
+    NSDate		*start;
+    NSTimeInterval	elapsed;
+
+    [m appendString: @"insert into yyy (ts, dt, d) values "];
+    for (i = 0; i < 1000; i++)
+      {
+	[m appendFormat: @"%s('2024-%02u-%02u %02u:%02u:%02u',"
+	  @" '1999-%02u-%02u %02u:%02u:%02u', '2010-%02u-%02u')",
+	  (0 == i ? "" : ", "),
+	  i % 12 + 1, i % 28 + 1, i % 24, i % 60, (i * 7) % 60,
+	  i % 12 + 1, i % 28 + 1, i % 24, i % 60, (i * 7) % 60,
+	  i % 12 + 1, i % 28 + 1];
+      }
+    [db execute: m, nil];
+
+    start = [NSDate date];
+    records = [db query: @"select a.ts, a.dt, b.d from yyy a, yyy b", nil];
+    elapsed = [[NSDate date] timeIntervalSinceDate: start];
+    if ([records count] != 1000000)
+      {
+	NSLog(@"Expected 1000000 records but got %" PRIuPTR "",
+	  [records count]);
+      }
+    else
+      {
+	record = [records lastObject];
+	NSLog(@"Decoded %" PRIuPTR " rows of dates in %g seconds (%g/sec)"
+	  @" last %@", [records count], elapsed,
+	  [records count] / elapsed, record);
+      }
+    [arp release];
+  }
+
+  /* Check that decoded values match those inserted (dates are returned
+   * as GMT), and that a zero date (which is not a valid date) is
+   * returned as text.
+   */
+  {
+    NSString	*fmt = @"%Y-%m-%d %H:%M:%S %z";
+    NSDate	*ts;
+    NSDate	*dt;
+    NSDate	*d;
+
+    ts = [NSCalendarDate dateWithString: @"2024-01-01 00:00:00 +0000"
+			 calendarFormat: fmt];
+    dt = [NSCalendarDate dateWithString: @"1999-01-01 00:00:00 +0000"
+			 calendarFormat: fmt];
+    d = [NSCalendarDate dateWithString: @"2010-01-01 00:00:00 +0000"
+			calendarFormat: fmt];
+    records = [db query: @"select ts, dt, d from yyy"
+      @" where dt = '1999-01-01 00:00:00'", nil];
+    if ([records count] != 1)
+      {
+	NSLog(@"Expected 1 date record but got %" PRIuPTR "",
+	  [records count]);
+      }
+    else
+      {
+	record = [records objectAtIndex: 0];
+	if ([[record objectForKey: @"ts"] isEqual: ts] == NO)
+	  {
+	    NSLog(@"Retrieved timestamp %@ does not match %@",
+	      [record objectForKey: @"ts"], ts);
+	  }
+	if ([[record objectForKey: @"dt"] isEqual: dt] == NO)
+	  {
+	    NSLog(@"Retrieved datetime %@ does not match %@",
+	      [record objectForKey: @"dt"], dt);
+	  }
+	if ([[record objectForKey: @"d"] isEqual: d] == NO)
+	  {
+	    NSLog(@"Retrieved date %@ does not match %@",
+	      [record objectForKey: @"d"], d);
+	  }
+      }
+
+    [db execute: @"set session sql_mode = ''", nil];
+    [db execute: @"insert into yyy (ts, dt, d) values"
+      @" ('0000-00-00 00:00:00', '0000-00-00 00:00:00', '0000-00-00')", nil];
+    records = [db query: @"select ts, dt, d from yyy"
+      @" where d = '0000-00-00'", nil];
+    if ([records count] != 1)
+      {
+	NSLog(@"Expected 1 zero date record but got %" PRIuPTR "",
+	  [records count]);
+      }
+    else
+      {
+	record = [records objectAtIndex: 0];
+	if ([[record objectForKey: @"dt"]
+	  isEqual: @"0000-00-00 00:00:00"] == NO)
+	  {
+	    NSLog(@"Retrieved zero datetime %@ is not the original text",
+	      [record objectForKey: @"dt"]);
+	  }
+	if ([[record objectForKey: @"d"] isEqual: @"0000-00-00"] == NO)
+	  {
+	    NSLog(@"Retrieved zero date %@ is not the original text",
+	      [record objectForKey: @"d"]);
+	  }
+      }
+  }
+
+  /* Check that a query with a value bound as a parameter of a cached
+   * prepared statement finds the same record each time it is run.
+   */
+  [db setOptions: [NSDictionary dictionaryWithObject: @"10"
+					      forKey: @"PreparedStatements"]];
+  for (i = 0; i < 2; i++)
+    {
+      records = [db query: @"select dt from yyy where dt = ",
+	[NSCalendarDate dateWithString: @"1999-01-01 00:00:00 +0000"
+			calendarFormat: @"%Y-%m-%d %H:%M:%S %z"], nil];
+      if ([records count] != 1)
+	{
+	  NSLog(@"Expected 1 bound date record but got %" PRIuPTR "",
+	    [records count]);
+	}
+    }
+  [db setOptions: nil];
+  [db execute: @"drop table yyy", nil];
+
   [pool release];
   return 0;
 }
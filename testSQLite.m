@@ -26,6 +26,286 @@
 #import	<Foundation/Foundation.h>
 #import	"SQLClient.h"
 
+/* Exercises a pool from several threads at once, counting failures.
+ */
+@interface	PoolTester : NSObject
+{
+@public
+  SQLClientPool	*pool;
+  NSCondition	*cond;
+  unsigned	running;
+  unsigned	failures;
+  SQLClient	*handed;
+}
+- (void) fail: (NSString*)msg;
+- (void) run: (id)ignored;
+- (void) waitForClient: (id)ignored;
+@end
+
+@implementation	PoolTester
+- (void) fail: (NSString*)msg
+{
+  [cond lock];
+  failures++;
+  [cond unlock];
+  NSLog(@"%@", msg);
+}
+
+/* Repeatedly obtains clients from the pool (shared and exclusive) and
+ * uses them, checking that a shared client is provided again to the
+ * same thread.
+ */
+- (void) run: (id)ignored
+{
+  NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+  unsigned		i;
+
+  for (i = 0; i < 50; i++)
+    {
+      NSAutoreleasePool	*inner = [NSAutoreleasePool new];
+
+      NS_DURING
+	{
+	  SQLClient	*shared = [pool provideClient];
+	  SQLClient	*again = [pool provideClient];
+	  SQLClient	*exclusive;
+
+	  if (shared != again)
+	    {
+	      [self fail: @"Pool provided different shared clients"];
+	    }
+	  if ([[shared queryString: @"SELECT 1", nil] intValue] != 1)
+	    {
+	      [self fail: @"Query using pool client failed"];
+	    }
+	  [pool swallowClient: again];
+	  [pool swallowClient: shared];
+
+	  /* Clients are returned before asking for another, so threads
+	   * never hold one client while waiting for a second.
+	   */
+	  exclusive = [pool provideClientBeforeDate:
+	    [NSDate dateWithTimeIntervalSinceNow: 10.0] exclusive: YES];
+	  if (nil == exclusive)
+	    {
+	      [self fail: @"Timed out waiting for exclusive client"];
+	    }
+	  else
+	    {
+	      if ([[exclusive queryString: @"SELECT 2", nil] intValue] != 2)
+		{
+		  [self fail: @"Query using exclusive client failed"];
+		}
+	      [pool swallowClient: exclusive];
+	    }
+	}
+      NS_HANDLER
+	{
+	  [self fail: [NSString stringWithFormat: @"Pool thread: %@",
+	    localException]];
+	}
+      NS_ENDHANDLER
+      [inner release];
+    }
+  [cond lock];
+  running--;
+  [cond broadcast];
+  [cond unlock];
+  [arp release];
+}
+
+/* Waits for a client when the pool is exhausted, recording the client
+ * handed to us.
+ */
+- (void) waitForClient: (id)ignored
+{
+  NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+  SQLClient		*c;
+
+  c = [pool provideClientBeforeDate:
+    [NSDate dateWithTimeIntervalSinceNow: 10.0] exclusive: YES];
+  [cond lock];
+  handed = [c retain];
+  running--;
+  [cond broadcast];
+  [cond unlock];
+  [pool swallowClient: c];
+  [arp release];
+}
+@end
+
+/* Tests provision of clients from a pool by several threads at once and
+ * the handing of a returned client to a waiting thread.
+ */
+static void
+testPool()
+{
+  NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+  PoolTester		*t = [[PoolTester new] autorelease];
+  SQLClient		*held[3];
+  SQLClient		*other;
+  NSDate		*when;
+  unsigned		i;
+
+  t->pool = [[[SQLClientPool alloc] initWithConfiguration: nil
+    name: @"test" max: 3 min: 1] autorelease];
+  t->cond = [[NSCondition new] autorelease];
+
+  t->running = 8;
+  for (i = 0; i < 8; i++)
+    {
+      [NSThread detachNewThreadSelector: @selector(run:)
+			       toTarget: t
+			     withObject: nil];
+    }
+  when = [NSDate dateWithTimeIntervalSinceNow: 60.0];
+  [t->cond lock];
+  while (t->running > 0 && [when timeIntervalSinceNow] > 0.0)
+    {
+      [t->cond waitUntilDate: when];
+    }
+  [t->cond unlock];
+  if (t->running > 0)
+    {
+      NSLog(@"Pool threads did not finish: %@", [t->pool statistics]);
+      [arp release];
+      return;
+    }
+  if ([t->pool availableConnections] != 3)
+    {
+      NSLog(@"Expected 3 available clients after threads but got %d",
+	[t->pool availableConnections]);
+    }
+
+  /* Exhaust the pool, then check that a request times out and that a
+   * client returned to the pool is handed to a waiting thread.
+   */
+  for (i = 0; i < 3; i++)
+    {
+      held[i] = [[t->pool provideClientExclusive] retain];
+    }
+  if (nil != [t->pool tryProvideClientExclusive])
+    {
+      NSLog(@"Exhausted pool provided a client");
+    }
+  if (nil != [t->pool provideClientBeforeDate:
+    [NSDate dateWithTimeIntervalSinceNow: 0.1] exclusive: YES])
+    {
+      NSLog(@"Exhausted pool provided a client before timeout");
+    }
+  t->running = 1;
+  [NSThread detachNewThreadSelector: @selector(waitForClient:)
+			   toTarget: t
+			 withObject: nil];
+  when = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+  while ([t->pool waiting] == 0 && [when timeIntervalSinceNow] > 0.0)
+    {
+      [NSThread sleepUntilDate: [NSDate dateWithTimeIntervalSinceNow: 0.01]];
+    }
+  [t->pool swallowClient: held[1]];
+  when = [NSDate dateWithTimeIntervalSinceNow: 10.0];
+  [t->cond lock];
+  while (t->running > 0 && [when timeIntervalSinceNow] > 0.0)
+    {
+      [t->cond waitUntilDate: when];
+    }
+  [t->cond unlock];
+  if (t->handed != held[1])
+    {
+      NSLog(@"Waiting thread was not handed the returned client");
+    }
+  [t->handed release];
+  [t->pool swallowClient: held[0]];
+  [t->pool swallowClient: held[2]];
+  for (i = 0; i < 3; i++)
+    {
+      [held[i] release];
+    }
+
+  other = [[[SQLClient alloc] initWithConfiguration: nil
+    name: @"test"] autorelease];
+  if (YES == [t->pool swallowClient: other])
+    {
+      NSLog(@"Pool swallowed a client it does not own");
+    }
+  if ([t->pool availableConnections] != 3)
+    {
+      NSLog(@"Expected 3 available clients at end but got %d",
+	[t->pool availableConnections]);
+    }
+  if (t->failures > 0)
+    {
+      NSLog(@"Pool threads had %u failures: %@",
+	t->failures, [t->pool statistics]);
+    }
+  [arp release];
+}
+
+/* Tests coalescing of inserts in a batch and the isolation of a failing
+ * insert using savepoints.
+ */
+static void
+testBatch(SQLClient *db)
+{
+  NSAutoreleasePool	*arp = [NSAutoreleasePool new];
+  SQLTransaction	*t;
+  SQLTransaction	*failures;
+  unsigned		done;
+  unsigned		i;
+
+  NS_DURING
+  [db execute: @"drop table zzz", nil];
+  NS_HANDLER
+  NS_ENDHANDLER
+  [db execute: @"create table zzz (k int primary key, v char(8))", nil];
+
+  /* Consecutive inserts into the same table and columns are coalesced
+   * into a single statement.
+   */
+  t = [db batch: NO];
+  [t setCoalesceInserts: 1000];
+  for (i = 1; i <= 4; i++)
+    {
+      [t add: [NSString stringWithFormat:
+        @"insert into zzz (k, v) values (%u, 'v%u')", i, i], nil];
+    }
+  done = [t executeBatch];
+  if (4 != done
+    || [[db queryString: @"select count(*) from zzz", nil] intValue] != 4)
+    {
+      NSLog(@"Expected 4 coalesced inserts but executed %u", done);
+    }
+
+  /* A duplicate key fails the coalesced insert, so the batch is retried
+   * using savepoints until the failing insert is isolated.
+   */
+  t = [db batch: NO];
+  [t setCoalesceInserts: 1000];
+  [t setUseSavepoints: YES];
+  [t add: @"insert into zzz (k, v) values (5, 'v5')", nil];
+  [t add: @"insert into zzz (k, v) values (6, 'v6')", nil];
+  [t add: @"insert into zzz (k, v) values (2, 'dup')", nil];
+  [t add: @"insert into zzz (k, v) values (7, 'v7')", nil];
+  [t add: @"insert into zzz (k, v) values (8, 'v8')", nil];
+  failures = [db transaction];
+  done = [t executeBatchReturningFailures: failures logExceptions: NO];
+  if (4 != done || 1 != [failures totalCount])
+    {
+      NSLog(@"Expected 4 inserts and 1 failure using savepoints"
+        @" but got %u and %u", done, [failures totalCount]);
+    }
+  if ([[db queryString: @"select count(*) from zzz", nil] intValue] != 8
+    || NO == [[db queryString: @"select v from zzz where k = 2", nil]
+    isEqual: @"v2"])
+    {
+      NSLog(@"Savepoint batch did not keep the successful inserts: %@",
+        [db query: @"select * from zzz order by k", nil]);
+    }
+
+  [db execute: @"drop table zzz", nil];
+  [arp release];
+}
+
 int
 main()
 {
@@ -37,6 +317,8 @@ main()
   unsigned char		dbuf[256];
   unsigned int		i;
   NSData		*data;
+  NSDate		*when;
+  NSUInteger		hits;
 
   defs = [NSUserDefaults standardUserDefaults];
   [defs registerDefaults:
@@ -123,6 +405,109 @@ main()
 
   NSLog(@"Records - %@", records);
 
+  /* Values passed to an execute or a query are bound to the statement
+   * rather than quoted into it, so the compiled statement is reused.
+   */
+  [SQLClient setAutoquote: YES];
+  NS_DURING
+  [db execute: @"drop table yyy", nil];
+  NS_HANDLER
+  NS_ENDHANDLER
+  [db execute: @"create table yyy (k char(40), intval int, realval real)",
+    nil];
+  when = [NSDate dateWithTimeIntervalSinceReferenceDate: 12345.5];
+  [db execute: @"insert into yyy (k, intval, realval) values (",
+    [NSString stringWithFormat: @"it's %u", 1], @", ",
+    [NSNumber numberWithInt: 1], @", ",
+    when, @")",
+    nil];
+  hits = [[[db metrics] objectForKey: @"StatementCacheHits"]
+    unsignedIntegerValue];
+  for (i = 2; i <= 5; i++)
+    {
+      [db execute: @"insert into yyy (k, intval, realval) values (",
+        [NSString stringWithFormat: @"it's %u", i], @", ",
+        [NSNumber numberWithInt: i], @", ",
+        [NSNumber numberWithDouble: i + 0.5], @")",
+        nil];
+    }
+  if ([[[db metrics] objectForKey: @"StatementCacheHits"]
+    unsignedIntegerValue] != hits + 4)
+    {
+      NSLog(@"Expected 4 statement cache hits but metrics are %@",
+        [db metrics]);
+    }
+
+  records = [db query: @"select * from yyy where intval = ",
+    [NSNumber numberWithInt: 1], @" or k = ",
+    [NSString stringWithFormat: @"it's %u", 3],
+    @" order by intval", nil];
+  if ([records count] != 2)
+    {
+      NSLog(@"Expected 2 records from query with arguments but got %"
+        PRIuPTR "", [records count]);
+    }
+  else
+    {
+      record = [records objectAtIndex: 0];
+      if ([[record objectForKey: @"k"] isEqual: @"it's 1"] == NO
+        || [[record objectForKey: @"intval"] intValue] != 1
+        || [[record objectForKey: @"realval"] doubleValue]
+        != [when timeIntervalSinceReferenceDate])
+        {
+          NSLog(@"Retrieved bound values do not match saved values %@",
+            record);
+        }
+      record = [records objectAtIndex: 1];
+      if ([[record objectForKey: @"k"] isEqual: @"it's 3"] == NO
+        || [[record objectForKey: @"intval"] intValue] != 3
+        || [[record objectForKey: @"realval"] doubleValue] != 3.5)
+        {
+          NSLog(@"Retrieved bound values do not match saved values %@",
+            record);
+        }
+    }
+  if ([[db queryString: @"select count(*) from yyy where k = ",
+    [NSString stringWithFormat: @"it's %u", 5], nil] intValue] != 1)
+    {
+      NSLog(@"Query string with arguments did not find the record");
+    }
+  hits = [[[db metrics] objectForKey: @"StatementCacheHits"]
+    unsignedIntegerValue];
+  for (i = 2; i <= 5; i++)
+    {
+      records = [db query: @"select * from yyy where intval = ",
+        [NSNumber numberWithInt: i], nil];
+      if ([records count] != 1
+        || [[[records lastObject] objectForKey: @"intval"] intValue] != i)
+        {
+          NSLog(@"Query with bound value %u got %@", i, records);
+        }
+    }
+  if ([[[db metrics] objectForKey: @"StatementCacheHits"]
+    unsignedIntegerValue] != hits + 3)
+    {
+      NSLog(@"Expected 3 statement cache hits for queries but metrics"
+        @" are %@", [db metrics]);
+    }
+
+  /* A decimal number is bound as text so that no precision is lost.
+   */
+  [db execute: @"insert into yyy (k, intval, realval) values (",
+    [NSDecimalNumber decimalNumberWithString: @"1234567890.123456789"],
+    @", 6, 6.5)", nil];
+  if (NO == [[db queryString: @"select k from yyy where intval = 6", nil]
+    isEqual: @"1234567890.123456789"])
+    {
+      NSLog(@"Bound decimal number lost precision: %@",
+        [db queryString: @"select k from yyy where intval = 6", nil]);
+    }
+  [db execute: @"drop table yyy", nil];
+  [SQLClient setAutoquote: NO];
+
+  testBatch(db);
+  testPool();
+
   [pool release];
   return 0;
 }